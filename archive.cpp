@@ -0,0 +1,415 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "crc32.hpp"
+#include "lzma_zip.hpp"
+#include "zstd_frames.hpp"
+
+void IndexFile::load(const std::string &p, uint64_t archive_id) {
+  loaded = true;
+  path = p;
+  id = archive_id;
+  indexes.clear();
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+    return;
+  uint32_t magic, version, n;
+  uint64_t fid;
+  if (fread(&magic, 4, 1, f) == 1 and fread(&version, 4, 1, f) == 1 and
+      fread(&fid, 8, 1, f) == 1 and fread(&n, 4, 1, f) == 1 and
+      magic == MAGIC and version == VERSION and fid == id) {
+    for (uint32_t i = 0; i < n; i++) {
+      int64_t offset;
+      InflateIndex index;
+      if (fread(&offset, 8, 1, f) != 1 or !index.load(f))
+        break;
+      indexes[offset] = std::move(index);
+    }
+  }
+  fclose(f);
+}
+
+const InflateIndex *IndexFile::add(int64_t offset,
+                                   InflateIndex &&index) noexcept {
+  InflateIndex *added = &(indexes[offset] = std::move(index));
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr)
+    return added;
+  uint32_t magic = MAGIC, version = VERSION, n = indexes.size();
+  bool ok = fwrite(&magic, 4, 1, f) == 1 and
+            fwrite(&version, 4, 1, f) == 1 and fwrite(&id, 8, 1, f) == 1 and
+            fwrite(&n, 4, 1, f) == 1;
+  for (auto it = indexes.begin(); ok and it != indexes.end(); it++)
+    ok = fwrite(&it->first, 8, 1, f) == 1 and it->second.save(f);
+  ok = fclose(f) == 0 and ok;
+  std::error_code ec;
+  if (ok)
+    fs::rename(tmp, path, ec);
+  if (!ok or ec)
+    fs::remove(tmp, ec);
+  return added;
+}
+
+int Archive::Entry::read_open(bool as_raw) {
+  raw = as_raw;
+  crc_value = 0;
+  read_bytes = 0;
+  int res = mz_zip_entry_read_open(parent, raw, nullptr);
+  if (res != MZ_OK)
+    return res;
+  return mz_zip_entry_get_info(parent, &entry);
+}
+
+const char *Archive::Entry::method_name(uint16_t method) {
+  switch (method) {
+  case MZ_COMPRESS_METHOD_STORE:
+    return "store";
+  case MZ_COMPRESS_METHOD_DEFLATE:
+    return "deflate";
+  case MZ_COMPRESS_METHOD_BZIP2:
+    return "bzip2";
+  case MZ_COMPRESS_METHOD_LZMA:
+    return "lzma";
+  case MZ_COMPRESS_METHOD_ZSTD:
+    return "zstd";
+  case MZ_COMPRESS_METHOD_XZ:
+    return "xz";
+  case MZ_COMPRESS_METHOD_AES:
+    return "aes";
+  }
+  return "unknown";
+}
+
+int64_t Archive::Entry::read_range(int64_t offt, int64_t len,
+                                   decode_sink_fn sink, void *ctx) {
+  if (entry->flag & MZ_ZIP_FLAG_ENCRYPTED or offt < 0)
+    return -1;
+  if (offt >= size() or len <= 0)
+    return 0;
+  len = std::min(len, size() - offt);
+  Range r = {archive, archive->data_offset(this), offt, len, sink, ctx, 0};
+  if (r.base == -1)
+    return -1;
+  try {
+    if (method() == MZ_COMPRESS_METHOD_STORE) {
+      PoolBuffer buf(std::min<int64_t>(len, STORED_CHUNK));
+      while (r.done < len) {
+        int64_t n = std::min<int64_t>(buf.size, len - r.done);
+        if (range_read_cb(&r, buf.get(), n, offt + r.done) != n)
+          return -1;
+        r.done += n;
+        if (!sink(ctx, buf.get(), n, r.done - n))
+          break;
+      }
+      return r.done;
+    }
+    uint32_t part_crc;
+    if (method() == MZ_COMPRESS_METHOD_LZMA) {
+      LzmaDecoder::decode(range_read_cb, &r, compressed_size(), offt + len,
+                          range_cb, &r, &part_crc);
+      return r.done;
+    }
+    if (method() == MZ_COMPRESS_METHOD_ZSTD) {
+      auto found = archive->zstd_frames.find(offset());
+      if (found == archive->zstd_frames.end()) {
+        found = archive->zstd_frames.emplace(offset(), ZstdFrames()).first;
+        try {
+          found->second.scan(range_read_cb, &r, compressed_size());
+        } catch (DecodeError &e) {
+          // decoding from the start will tell what's wrong, if anything
+          found->second.frames.clear();
+        }
+      }
+      const auto &frames = found->second.frames;
+      auto it = std::upper_bound(
+          frames.begin(), frames.end(), offt,
+          [](int64_t o, const ZstdFrames::Frame &f) { return o < f.out; });
+      int64_t in = 0, out = 0;
+      if (it != frames.begin()) {
+        in = (it - 1)->in;
+        out = (it - 1)->out;
+      }
+      ZstdFrames::decode(range_read_cb, &r, in, compressed_size(), out,
+                         range_cb, &r, &part_crc);
+      return r.done;
+    }
+    if (method() != MZ_COMPRESS_METHOD_DEFLATE)
+      return -1;
+    IndexFile *indexes = archive->index_file();
+    const InflateIndex *index = indexes->find(offset(), size(), crc());
+    InflateIndex from_start;
+    if (index == nullptr and archive->lazy_index) {
+      InflateIndex built;
+      built.build(range_read_cb, &r, compressed_size(),
+                  InflateIndex::span_for(size()));
+      if (built.out_size != size())
+        return -1;
+      index = indexes->add(offset(), std::move(built));
+    } else if (index == nullptr) {
+      // a single point at the start
+      from_start.points.push_back({0, 0, 0, {}});
+      from_start.in_size = compressed_size();
+      from_start.out_size = size();
+      index = &from_start;
+    }
+    auto it = std::upper_bound(
+        index->points.begin(), index->points.end(), offt,
+        [](int64_t o, const InflateIndex::Point &p) { return o < p.out; });
+    index->decode(range_read_cb, &r, it - index->points.begin() - 1,
+                  offt + len, range_cb, &r);
+  } catch (DecodeError &e) {
+    return -1;
+  }
+  return r.done;
+}
+
+int Archive::Entry::write_to(OutputSink *sink) {
+  std::vector<char> rbuf(RBUFSIZ);
+
+  int64_t rem_entry = entry->uncompressed_size;
+  int32_t read_entry;
+
+  while (rem_entry > 0 and !canceled()) {
+    read_entry = read(rbuf.data(), RBUFSIZ);
+    if (read_entry < 0) {
+      return -1;
+    }
+    rem_entry -= read_entry;
+
+    if (rem_entry < 0) {
+      return -1;
+    }
+
+    sink->write(rbuf.data(), read_entry);
+  }
+  return 0;
+}
+
+int Archive::Entry::r2s(std::string *str) {
+  char *rbuf = (char *)malloc(RBUFSIZ);
+  if (rbuf == nullptr) {
+    return -1;
+  }
+
+  int64_t rem_entry = entry->uncompressed_size;
+  int32_t read_entry;
+
+  while (rem_entry > 0 and !canceled()) {
+    read_entry = read(rbuf, RBUFSIZ);
+    if (read_entry < 0) {
+      return -1;
+    }
+    rem_entry -= read_entry;
+
+    if (rem_entry < 0) {
+      return -1;
+    }
+
+    str->append(rbuf, read_entry);
+  }
+  free(rbuf);
+  return 0;
+}
+
+static uint32_t le32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Where the end of central directory record says the central directory
+// starts, or -1.
+static int64_t stated_cd_offset(Mystream *s) {
+  enum { EOCD = 22, LOCATOR = 20, ZIP64_EOCD = 56, MAX_COMMENT = 0xffff };
+  int64_t tail = std::min<int64_t>(s->whole_size, EOCD + MAX_COMMENT);
+  int64_t from = s->whole_size - tail;
+  std::vector<unsigned char> buf(tail);
+  if (s->read_at((char *)buf.data(), tail, from) != tail)
+    return -1;
+  for (int64_t i = tail - EOCD; i >= 0; i--) {
+    const unsigned char *p = buf.data() + i;
+    if (le32(p) != 0x06054b50)
+      continue;
+    int64_t eocd = from + i;
+    unsigned char loc[LOCATOR], z[ZIP64_EOCD];
+    if (eocd < LOCATOR or
+        s->read_at((char *)loc, LOCATOR, eocd - LOCATOR) != LOCATOR or
+        le32(loc) != 0x07064b50)
+      return le32(p + 16);
+    // the locator's offset is shifted too, the record is usually right
+    // before it
+    int64_t at = le32(loc + 8) | (int64_t)le32(loc + 12) << 32;
+    for (int64_t z64 : {at, eocd - LOCATOR - ZIP64_EOCD}) {
+      if (z64 >= 0 and
+          s->read_at((char *)z, ZIP64_EOCD, z64) == ZIP64_EOCD and
+          le32(z) == 0x06064b50)
+        return le32(z + 48) | (int64_t)le32(z + 52) << 32;
+    }
+    return -1;
+  }
+  return -1;
+}
+
+Archive::Archive(Mystream *strm, int32_t mode) : stream(strm) {
+  zip = mz_zip_create();
+  if (zip == nullptr) {
+    throw Error();
+  }
+  mz_stream *s = strm->get_mz_stream();
+  int res = mz_zip_open(zip, s, mode);
+  if (res == MZ_OK) {
+    res = mz_zip_get_number_entry(zip, &num_entries);
+  }
+  if (res == MZ_OK) {
+    res = mz_zip_goto_first_entry(zip);
+  }
+  if (res != MZ_OK) {
+    // no destructor runs for an archive that wasn't made
+    mz_zip_close(zip);
+    mz_zip_delete(&zip);
+    throw Error();
+  }
+  // the first entry is current, so minizip's position is where it found
+  // the central directory
+  int64_t stated = stated_cd_offset(stream);
+  if (stated != -1)
+    offset_shift = entry_pos() - stated;
+  current_entry = 0;
+}
+
+Archive::~Archive() {
+  mz_zip_close(zip);
+  mz_zip_delete(&zip);
+}
+
+int64_t Archive::data_offset(Entry *e) {
+  unsigned char hdr[30];
+  int64_t at = e->offset() + offset_shift;
+  if (stream->read_at((char *)hdr, sizeof(hdr), at) != sizeof(hdr))
+    return -1;
+  if (le32(hdr) != 0x04034b50)
+    return -1;
+  uint16_t name_len = hdr[26] | hdr[27] << 8;
+  uint16_t extra_len = hdr[28] | hdr[29] << 8;
+  return at + sizeof(hdr) + name_len + extra_len;
+}
+
+int Archive::list(bool (*cb)(Entry *, void *), void *ctx) {
+  Entry e;
+  int res = go_to_first_entry(&e);
+  while (res == MZ_OK and !cancel) {
+    res = e.load_info();
+    if (res != MZ_OK)
+      return res;
+    if (!cb(&e, ctx))
+      return MZ_OK;
+    res = get_next_entry(&e);
+  }
+  return res == MZ_END_OF_LIST ? MZ_OK : res;
+}
+
+uint64_t Archive::id() {
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&h](const void *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      h ^= ((const unsigned char *)p)[i];
+      h *= 1099511628211ull;
+    }
+  };
+  for (auto &part : stream->parts) {
+    std::string name = fs::path(part.path).filename().string();
+    int64_t size = part.file_size;
+    mix(name.data(), name.size());
+    mix(&size, sizeof(size));
+  }
+  mix(&num_entries, sizeof(num_entries));
+  return h;
+}
+
+void Lister::json_string(std::string *s, const char *str) {
+  s->push_back('"');
+  for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    switch (*p) {
+    case '"':
+      s->append("\\\"");
+      break;
+    case '\\':
+      s->append("\\\\");
+      break;
+    case '\n':
+      s->append("\\n");
+      break;
+    case '\t':
+      s->append("\\t");
+      break;
+    default:
+      if (*p < 0x20) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", *p);
+        s->append(esc);
+      } else {
+        s->push_back(*p);
+      }
+    }
+  }
+  s->push_back('"');
+}
+
+void Lister::begin() {
+  rows = 0;
+  if (format == Format::JSON) {
+    fputs("[\n", out);
+  } else {
+    fputs("name\tsize\tcompressed\tratio\tmethod\tcrc\toffset\tvolume"
+          "\tvolume_offset\n",
+          out);
+  }
+}
+
+void Lister::row(Archive::Entry *e) {
+  double ratio =
+      e->size() > 0 ? (double)e->compressed_size() / (double)e->size() : 0;
+  int volume = -1;
+  int64_t volume_offset = -1;
+  if (stream != nullptr) {
+    Mystream::Part *part = stream->find_part_wofft(e->offset());
+    if (part != nullptr) {
+      volume = part - stream->parts.data();
+      volume_offset = part->local_offt(e->offset());
+    }
+  }
+  char nums[256];
+  line.clear();
+  if (format == Format::JSON) {
+    line.append(rows == 0 ? "{\"name\":" : ",\n{\"name\":");
+    json_string(&line, e->get_name());
+    snprintf(nums, sizeof(nums),
+             ",\"size\":%lld,\"compressed\":%lld,\"ratio\":%.4f,"
+             "\"method\":\"%s\",\"crc\":\"%08x\",\"offset\":%lld,"
+             "\"volume\":%d,\"volume_offset\":%lld}",
+             (long long)e->size(), (long long)e->compressed_size(), ratio,
+             Archive::Entry::method_name(e->method()), e->crc(),
+             (long long)e->offset(), volume, (long long)volume_offset);
+  } else {
+    // names can't hold a newline in TSV, escape like the JSON does
+    for (const char *p = e->get_name(); *p; p++) {
+      if (*p == '\\')
+        line.append("\\\\");
+      else if (*p == '\t')
+        line.append("\\t");
+      else if (*p == '\n')
+        line.append("\\n");
+      else
+        line.push_back(*p);
+    }
+    snprintf(nums, sizeof(nums),
+             "\t%lld\t%lld\t%.4f\t%s\t%08x\t%lld\t%d\t%lld\n",
+             (long long)e->size(), (long long)e->compressed_size(), ratio,
+             Archive::Entry::method_name(e->method()), e->crc(),
+             (long long)e->offset(), volume, (long long)volume_offset);
+  }
+  line.append(nums);
+  fwrite(line.data(), 1, line.size(), out);
+  rows++;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+// Archive walks a Mystream with minizip. IndexFile keeps inflate checkpoints
+// of its huge entries, Lister prints its central directory.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ioapi.h>
+#include <mz.h>
+#include <mz_zip.h>
+
+#include "crc32.hpp"
+#include "inflate_index.hpp"
+#include "mystream.hpp"
+#include "sink.hpp"
+#include "zstd_frames.hpp"
+
+// Inflate checkpoints of the huge entries of an archive, kept in a file next
+// to its first part so that later runs can use them from the start.
+struct IndexFile {
+  enum { MAGIC = 0x58434a5a, VERSION = 1 };
+
+  std::string path;
+  uint64_t id = 0;
+  // by local header offset
+  std::map<int64_t, InflateIndex> indexes;
+  bool loaded = false;
+
+  void load(const std::string &p, uint64_t archive_id);
+
+  // The saved index of the entry at offset, if it still matches it.
+  const InflateIndex *find(int64_t offset, int64_t size, uint32_t crc) {
+    auto it = indexes.find(offset);
+    if (it == indexes.end() or it->second.out_size != size or
+        it->second.crc != crc)
+      return nullptr;
+    return &it->second;
+  }
+
+  // Adds an index and writes the file again. Not being able to write next to
+  // the archive only means there won't be an index next time.
+  const InflateIndex *add(int64_t offset, InflateIndex &&index) noexcept;
+};
+
+struct Archive {
+  struct Error : std::exception {
+    const char *message;
+    Error(const char *m = "An error ocurred while opening the archive") {
+      message = m;
+    }
+    const char *what() const noexcept override { return message; }
+  };
+
+  void *zip;
+  Mystream *stream;
+  uint64_t num_entries;
+
+  struct Entry {
+    void *parent;
+    mz_zip_file *entry;
+    Archive *archive;
+
+    enum { RBUFSIZ = 4096 * 8 };
+    // read_range() reads stored data this much at a time
+    enum { STORED_CHUNK = 1 << 20 };
+
+    int load_info() { return mz_zip_entry_get_info(parent, &entry); }
+
+    // A raw entry is read as it is stored in the archive and minizip neither
+    // decompresses it nor checks its CRC. For stored entries it's computed in
+    // crc_value while reading, Inflater does it for deflated ones.
+    bool raw = false;
+    uint32_t crc_value = 0;
+    int64_t read_bytes = 0;
+
+    bool is_stored() {
+      return entry->compression_method == MZ_COMPRESS_METHOD_STORE and
+             !(entry->flag & MZ_ZIP_FLAG_ENCRYPTED);
+    }
+
+    // minizip checks what it reads itself. A raw entry has to have been read
+    // to its full size, a short read fails like a bad CRC.
+    bool crc_ok() {
+      return !raw or (read_bytes == entry->uncompressed_size and
+                      crc_value == entry->crc);
+    }
+
+    int read(char *buf, int32_t len) {
+      int32_t n = mz_zip_entry_read(parent, buf, len);
+      if (raw and n > 0 and is_stored()) {
+        crc_value = crc32_update(crc_value, buf, n);
+        read_bytes += n;
+      }
+      return n;
+    }
+
+    int read_open(bool as_raw = false);
+
+    int read_close() {
+      return mz_zip_entry_read_close(parent, &entry->crc,
+                                     &entry->compressed_size,
+                                     &entry->uncompressed_size);
+    }
+
+    const char *get_name() { return entry->filename; }
+
+    int64_t size() { return entry->uncompressed_size; }
+
+    int64_t compressed_size() { return entry->compressed_size; }
+
+    uint32_t crc() { return entry->crc; }
+
+    uint16_t method() { return entry->compression_method; }
+
+    // offset of the local header in the whole (multi-part) stream
+    int64_t offset() { return entry->disk_offset; }
+
+    time_t mtime() { return entry->modified_date; }
+
+    static const char *method_name(uint16_t method);
+
+    bool is_dir() { return !mz_zip_entry_is_dir(parent); }
+
+    bool is_symlink() { return !mz_zip_entry_is_symlink(parent); }
+
+    bool canceled() { return archive->cancel; }
+
+    // What read_range() passes on: the output in [offt, offt + len), with
+    // offsets from offt.
+    struct Range {
+      Archive *archive;
+      int64_t base;
+      int64_t offt;
+      int64_t len;
+      decode_sink_fn sink;
+      void *ctx;
+      // bytes passed on so far
+      int64_t done;
+    };
+
+    static int64_t range_read_cb(void *ctx, char *buf, int64_t len,
+                                 int64_t offt) {
+      Range *r = (Range *)ctx;
+      return r->archive->stream->read_at(buf, len, r->base + offt);
+    }
+
+    static bool range_cb(void *ctx, const char *buf, size_t len,
+                         int64_t offt) {
+      Range *r = (Range *)ctx;
+      int64_t from = std::max(offt, r->offt);
+      int64_t to = std::min<int64_t>(offt + len, r->offt + r->len);
+      if (from < to) {
+        r->done += to - from;
+        if (!r->sink(r->ctx, buf + (from - offt), to - from, from - r->offt))
+          return false;
+      }
+      return to < r->offt + r->len;
+    }
+
+    static bool copy_cb(void *ctx, const char *buf, size_t len, int64_t offt) {
+      memcpy((char *)ctx + offt, buf, len);
+      return true;
+    }
+
+    // Decodes up to len bytes at offt of the uncompressed data once and
+    // hands them to sink in order, without going through the entry from its
+    // start where it can: stored data is read in place, deflated data is
+    // inflated from the closest checkpoint before offt and zstd data from
+    // the frame offt is in, if the frames before it have their sizes. LZMA
+    // data is decoded from the start. Checkpoints are recorded on the first
+    // call if the archive has lazy_index set, otherwise only saved ones are
+    // used. Needs load_info() but not read_open(). Returns the count passed
+    // to sink, less than len if it stopped early, or -1.
+    int64_t read_range(int64_t offt, int64_t len, decode_sink_fn sink,
+                       void *ctx);
+
+    // read_range() into buf.
+    int64_t read_at(char *buf, int64_t len, int64_t offt) {
+      return read_range(offt, len, copy_cb, buf);
+    }
+
+    // Reads the entry into the file sink began last. Errors of the sink are
+    // thrown, -1 is returned if the entry can't be read.
+    int write_to(OutputSink *sink);
+
+    int r2s(std::string *str);
+  };
+
+  Entry *current_entry = nullptr;
+  // set from other threads to stop what's running
+  std::atomic<bool> cancel{false};
+  // what minizip adds to the offsets of the central directory when bytes
+  // were put in front of the archive, like a self-extractor stub
+  int64_t offset_shift = 0;
+  IndexFile indexes;
+  // frame tables of the zstd entries read_range() was used on, by local
+  // header offset
+  std::map<int64_t, ZstdFrames> zstd_frames;
+  // Entry::read_at records and saves checkpoints for entries without them.
+  bool lazy_index = false;
+
+  Archive(Mystream *strm, int32_t mode = ZLIB_FILEFUNC_MODE_READ);
+
+  ~Archive();
+
+  Archive(const Archive &) = delete;
+  Archive &operator=(const Archive &) = delete;
+
+  int go_to_first_entry(Entry *e) {
+    int res = mz_zip_goto_first_entry(zip);
+    e->parent = zip;
+    current_entry = e;
+    e->archive = this;
+    return res;
+  }
+
+  int32_t get_next_entry(Entry *e) {
+    int res = mz_zip_goto_next_entry(zip);
+    e->parent = zip;
+    current_entry = e;
+    e->archive = this;
+    return res;
+  }
+
+  // cd_pos is what entry_pos() returned while the entry was current.
+  int32_t go_to_entry(Entry *e, int64_t cd_pos) {
+    int res = mz_zip_goto_entry(zip, cd_pos);
+    e->parent = zip;
+    current_entry = e;
+    e->archive = this;
+    return res;
+  }
+
+  int64_t entry_pos() { return mz_zip_get_entry(zip); }
+
+  // Checkpoints saved next to the archive, loaded on first use.
+  IndexFile *index_file() {
+    if (!indexes.loaded)
+      indexes.load(stream->parts.front().path + ".zcidx", id());
+    return &indexes;
+  }
+
+  // Offset of the entry's data in the stream, past its local header, with
+  // offset_shift applied as minizip does.
+  int64_t data_offset(Entry *e);
+
+  // Calls cb for every entry, using the central directory only. No local
+  // header or entry data is read, so this is cheap even for huge archives.
+  int list(bool (*cb)(Entry *, void *), void *ctx);
+
+  // Identifies the archive across runs, from its part names and sizes.
+  uint64_t id();
+};
+
+// Writes Archive::list() output as TSV or as a JSON array with one entry per
+// line, one row at a time.
+struct Lister {
+  enum class Format { TSV, JSON };
+
+  Format format = Format::TSV;
+  FILE *out = stdout;
+  Mystream *stream = nullptr;
+  uint64_t rows = 0;
+  std::string line;
+
+  static void json_string(std::string *s, const char *str);
+
+  void begin();
+
+  void row(Archive::Entry *e);
+
+  void end() {
+    if (format == Format::JSON)
+      fputs(rows == 0 ? "]\n" : "\n]\n", out);
+    fflush(out);
+  }
+
+  static bool row_cb(Archive::Entry *e, void *ctx) {
+    Lister *l = (Lister *)ctx;
+    l->row(e);
+    return !ferror(l->out);
+  }
+
+  int list(Archive *a) {
+    stream = a->stream;
+    begin();
+    int res = a->list(row_cb, this);
+    end();
+    return res;
+  }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+// Synthetic archives for benchmarks and regression runs. Corpus writes a ZIP
+// from a CorpusSpec and split_volumes() cuts it into parts named the way the
+// splitting tools people use name them. All randomness comes from the seed,
+// with mt19937_64 and our own distributions on top since the std ones differ
+// between standard libraries, so a spec gives the same bytes everywhere (short
+// of a libm rounding log or exp differently for lognormal sizes).
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "volumes.hpp"
+#include "zip_writer.hpp"
+
+// Fills data with size bytes that are text-like in about compressibility of
+// its 256-byte blocks and random in the rest, so deflate shrinks it roughly in
+// proportion.
+inline void corpus_data(std::vector<unsigned char> *data, size_t size,
+                        double compressibility, std::mt19937_64 *gen) {
+  static const char words[][8] = {"zip",   "part", "volume", "entry",
+                                  "frame", "data", "crc",    "\n"};
+  enum { BLOCK = 256 };
+  data->resize(size);
+  unsigned char *p = data->data();
+  for (size_t off = 0; off < size; off += BLOCK) {
+    size_t end = std::min<size_t>(off + BLOCK, size);
+    if (((*gen)() >> 11) * 0x1.0p-53 >= compressibility) {
+      for (size_t i = off; i < end; i += 8) {
+        uint64_t r = (*gen)();
+        memcpy(p + i, &r, std::min<size_t>(8, end - i));
+      }
+      continue;
+    }
+    for (size_t i = off; i < end;) {
+      uint64_t r = (*gen)();
+      const char *w = words[r % 8];
+      size_t n = std::min(strlen(w), end - i);
+      memcpy(p + i, w, n);
+      i += n;
+      if (i < end)
+        p[i++] = (r >> 8) % 16 == 0 ? '0' + (r >> 16) % 10 : ' ';
+    }
+  }
+}
+
+struct CorpusSpec {
+  enum class Sizes { FIXED, UNIFORM, LOGNORMAL };
+  enum class Method { STORE, DEFLATE, MIXED };
+
+  uint64_t seed = 1;
+  uint64_t entries = 1000;
+  // FIXED is always min_size, UNIFORM is in [min_size, max_size], LOGNORMAL
+  // is around median, clamped to [min_size, max_size]
+  Sizes sizes = Sizes::LOGNORMAL;
+  uint64_t min_size = 0;
+  uint64_t max_size = 64 << 20;
+  uint64_t median = 16 << 10;
+  double sigma = 1.5;
+  double compressibility = 0.7;
+  // files go depth folders deep at most, with fanout folders per level
+  int depth = 3;
+  int fanout = 4;
+  // share of entries that are symlinks to an earlier file
+  double symlinks = 0;
+  Method method = Method::DEFLATE;
+  int level = 6;
+};
+
+struct Corpus {
+  CorpusSpec spec;
+  std::mt19937_64 gen;
+  uint64_t files = 0;
+  uint64_t links = 0;
+  uint64_t dirs = 0;
+  uint64_t bytes = 0;
+
+  Corpus(const CorpusSpec &s) : spec(s), gen(s.seed) {}
+
+  uint64_t uniform(uint64_t n) { return n == 0 ? 0 : gen() % n; }
+
+  double real01() { return (gen() >> 11) * 0x1.0p-53; }
+
+  uint64_t next_size() {
+    switch (spec.sizes) {
+    case CorpusSpec::Sizes::FIXED:
+      return spec.min_size;
+    case CorpusSpec::Sizes::UNIFORM:
+      return spec.min_size + uniform(spec.max_size - spec.min_size + 1);
+    case CorpusSpec::Sizes::LOGNORMAL:
+      break;
+    }
+    // Box-Muller, 1 - real01() is never 0
+    double z = std::sqrt(-2 * std::log(1 - real01())) *
+               std::cos(6.283185307179586 * real01());
+    double s = std::exp(std::log((double)std::max<uint64_t>(spec.median, 1)) +
+                        spec.sigma * z);
+    if (s < spec.min_size)
+      return spec.min_size;
+    if (s > spec.max_size)
+      return spec.max_size;
+    return s;
+  }
+
+  // A folder 0 to depth levels deep, "" for the top.
+  std::string next_folder() {
+    std::string folder;
+    int d = uniform(spec.depth + 1);
+    for (int i = 0; i < d; i++)
+      folder += "d" + std::to_string(uniform(spec.fanout)) + "/";
+    return folder;
+  }
+
+  // Writes the archive to path. Folder entries come before anything in them.
+  void write(const std::string &path) {
+    ZipWriter w(path);
+    std::set<std::string> made;
+    std::vector<std::string> names;
+    std::vector<unsigned char> data;
+    char name[32];
+    for (uint64_t i = 0; i < spec.entries; i++) {
+      std::string folder = next_folder();
+      for (size_t s = folder.find('/'); s != std::string::npos;
+           s = folder.find('/', s + 1)) {
+        if (made.insert(folder.substr(0, s + 1)).second) {
+          w.add_dir(folder.substr(0, s + 1));
+          dirs++;
+        }
+      }
+      if (!names.empty() and real01() < spec.symlinks) {
+        snprintf(name, sizeof(name), "l%07llu", (unsigned long long)i);
+        // relative to the link's folder
+        std::string target;
+        for (char c : folder)
+          target += c == '/' ? "../" : "";
+        target += names[uniform(names.size())];
+        w.add_symlink(folder + name, target);
+        links++;
+        continue;
+      }
+      snprintf(name, sizeof(name), "f%07llu.%s", (unsigned long long)i,
+               spec.compressibility >= 0.5 ? "txt" : "bin");
+      corpus_data(&data, next_size(), spec.compressibility, &gen);
+      uint16_t method = ZipWriter::DEFLATE;
+      if (spec.method == CorpusSpec::Method::STORE or
+          (spec.method == CorpusSpec::Method::MIXED and gen() % 2 == 0))
+        method = ZipWriter::STORE;
+      w.add_file(folder + name, data.data(), data.size(), method, spec.level);
+      names.push_back(folder + name);
+      files++;
+      bytes += data.size();
+    }
+    w.close();
+  }
+};
+
+// Cuts the file at path into n parts of the same size, the last one shorter,
+// named after zip, and returns their paths in order. The file itself is left
+// alone, so with WINZIP names it can't be zip.
+inline std::list<std::string> split_volumes(const std::string &path,
+                                            const std::string &zip, int n,
+                                            Naming naming) {
+  std::list<std::string> parts;
+  FILE *in = fopen(path.c_str(), "rb");
+  if (in == nullptr)
+    throw ZipWriter::Error("Failed to open " + path);
+  fseeko(in, 0, SEEK_END);
+  off_t size = ftello(in);
+  fseeko(in, 0, SEEK_SET);
+  off_t part_size = std::max<off_t>(1, (size + n - 1) / n);
+  std::vector<char> buf(1 << 20);
+  for (int i = 0; i < n; i++) {
+    parts.push_back(volume_name(zip, naming, i, n));
+    if (parts.back() == path) {
+      fclose(in);
+      throw ZipWriter::Error("A part would overwrite " + path);
+    }
+    FILE *out = fopen(parts.back().c_str(), "wb");
+    if (out == nullptr) {
+      fclose(in);
+      throw ZipWriter::Error("Failed to create " + parts.back());
+    }
+    bool ok = true;
+    for (off_t left = part_size; ok and left > 0;) {
+      size_t got = fread(buf.data(), 1, std::min<off_t>(left, buf.size()), in);
+      if (got == 0)
+        break;
+      ok = fwrite(buf.data(), 1, got, out) == got;
+      left -= got;
+    }
+    if (fclose(out) != 0 or !ok) {
+      fclose(in);
+      throw ZipWriter::Error("Failed to write " + parts.back());
+    }
+  }
+  fclose(in);
+  return parts;
+}
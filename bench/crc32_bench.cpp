@@ -0,0 +1,122 @@
+// Throughput of the CRC-32 kernels in crc32.hpp next to minizip's own
+// mz_crypt_crc32_update(), which is what every extracted byte used to go
+// through. With --check it only checks the kernels this CPU has against
+// zlib's crc32(), and crc32_merge() against CRCs of whole buffers.
+
+#include "crc32.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <mz.h>
+#include <mz_crypt.h>
+#include <zlib.h>
+
+static uint32_t crc32_minizip(uint32_t crc, const void *buf, size_t len) {
+  return mz_crypt_crc32_update(crc, (const uint8_t *)buf, (int32_t)len);
+}
+
+// MB/s of fn over buffers of size bytes, run for about 200ms.
+static double measure(crc32_fn fn, const std::vector<uint8_t> &data,
+                      size_t size, uint32_t *sink) {
+  using clock = std::chrono::steady_clock;
+  uint64_t bytes = 0;
+  auto start = clock::now();
+  double elapsed = 0;
+  while (elapsed < 0.2) {
+    for (size_t off = 0; off + size <= data.size(); off += size) {
+      *sink ^= fn(*sink, data.data() + off, size);
+      bytes += size;
+    }
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  }
+  return bytes / elapsed / 1e6;
+}
+
+// Every length up to MAX_LEN at every alignment up to MAX_OFFSET, which
+// goes over the block sizes and tail handling of all kernels, once from the
+// start and once going on from an earlier CRC.
+static int check(const std::vector<Crc32Kernel> &kernels,
+                 const std::vector<uint8_t> &data) {
+  enum { MAX_LEN = 1200, MAX_OFFSET = 16 };
+  int bad = 0;
+  for (auto &k : kernels) {
+    int before = bad;
+    for (size_t off = 0; off <= MAX_OFFSET; off++) {
+      for (size_t len = 0; len <= MAX_LEN; len++) {
+        for (uint32_t seed : {0u, 0x12345678u}) {
+          uint32_t want = crc32(seed, data.data() + off, len);
+          uint32_t got = k.fn(seed, data.data() + off, len);
+          if (got != want and bad++ < 10)
+            fprintf(stderr, "%s: %08x, not %08x, at offset %zu length %zu\n",
+                    k.name, got, want, off, len);
+        }
+      }
+    }
+    printf("%s: %s\n", k.name, bad == before ? "ok" : "wrong");
+  }
+  // every split of a short buffer and a few of a long one
+  uint32_t whole = crc32(0, data.data(), MAX_LEN);
+  for (size_t a = 0; a <= MAX_LEN; a++) {
+    uint32_t merged = crc32_merge(crc32(0, data.data(), a),
+                                  crc32(0, data.data() + a, MAX_LEN - a),
+                                  MAX_LEN - a);
+    if (merged != whole and bad++ < 10)
+      fprintf(stderr, "crc32_merge: wrong at %zu of %d\n", a, MAX_LEN);
+  }
+  whole = crc32(0, data.data(), data.size());
+  for (size_t a : {(size_t)1, (size_t)4095, data.size() / 3, data.size() - 1}) {
+    uint32_t merged = crc32_merge(crc32(0, data.data(), a),
+                                  crc32(0, data.data() + a, data.size() - a),
+                                  data.size() - a);
+    if (merged != whole and bad++ < 10)
+      fprintf(stderr, "crc32_merge: wrong at %zu of %zu\n", a, data.size());
+  }
+  if (bad != 0)
+    fprintf(stderr, "%d wrong results\n", bad);
+  else
+    printf("crc32_merge: ok\n");
+  return bad != 0;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<uint8_t> data(16 << 20);
+  std::mt19937 gen(42);
+  for (auto &b : data)
+    b = gen();
+
+  std::vector<Crc32Kernel> kernels = {{"bytewise", crc32_bytewise},
+                                      {"slice-by-16", crc32_slice16}};
+  Crc32Kernel best = crc32_kernel();
+  if (best.fn != crc32_slice16)
+    kernels.push_back(best);
+#ifdef CRC32_X86
+  if (best.fn == crc32_vpclmul)
+    kernels.push_back({"pclmulqdq", crc32_pclmul});
+#endif
+  if (argc > 1 and !strcmp(argv[1], "--check"))
+    return check(kernels, data);
+  kernels.insert(kernels.begin() + 1, {"minizip", crc32_minizip});
+
+  uint32_t ref = crc32_bytewise(0, data.data(), data.size());
+  for (auto &k : kernels) {
+    if (k.fn(0, data.data(), data.size()) != ref) {
+      fprintf(stderr, "%s: wrong result\n", k.name);
+      return 1;
+    }
+  }
+
+  uint32_t sink = 0;
+  printf("%-12s %10s %12s\n", "kernel", "size", "MB/s");
+  for (size_t size : {64, 1024, 32 << 10, 1 << 20, 16 << 20}) {
+    for (auto &k : kernels) {
+      printf("%-12s %10zu %12.1f\n", k.name, size,
+             measure(k.fn, data, size, &sink));
+    }
+  }
+  printf("selected kernel: %s (%08x)\n", best.name, sink);
+  return 0;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+// Just enough of a ZIP writer to make test archives: stored and deflated
+// files, folders and symlinks with Unix attributes and a fixed date, and
+// zip64 records once sizes, offsets or the entry count need them. Everything
+// it writes is a function of its input, so the same calls give the same
+// bytes.
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "crc32.hpp"
+
+struct ZipWriter {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "Failed to write the archive") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  enum : uint16_t { STORE = 0, DEFLATE = 8 };
+  static constexpr uint64_t MAX32 = 0xffffffff;
+  // 2020-01-01 00:00:00 in DOS format
+  enum : uint16_t { DOS_TIME = 0, DOS_DATE = (40 << 9) | (1 << 5) | 1 };
+
+  struct Record {
+    std::string name;
+    uint16_t method;
+    uint32_t crc;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t mode;
+  };
+
+  FILE *f;
+  uint64_t offset = 0;
+  std::vector<Record> records;
+  std::vector<unsigned char> buf;
+
+  ZipWriter(const std::string &path) {
+    f = fopen(path.c_str(), "wb");
+    if (f == nullptr)
+      throw Error("Failed to create " + path);
+  }
+
+  ~ZipWriter() {
+    if (f != nullptr)
+      fclose(f);
+  }
+
+  void put(const void *data, size_t len) {
+    if (len != 0 and fwrite(data, 1, len, f) != len)
+      throw Error();
+    offset += len;
+  }
+
+  static void le(std::vector<unsigned char> *out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+      out->push_back(v >> (8 * i));
+  }
+
+  // Raw deflate of data at level.
+  static std::vector<unsigned char> deflate_data(const void *data, size_t len,
+                                                 int level) {
+    z_stream s = {};
+    if (deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+        Z_OK)
+      throw Error("Out of memory");
+    // avail_in and avail_out are 32 bits, so it goes in 1 GiB steps
+    const size_t step = 1 << 30;
+    std::vector<unsigned char> out(len + len / 1000 + 64);
+    const unsigned char *in = (const unsigned char *)data;
+    size_t fed = 0, made = 0;
+    int ret = Z_OK;
+    while (ret == Z_OK or ret == Z_BUF_ERROR) {
+      if (s.avail_in == 0 and fed < len) {
+        s.next_in = (unsigned char *)in + fed;
+        s.avail_in = std::min(step, len - fed);
+        fed += s.avail_in;
+      }
+      if (made == out.size())
+        out.resize(out.size() + out.size() / 4);
+      s.next_out = out.data() + made;
+      s.avail_out = std::min(step, out.size() - made);
+      ret = deflate(&s, fed == len ? Z_FINISH : Z_NO_FLUSH);
+      made = s.next_out - out.data();
+      if (ret == Z_BUF_ERROR and s.avail_in != 0)
+        break;
+    }
+    deflateEnd(&s);
+    if (ret != Z_STREAM_END)
+      throw Error("deflate failed");
+    out.resize(made);
+    return out;
+  }
+
+  // Adds an entry whose data is already compressed with method.
+  void add_raw(const std::string &name, uint16_t method, const void *data,
+               uint64_t compressed_size, uint64_t size, uint32_t crc,
+               uint32_t mode) {
+    Record r = {name, method, crc, compressed_size, size, offset, mode};
+    bool zip64 = size >= MAX32 or compressed_size >= MAX32;
+    buf.clear();
+    le(&buf, 0x04034b50, 4);
+    le(&buf, zip64 ? 45 : 20, 2);
+    le(&buf, 0x800, 2); // names are UTF-8
+    le(&buf, method, 2);
+    le(&buf, DOS_TIME, 2);
+    le(&buf, DOS_DATE, 2);
+    le(&buf, crc, 4);
+    le(&buf, zip64 ? MAX32 : compressed_size, 4);
+    le(&buf, zip64 ? MAX32 : size, 4);
+    le(&buf, name.size(), 2);
+    le(&buf, zip64 ? 20 : 0, 2);
+    buf.insert(buf.end(), name.begin(), name.end());
+    if (zip64) {
+      le(&buf, 1, 2);
+      le(&buf, 16, 2);
+      le(&buf, size, 8);
+      le(&buf, compressed_size, 8);
+    }
+    put(buf.data(), buf.size());
+    put(data, compressed_size);
+    records.push_back(r);
+  }
+
+  void add_file(const std::string &name, const void *data, uint64_t size,
+                uint16_t method = DEFLATE, int level = 6,
+                uint32_t mode = 0100644) {
+    uint32_t crc = crc32_update(0, data, size);
+    if (method == STORE) {
+      add_raw(name, STORE, data, size, size, crc, mode);
+      return;
+    }
+    std::vector<unsigned char> packed = deflate_data(data, size, level);
+    add_raw(name, DEFLATE, packed.data(), packed.size(), size, crc, mode);
+  }
+
+  // name ends with '/'
+  void add_dir(const std::string &name) {
+    add_raw(name, STORE, nullptr, 0, 0, 0, 040755);
+  }
+
+  void add_symlink(const std::string &name, const std::string &target) {
+    uint32_t crc = crc32_update(0, target.data(), target.size());
+    add_raw(name, STORE, target.data(), target.size(), target.size(), crc,
+            0120777);
+  }
+
+  // Writes the central directory and closes the file.
+  void close() {
+    uint64_t cd_offset = offset;
+    for (auto &r : records) {
+      buf.clear();
+      std::vector<unsigned char> extra;
+      if (r.size >= MAX32)
+        le(&extra, r.size, 8);
+      if (r.compressed_size >= MAX32)
+        le(&extra, r.compressed_size, 8);
+      if (r.offset >= MAX32)
+        le(&extra, r.offset, 8);
+      le(&buf, 0x02014b50, 4);
+      le(&buf, 3 << 8 | 45, 2); // made on Unix
+      le(&buf, extra.empty() ? 20 : 45, 2);
+      le(&buf, 0x800, 2);
+      le(&buf, r.method, 2);
+      le(&buf, DOS_TIME, 2);
+      le(&buf, DOS_DATE, 2);
+      le(&buf, r.crc, 4);
+      le(&buf, r.compressed_size >= MAX32 ? MAX32 : r.compressed_size, 4);
+      le(&buf, r.size >= MAX32 ? MAX32 : r.size, 4);
+      le(&buf, r.name.size(), 2);
+      le(&buf, extra.empty() ? 0 : extra.size() + 4, 2);
+      le(&buf, 0, 2); // comment
+      le(&buf, 0, 2); // disk
+      le(&buf, 0, 2); // internal attributes
+      le(&buf, (uint64_t)r.mode << 16, 4);
+      le(&buf, r.offset >= MAX32 ? MAX32 : r.offset, 4);
+      buf.insert(buf.end(), r.name.begin(), r.name.end());
+      if (!extra.empty()) {
+        le(&buf, 1, 2);
+        le(&buf, extra.size(), 2);
+        buf.insert(buf.end(), extra.begin(), extra.end());
+      }
+      put(buf.data(), buf.size());
+    }
+    uint64_t cd_size = offset - cd_offset;
+    uint64_t count = records.size();
+    buf.clear();
+    if (count >= 0xffff or cd_size >= MAX32 or cd_offset >= MAX32) {
+      uint64_t eocd64 = offset;
+      le(&buf, 0x06064b50, 4);
+      le(&buf, 44, 8);
+      le(&buf, 3 << 8 | 45, 2);
+      le(&buf, 45, 2);
+      le(&buf, 0, 4);
+      le(&buf, 0, 4);
+      le(&buf, count, 8);
+      le(&buf, count, 8);
+      le(&buf, cd_size, 8);
+      le(&buf, cd_offset, 8);
+      le(&buf, 0x07064b50, 4);
+      le(&buf, 0, 4);
+      le(&buf, eocd64, 8);
+      le(&buf, 1, 4);
+    }
+    le(&buf, 0x06054b50, 4);
+    le(&buf, 0, 2);
+    le(&buf, 0, 2);
+    le(&buf, count >= 0xffff ? 0xffff : count, 2);
+    le(&buf, count >= 0xffff ? 0xffff : count, 2);
+    le(&buf, cd_size >= MAX32 ? MAX32 : cd_size, 4);
+    le(&buf, cd_offset >= MAX32 ? MAX32 : cd_offset, 4);
+    le(&buf, 0, 2);
+    put(buf.data(), buf.size());
+    if (fclose(f) != 0) {
+      f = nullptr;
+      throw Error();
+    }
+    f = nullptr;
+  }
+};
@@ -0,0 +1,540 @@
+// Speed of the hot paths of the engine, as JSON for comparing releases:
+//
+//   mystream_read     Mystream::read() front to back and read_at() at random
+//                     offsets, over the same data cut into 1 to 256 parts
+//   cd_open           opening an archive and walking its central directory,
+//                     against the entry count
+//   extract           Extractor into an empty folder: stored, deflated, many
+//                     tiny files and one huge file
+//
+// The archives are made in a temporary folder (--dir) and deleted at the end.
+// They are read right after being written, so this measures the code and the
+// page cache rather than the disk. Each figure is the best of --runs runs.
+// With --check it only checks the choices of the daemon's Scheduler, how
+// the names and the completeness of split volumes are read and the headers
+// TarSink writes.
+//
+//   zipcombiner_bench [--scale N] [--runs N] [--dir PATH] > results.json
+//   zipcombiner_bench --check
+
+#include "corpus.hpp"
+#include "zipcombiner.hpp"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int runs = 3;
+static double scale = 1;
+static std::vector<std::string> results;
+
+static double seconds(const std::function<void()> &fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+// Best time of runs runs, with setup run untimed before each.
+static double best_of(const std::function<void()> &fn,
+                      const std::function<void()> &setup = nullptr) {
+  double best = 1e30;
+  for (int i = 0; i < runs; i++) {
+    if (setup)
+      setup();
+    best = std::min(best, seconds(fn));
+  }
+  return best;
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "zipcombiner_bench: %s\n", what);
+  exit(1);
+}
+
+// Bytes that deflate to about a third of their size, or not at all.
+static std::vector<unsigned char> make_data(size_t size, bool compressible,
+                                            uint32_t seed) {
+  std::vector<unsigned char> data;
+  std::mt19937_64 gen(seed);
+  corpus_data(&data, size, compressible ? 1 : 0, &gen);
+  return data;
+}
+
+static void remove_all(const std::list<std::string> &paths) {
+  for (auto &p : paths)
+    fs::remove(p);
+}
+
+static void add_result(const char *bench, const std::string &rest) {
+  results.push_back(std::string("{\"bench\": \"") + bench + "\", " + rest +
+                    "}");
+}
+
+static std::string fields(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static std::string fields(const char *fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+static void bench_mystream(const std::string &dir) {
+  const size_t total = 256e6 * scale;
+  const int32_t CHUNK = 64 << 10, BLOCK = 4 << 10;
+  std::string path = dir + "/stream.bin";
+  {
+    std::vector<unsigned char> data = make_data(total, false, 1);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == nullptr or fwrite(data.data(), 1, total, f) != total)
+      fail("can't write the stream data");
+    fclose(f);
+  }
+  std::vector<char> buf(CHUNK);
+  for (int n : {1, 4, 16, 64, 256}) {
+    std::list<std::string> paths =
+        split_volumes(path, path, n, Naming::SEVEN_ZIP);
+    {
+      Mystream s(&paths);
+      double seq = best_of([&] {
+        s.seek(0, MZ_SEEK_SET);
+        int64_t got = 0;
+        for (int32_t r; (r = s.read(buf.data(), CHUNK)) > 0;)
+          got += r;
+        if (got != s.whole_size)
+          fail("short sequential read");
+      });
+      // the same offsets every run and every part count
+      const int reads = 20000 * scale + 1;
+      std::vector<off_t> offsets(reads);
+      std::mt19937_64 gen(2);
+      for (auto &o : offsets)
+        o = gen() % (s.whole_size - BLOCK);
+      double seek_read = best_of([&] {
+        for (off_t o : offsets) {
+          s.seek(o, MZ_SEEK_SET);
+          if (s.read(buf.data(), BLOCK) <= 0)
+            fail("short random read");
+        }
+      });
+      double read_at = best_of([&] {
+        for (off_t o : offsets) {
+          if (s.read_at(buf.data(), BLOCK, o) != BLOCK)
+            fail("short random read");
+        }
+      });
+      add_result("mystream_read",
+                 fields("\"parts\": %d, \"part_size\": %lld, "
+                        "\"seq_mb_s\": %.1f, \"seek_read_iops\": %.0f, "
+                        "\"read_at_iops\": %.0f",
+                        n, (long long)s.parts.front().file_size,
+                        s.whole_size / seq / 1e6, reads / seek_read,
+                        reads / read_at));
+    }
+    remove_all(paths);
+  }
+  fs::remove(path);
+}
+
+// Opens the archive and reads the central directory record of every entry.
+static uint64_t open_and_list(const std::string &path) {
+  std::list<std::string> paths = {path};
+  Mystream s(&paths);
+  Archive a(&s);
+  Archive::Entry e;
+  uint64_t n = 0;
+  for (int res = a.go_to_first_entry(&e); res == MZ_OK;
+       res = a.get_next_entry(&e)) {
+    if (e.load_info() != MZ_OK)
+      fail("can't read an entry");
+    n++;
+  }
+  return n;
+}
+
+static void bench_cd_open(const std::string &dir) {
+  for (int count : {1000, 10000, 100000}) {
+    count = std::max(1, int(count * scale));
+    std::string path = dir + "/cd.zip";
+    ZipWriter w(path);
+    char name[64];
+    for (int i = 0; i < count; i++) {
+      snprintf(name, sizeof(name), "d%03d/file%07d.txt", i % 100, i);
+      w.add_file(name, name, strlen(name), ZipWriter::STORE);
+    }
+    w.close();
+    uint64_t seen = 0;
+    double t = best_of([&] { seen = open_and_list(path); });
+    if (seen != (uint64_t)count)
+      fail("wrong entry count");
+    add_result("cd_open", fields("\"entries\": %d, \"ms\": %.2f,"
+                                 " \"entries_per_s\": %.0f",
+                                 count, t * 1e3, count / t));
+    fs::remove(path);
+  }
+}
+
+struct ExtractCase {
+  const char *name;
+  int files;
+  size_t file_size;
+  uint16_t method;
+};
+
+static void bench_extract(const std::string &dir) {
+  const ExtractCase cases[] = {
+      {"stored", 64, size_t(4e6 * scale), ZipWriter::STORE},
+      {"deflated", 64, size_t(4e6 * scale), ZipWriter::DEFLATE},
+      {"tiny_files", int(20000 * scale), 512, ZipWriter::DEFLATE},
+      {"huge_file", 1, size_t(512e6 * scale), ZipWriter::DEFLATE},
+  };
+  std::string out = dir + "/out";
+  for (const ExtractCase &c : cases) {
+    std::string path = dir + "/extract.zip";
+    uint64_t bytes = 0;
+    {
+      ZipWriter w(path);
+      std::vector<unsigned char> data = make_data(c.file_size, true, 3);
+      char name[64];
+      for (int i = 0; i < c.files; i++) {
+        snprintf(name, sizeof(name), "d%02d/file%06d.txt", i % 32, i);
+        // a different first byte so the files aren't all the same
+        data[0] = 'a' + i % 26;
+        w.add_file(name, data.data(), data.size(), c.method);
+        bytes += data.size();
+      }
+      w.close();
+    }
+    // huge entries save inflate checkpoints on the first run, so the cold
+    // runs start without them and the runs that use them are reported apart
+    double cold, indexed = 0;
+    {
+      std::list<std::string> paths = {path};
+      Mystream s(&paths);
+      Archive a(&s);
+      auto run = [&] {
+        a.cancel = false;
+        Extractor x(&a, out, path);
+        x.extract();
+      };
+      cold = best_of(run, [&] {
+        fs::remove_all(out);
+        fs::remove(path + ".zcidx");
+        a.indexes = IndexFile();
+      });
+      if (fs::exists(path + ".zcidx"))
+        indexed = best_of(run, [&] { fs::remove_all(out); });
+    }
+    for (int i = 0; i < 2; i++) {
+      double t = i == 0 ? cold : indexed;
+      if (t == 0)
+        continue;
+      add_result("extract",
+                 fields("\"archive\": \"%s\", \"indexed\": %s,"
+                        " \"entries\": %d, \"bytes\": %llu,"
+                        " \"mb_s\": %.1f, \"entries_per_s\": %.0f",
+                        c.name, i == 0 ? "false" : "true", c.files,
+                        (unsigned long long)bytes, bytes / t / 1e6,
+                        c.files / t));
+    }
+    fs::remove_all(out);
+    fs::remove(path);
+    fs::remove(path + ".zcidx");
+  }
+}
+
+static std::shared_ptr<ExtractJob> job(uint64_t id, uint64_t bytes,
+                                       std::vector<uint64_t> devices,
+                                       bool cpu_bound, uint64_t queued_ns) {
+  std::shared_ptr<ExtractJob> j(new ExtractJob);
+  j->id = id;
+  j->bytes = bytes;
+  j->devices = devices;
+  j->cpu_bound = cpu_bound;
+  j->queued_ns = queued_ns;
+  return j;
+}
+
+// Scheduler::fits() and pick() on made up jobs, the devices being numbers.
+static int check_scheduler() {
+  const uint64_t now = 1000e9, fresh = now - 1e9, old = 0;
+  int bad = 0;
+  auto expect = [&](const char *what, bool ok) {
+    printf("%s: %s\n", what, ok ? "ok" : "wrong");
+    bad += !ok;
+  };
+  auto id = [](const std::shared_ptr<ExtractJob> &j) {
+    return j == nullptr ? 0 : j->id;
+  };
+
+  Scheduler s;
+  auto running = job(1, 100, {1}, false, old);
+  s.started(*running);
+  expect("an I/O job waits for another on its device",
+         !s.fits(*job(2, 1, {1, 2}, false, fresh)));
+  expect("a CPU job shares a device with an I/O job",
+         s.fits(*job(3, 1, {1}, true, fresh)));
+
+  s.queue = {job(2, 10, {2}, false, fresh), job(3, 50, {3}, true, fresh)};
+  expect("the kind fewer jobs run of goes first", id(s.pick(now)) == 3);
+  s.queue.push_front(job(4, 5, {4}, false, fresh));
+  expect("then the smallest", id(s.pick(now)) == 4);
+
+  Scheduler t;
+  t.started(*running);
+  // 5 starves and can't start, so 6 mustn't take device 3 from it
+  t.queue = {job(5, 100, {1, 3}, false, old), job(6, 1, {3}, false, fresh),
+             job(7, 50, {2}, false, fresh)};
+  expect("a starved job holds its devices", id(t.pick(now)) == 7);
+  expect("and the others wait", t.pick(now) == nullptr);
+  t.finished(*running);
+  expect("it goes first once it fits", id(t.pick(now)) == 5);
+
+  Scheduler u;
+  u.started(*running);
+  // found after the pick, 8 still holds device 3 from 9
+  u.queue = {job(9, 1, {3}, false, fresh), job(8, 100, {1, 3}, false, old)};
+  expect("a starved job later in the queue holds its devices too",
+         u.pick(now) == nullptr);
+  if (bad != 0)
+    fprintf(stderr, "%d wrong results\n", bad);
+  return bad != 0;
+}
+
+// Volume::parse() on the names volume_name() makes, and archive_complete() on
+// a set being copied in.
+static int check_volumes(const std::string &base) {
+  int bad = 0;
+  auto expect = [&](const std::string &what, bool ok) {
+    printf("%s: %s\n", what.c_str(), ok ? "ok" : "wrong");
+    bad += !ok;
+  };
+
+  const char *schemes[] = {"7-Zip", "numbered", "letters", "WinZip", "RAR"};
+  for (int k = 0; k < 5; k++) {
+    Naming naming = (Naming)k;
+    const int n = 12;
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+      Volume v;
+      std::string name = volume_name("dir/Set.zip", naming, i, n);
+      int index = naming == Naming::WINZIP and i == n - 1 ? Volume::LAST : i;
+      ok = ok and Volume::parse(name, &v) and v.base == "dir/Set" and
+           v.naming == naming and v.index == index;
+    }
+    expect(std::string(schemes[k]) + " names", ok);
+  }
+  Volume v;
+  expect("names are read in any case",
+         Volume::parse("SET.Z03", &v) and v.naming == Naming::WINZIP and
+             v.index == 2);
+  expect("other names aren't parts", !Volume::parse("notes.txt", &v) and
+                                         !Volume::parse("set.zip.1", &v) and
+                                         !Volume::parse(".zip", &v));
+
+  std::string dir = create_temp_work_dir("zccheck", base).string();
+  CorpusSpec spec;
+  spec.entries = 200;
+  spec.max_size = 64 << 10;
+  Corpus c(spec);
+  std::string path = dir + "/whole.bin";
+  c.write(path);
+  std::list<std::string> parts =
+      split_volumes(path, dir + "/set.zip", 4, Naming::SEVEN_ZIP);
+  expect("a whole set is complete", archive_complete(&parts));
+  std::list<std::string> first(parts.begin(), std::prev(parts.end()));
+  expect("a set without its last part isn't", !archive_complete(&first));
+  // the second part still being copied in
+  std::string growing = *std::next(parts.begin());
+  fs::resize_file(growing, fs::file_size(growing) / 2);
+  expect("a set with a part still growing isn't", !archive_complete(&parts));
+  fs::remove_all(dir);
+  if (bad != 0)
+    fprintf(stderr, "%d wrong results\n", bad);
+  return bad != 0;
+}
+
+struct TarEntry {
+  std::string name;
+  char type;
+  int64_t size;
+  std::string link;
+  std::string data;
+};
+
+// Reads back the ustar and pax headers of a tar stream, as far as it goes.
+// False if a checksum or a pax record length is off.
+static bool read_tar(const std::string &tar, std::vector<TarEntry> *out) {
+  const size_t BLOCK = TarSink::BLOCK;
+  auto field = [](const char *p, size_t n) {
+    return std::string(p, strnlen(p, n));
+  };
+  std::map<std::string, std::string> pax;
+  for (size_t at = 0; at + BLOCK <= tar.size();) {
+    std::string h = tar.substr(at, BLOCK);
+    at += BLOCK;
+    if (h == std::string(BLOCK, '\0'))
+      break;
+    unsigned sum = 0;
+    for (size_t i = 0; i < BLOCK; i++)
+      sum += i >= 148 and i < 156 ? ' ' : (unsigned char)h[i];
+    if (strtoul(field(&h[148], 8).c_str(), nullptr, 8) != sum)
+      return false;
+    TarEntry e;
+    e.type = h[156];
+    e.size = strtoll(field(&h[124], 12).c_str(), nullptr, 8);
+    e.name = field(&h[0], 100);
+    e.link = field(&h[157], 100);
+    if (e.type == 'x') {
+      std::string records = tar.substr(at, e.size);
+      for (size_t r = 0; r < records.size();) {
+        size_t len = strtoul(records.c_str() + r, nullptr, 10);
+        size_t space = records.find(' ', r), eq = records.find('=', r);
+        if (len == 0 or r + len > records.size() or
+            records[r + len - 1] != '\n' or eq > r + len)
+          return false;
+        pax[records.substr(space + 1, eq - space - 1)] =
+            records.substr(eq + 1, r + len - eq - 2);
+        r += len;
+      }
+      at += (e.size + BLOCK - 1) / BLOCK * BLOCK;
+      continue;
+    }
+    if (pax.count("path"))
+      e.name = pax["path"];
+    if (pax.count("linkpath"))
+      e.link = pax["linkpath"];
+    if (pax.count("size"))
+      e.size = strtoll(pax["size"].c_str(), nullptr, 10);
+    pax.clear();
+    e.data = tar.substr(std::min(at, tar.size()), e.size);
+    at += (e.size + BLOCK - 1) / BLOCK * BLOCK;
+    out->push_back(e);
+  }
+  return true;
+}
+
+// TarSink's headers for names and sizes that don't fit ustar, read back.
+static int check_tar() {
+  int bad = 0;
+  auto expect = [&](const char *what, bool ok) {
+    printf("%s: %s\n", what, ok ? "ok" : "wrong");
+    bad += !ok;
+  };
+
+  // where the length's digits carry over, 99 to 100 bytes and so on
+  bool counted = true;
+  for (size_t n = 1; n < 1100; n++) {
+    std::string pax;
+    TarSink::pax_record(&pax, "path", std::string(n, 'a'));
+    counted = counted and std::to_string(pax.size()) ==
+                              pax.substr(0, pax.find(' '));
+  }
+  expect("pax records count their own length", counted);
+
+  FILE *f = tmpfile();
+  if (f == nullptr)
+    fail("can't create a temporary file");
+  std::string long_name = std::string(60, 'd') + "/" + std::string(70, 'f');
+  std::string target = "../" + std::string(120, 't');
+  const int64_t huge = (8ll << 30) + 3;
+  {
+    TarSink t(f);
+    t.dir("d/", 0);
+    t.begin_file(long_name, 5, 1000);
+    t.write("hello", 5);
+    t.end_file();
+    t.symlink("link", target, 0);
+    // the data of this one is never written, only its header is read back
+    t.header("huge.bin", '0', huge, 0);
+    fflush(f);
+  }
+  std::string tar;
+  rewind(f);
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    tar.append(buf, n);
+  fclose(f);
+  std::vector<TarEntry> e;
+  expect("tar headers have good checksums and pax records",
+         read_tar(tar, &e));
+  expect("all entries read back", e.size() == 4);
+  if (e.size() == 4) {
+    expect("a folder", e[0].name == "d/" and e[0].type == '5');
+    expect("a name over 100 bytes", e[1].name == long_name and
+                                        e[1].type == '0' and
+                                        e[1].data == "hello");
+    expect("a link target over 100 bytes",
+           e[2].type == '2' and e[2].link == target);
+    expect("a size of 8 GiB and more", e[3].name == "huge.bin" and
+                                           e[3].size == huge);
+  }
+  if (bad != 0)
+    fprintf(stderr, "%d wrong results\n", bad);
+  return bad != 0;
+}
+
+int main(int argc, char *argv[]) {
+  std::string base = fs::temp_directory_path().string();
+  if (argc > 1 and !strcmp(argv[1], "--check")) {
+    int bad = check_scheduler() | check_tar();
+    try {
+      bad |= check_volumes(base);
+    } catch (std::exception &e) {
+      fail(e.what());
+    }
+    return bad;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--scale") and i + 1 < argc) {
+      scale = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--runs") and i + 1 < argc) {
+      runs = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "--dir") and i + 1 < argc) {
+      base = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: zipcombiner_bench [--scale N] [--runs N] [--dir PATH]\n"
+              "       zipcombiner_bench --check\n");
+      return 2;
+    }
+  }
+  if (scale <= 0)
+    fail("--scale must be positive");
+  std::string dir;
+  try {
+    dir = create_temp_work_dir("zcbench", base).string();
+  } catch (std::exception &e) {
+    fail(e.what());
+  }
+  try {
+    bench_mystream(dir);
+    bench_cd_open(dir);
+    bench_extract(dir);
+  } catch (std::exception &e) {
+    fs::remove_all(dir);
+    fail(e.what());
+  }
+  fs::remove_all(dir);
+
+  printf("{\n  \"version\": 1,\n  \"cores\": %u,\n  \"scale\": %g,\n"
+         "  \"runs\": %d,\n  \"results\": [",
+         std::max(1u, std::thread::hardware_concurrency()), scale, runs);
+  for (size_t i = 0; i < results.size(); i++)
+    printf("%s\n    %s", i == 0 ? "" : ",", results[i].c_str());
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,202 @@
+// Writes a synthetic archive, see corpus.hpp, and optionally splits it into
+// volumes. The same options give the same files.
+//
+//   zipgen --seed 7 --entries 20000 --sizes lognormal:4096:2 --volumes 16
+//          --naming 7z corpus.zip
+
+#include "corpus.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char usage[] =
+    "Usage: zipgen [options] OUT.zip\n"
+    "  --seed N               seed of everything random (1)\n"
+    "  --entries N            number of files and symlinks (1000)\n"
+    "  --sizes DIST           fixed:N, uniform:MIN:MAX or\n"
+    "                         lognormal:MEDIAN:SIGMA[:MIN:MAX]\n"
+    "                         (lognormal:16384:1.5)\n"
+    "  --compressibility R    0 for random data to 1 for text (0.7)\n"
+    "  --depth N              folder levels at most (3)\n"
+    "  --fanout N             folders per level (4)\n"
+    "  --symlinks R           share of entries that are symlinks (0)\n"
+    "  --method M             store, deflate or mixed (deflate)\n"
+    "  --level N              deflate level (6)\n"
+    "  --volumes N            split into N parts (1, no split)\n"
+    "  --naming S             part names: 7z (OUT.zip.001), num (OUT.001),\n"
+    "                         letters (OUT.zip.aa), winzip (OUT.z01..OUT.zip),\n"
+    "                         rar (OUT.part1.zip) (7z)\n"
+    "Sizes take k, m and g suffixes.\n";
+
+static void bad(const char *opt) {
+  fprintf(stderr, "zipgen: bad value for %s\n%s", opt, usage);
+  exit(2);
+}
+
+static uint64_t parse_size(const char *s, const char *opt) {
+  char *end;
+  double v = strtod(s, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    v *= 1 << 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    v *= 1 << 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    v *= 1 << 30;
+    end++;
+    break;
+  }
+  if (end == s or (*end != 0 and *end != ':') or v < 0)
+    bad(opt);
+  return v;
+}
+
+// The fields of a DIST after its name, split at ':'.
+static std::vector<std::string> fields(const std::string &dist) {
+  std::vector<std::string> out;
+  size_t at = dist.find(':');
+  while (at != std::string::npos) {
+    size_t next = dist.find(':', at + 1);
+    out.push_back(dist.substr(at + 1, next - at - 1));
+    at = next;
+  }
+  return out;
+}
+
+static void parse_sizes(CorpusSpec *spec, const std::string &dist) {
+  const char *opt = "--sizes";
+  std::vector<std::string> f = fields(dist);
+  if (dist.rfind("fixed:", 0) == 0 and f.size() == 1) {
+    spec->sizes = CorpusSpec::Sizes::FIXED;
+    spec->min_size = parse_size(f[0].c_str(), opt);
+  } else if (dist.rfind("uniform:", 0) == 0 and f.size() == 2) {
+    spec->sizes = CorpusSpec::Sizes::UNIFORM;
+    spec->min_size = parse_size(f[0].c_str(), opt);
+    spec->max_size = parse_size(f[1].c_str(), opt);
+  } else if (dist.rfind("lognormal:", 0) == 0 and
+             (f.size() == 2 or f.size() == 4)) {
+    spec->sizes = CorpusSpec::Sizes::LOGNORMAL;
+    spec->median = parse_size(f[0].c_str(), opt);
+    spec->sigma = atof(f[1].c_str());
+    if (f.size() == 4) {
+      spec->min_size = parse_size(f[2].c_str(), opt);
+      spec->max_size = parse_size(f[3].c_str(), opt);
+    }
+  } else {
+    bad(opt);
+  }
+  if (spec->min_size > spec->max_size)
+    bad(opt);
+}
+
+int main(int argc, char *argv[]) {
+  CorpusSpec spec;
+  int volumes = 1;
+  Naming naming = Naming::SEVEN_ZIP;
+  std::string out;
+  for (int i = 1; i < argc; i++) {
+    std::string opt = argv[i];
+    if (opt == "-h" or opt == "--help") {
+      fputs(usage, stdout);
+      return 0;
+    }
+    if (opt.rfind("--", 0) != 0) {
+      if (!out.empty())
+        bad("OUT.zip");
+      out = opt;
+      continue;
+    }
+    if (i + 1 >= argc)
+      bad(argv[i]);
+    const char *v = argv[++i];
+    if (opt == "--seed") {
+      spec.seed = strtoull(v, nullptr, 10);
+    } else if (opt == "--entries") {
+      spec.entries = strtoull(v, nullptr, 10);
+    } else if (opt == "--sizes") {
+      parse_sizes(&spec, v);
+    } else if (opt == "--compressibility") {
+      spec.compressibility = atof(v);
+      if (spec.compressibility < 0 or spec.compressibility > 1)
+        bad(argv[i - 1]);
+    } else if (opt == "--depth") {
+      spec.depth = std::max(0, atoi(v));
+    } else if (opt == "--fanout") {
+      spec.fanout = std::max(1, atoi(v));
+    } else if (opt == "--symlinks") {
+      spec.symlinks = atof(v);
+    } else if (opt == "--method") {
+      if (!strcmp(v, "store"))
+        spec.method = CorpusSpec::Method::STORE;
+      else if (!strcmp(v, "deflate"))
+        spec.method = CorpusSpec::Method::DEFLATE;
+      else if (!strcmp(v, "mixed"))
+        spec.method = CorpusSpec::Method::MIXED;
+      else
+        bad(argv[i - 1]);
+    } else if (opt == "--level") {
+      spec.level = atoi(v);
+      if (spec.level < 0 or spec.level > 9)
+        bad(argv[i - 1]);
+    } else if (opt == "--volumes") {
+      volumes = atoi(v);
+      if (volumes < 1)
+        bad(argv[i - 1]);
+    } else if (opt == "--naming") {
+      if (!strcmp(v, "7z"))
+        naming = Naming::SEVEN_ZIP;
+      else if (!strcmp(v, "num"))
+        naming = Naming::NUMBERED;
+      else if (!strcmp(v, "letters"))
+        naming = Naming::LETTERS;
+      else if (!strcmp(v, "winzip"))
+        naming = Naming::WINZIP;
+      else if (!strcmp(v, "rar"))
+        naming = Naming::RAR_STYLE;
+      else
+        bad(argv[i - 1]);
+    } else {
+      fprintf(stderr, "zipgen: unknown option %s\n%s", opt.c_str(), usage);
+      return 2;
+    }
+  }
+  if (out.empty()) {
+    fputs(usage, stderr);
+    return 2;
+  }
+  if (naming == Naming::LETTERS and volumes > 26 * 26)
+    bad("--volumes");
+
+  Corpus corpus(spec);
+  // a split archive is written next to its parts first and removed after
+  std::string whole = volumes > 1 ? out + ".whole" : out;
+  try {
+    corpus.write(whole);
+    if (volumes > 1) {
+      std::list<std::string> parts = split_volumes(whole, out, volumes, naming);
+      remove(whole.c_str());
+      for (auto &p : parts)
+        printf("%s\n", p.c_str());
+    } else {
+      printf("%s\n", out.c_str());
+    }
+  } catch (std::exception &e) {
+    remove(whole.c_str());
+    fprintf(stderr, "zipgen: %s\n", e.what());
+    return 1;
+  }
+  fprintf(stderr, "%llu files, %llu symlinks, %llu folders, %llu bytes\n",
+          (unsigned long long)corpus.files, (unsigned long long)corpus.links,
+          (unsigned long long)corpus.dirs, (unsigned long long)corpus.bytes);
+  return 0;
+}
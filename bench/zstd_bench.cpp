@@ -0,0 +1,108 @@
+// Decoding speed of zstd entry data with ZstdFrames: one frame, which can
+// only be decoded on one thread, and the same data as independent 4 MiB
+// frames decoded on 1, 2, 4... threads, with the speedup over one thread.
+
+#include "zstd_frames.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static std::vector<char> packed;
+
+static int64_t read_cb(void *ctx, char *buf, int64_t len, int64_t offt) {
+  (void)ctx;
+  len = std::min<int64_t>(len, packed.size() - offt);
+  memcpy(buf, packed.data() + offt, len);
+  return len;
+}
+
+static bool sink_cb(void *ctx, const char *buf, size_t len, int64_t offt) {
+  memcpy((char *)ctx + offt, buf, len);
+  return true;
+}
+
+// Text-like data that compresses about 3:1.
+static std::vector<char> make_data(size_t size) {
+  static const char words[][8] = {"zip",   "part", "volume", "entry",
+                                  "frame", "data", "crc",    "\n"};
+  std::vector<char> data;
+  data.reserve(size + 8);
+  std::mt19937 gen(42);
+  while (data.size() < size) {
+    const char *w = words[gen() % 8];
+    data.insert(data.end(), w, w + strlen(w));
+    data.push_back(gen() % 16 == 0 ? '0' + gen() % 10 : ' ');
+  }
+  data.resize(size);
+  return data;
+}
+
+static std::vector<char> compress(const std::vector<char> &data,
+                                  size_t frame) {
+  std::vector<char> out;
+  std::vector<char> tmp(ZSTD_compressBound(frame));
+  for (size_t off = 0; off < data.size(); off += frame) {
+    size_t n = std::min(frame, data.size() - off);
+    size_t r = ZSTD_compress(tmp.data(), tmp.size(), data.data() + off, n, 3);
+    if (ZSTD_isError(r)) {
+      fprintf(stderr, "%s\n", ZSTD_getErrorName(r));
+      exit(1);
+    }
+    out.insert(out.end(), tmp.begin(), tmp.begin() + r);
+  }
+  return out;
+}
+
+// MB/s of output, best of three runs.
+static double measure(const ZstdFrames &frames, unsigned threads,
+                      const std::vector<char> &data) {
+  std::vector<char> out(data.size());
+  double best = 0;
+  for (int run = 0; run < 3; run++) {
+    uint32_t crc;
+    auto start = std::chrono::steady_clock::now();
+    frames.decode_all(read_cb, nullptr, threads, sink_cb, out.data(), &crc);
+    auto end = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(end - start).count();
+    if (out != data) {
+      fprintf(stderr, "wrong output with %u threads\n", threads);
+      exit(1);
+    }
+    best = std::max(best, data.size() / s / 1e6);
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = (argc > 1 ? atoi(argv[1]) : 256) << 20;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<char> data = make_data(size);
+
+  packed = compress(data, size);
+  ZstdFrames single;
+  single.scan(read_cb, nullptr, packed.size());
+  printf("%-16s %8s %12s %8s\n", "data", "threads", "MB/s", "speedup");
+  printf("%-16s %8u %12.1f %8s\n", "1 frame", 1, measure(single, 1, data),
+         "-");
+
+  packed = compress(data, 4 << 20);
+  ZstdFrames framed;
+  framed.scan(read_cb, nullptr, packed.size());
+  char name[32];
+  snprintf(name, sizeof(name), "%zu frames", framed.frames.size());
+  std::vector<unsigned> counts;
+  for (unsigned t = 1; t < cores; t *= 2)
+    counts.push_back(t);
+  counts.push_back(cores);
+  double base = 0;
+  for (unsigned t : counts) {
+    double mbs = measure(framed, t, data);
+    if (t == 1)
+      base = mbs;
+    printf("%-16s %8u %12.1f %7.2fx\n", name, t, mbs, mbs / base);
+  }
+  return 0;
+}
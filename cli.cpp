@@ -0,0 +1,534 @@
+#include "cli.hpp"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+Extractor *Cli::running = nullptr;
+StreamExtractor *Cli::streaming = nullptr;
+
+int Cli::usage(FILE *out) {
+  fprintf(out,
+          "usage: ZipCombiner extract [options] -o DIR ZIP...\n"
+          "       ZipCombiner extract --tar [options] ZIP... > TAR\n"
+          "       ZipCombiner list [--json|--tsv] ZIP...\n"
+          "       ZipCombiner test [--each] [-j N] ZIP...\n"
+          "       ZipCombiner cat [options] ENTRY ZIP...\n"
+          "       ZipCombiner daemon [options]\n"
+          "\n"
+          "  --trace FILE           write a Chrome/Perfetto trace of where\n"
+          "                         the time went, with any command\n"
+          "  --max-mem SIZE         memory for buffers at most, like 512M,\n"
+          "                         work waits for it when it runs out\n"
+          "\n"
+          "All ZIPs are parts of a single archive unless --each is given.\n"
+          "extract reads the archive from standard input if ZIP is -.\n"
+          "\n"
+          "extract:\n"
+          "  -o, --output DIR       folder to extract to\n"
+          "  --tar                  write a tar stream to standard output\n"
+          "                         instead of files; entries of unknown\n"
+          "                         size are held until they end, in\n"
+          "                         memory up to 64M or --max-mem and in\n"
+          "                         a temporary file past that\n"
+          "  --each                 treat every ZIP as a full archive\n"
+          "  -i, --include PATTERN  only extract matching entries\n"
+          "  -x, --exclude PATTERN  skip matching entries, PATTERN is a\n"
+          "                         glob, re:REGEX or @LISTFILE\n"
+          "  --keep                 don't overwrite existing files\n"
+          "  --skip-unchanged[=crc] skip files whose size and date (or\n"
+          "                         CRC) already match\n"
+          "  --resume               keep a journal and resume\n"
+          "                         interrupted runs\n"
+          "  --sync none|file|batch|end\n"
+          "                         when to flush extracted data to disk\n"
+          "  --metrics FILE         write bytes, calls, waits and entry\n"
+          "                         latencies of each archive as JSON,\n"
+          "                         - for standard error\n"
+          "\n"
+          "list:\n"
+          "  --json, --tsv          output format, TSV by default\n"
+          "\n"
+          "test:\n"
+          "  -j, --jobs N           threads to use, all cores by default\n"
+          "  --each                 treat every ZIP as a full archive\n"
+          "\n"
+          "cat:\n"
+          "  --offset N             start N bytes into the entry\n"
+          "  --length N             write at most N bytes\n"
+          "  --index                save inflate checkpoints next to the\n"
+          "                         archive to speed up later reads\n"
+          "\n"
+          "daemon:\n"
+          "  --listen ADDR          HOST:PORT or PORT on a loopback address,\n"
+          "                         or the path of a Unix socket\n"
+          "                         (127.0.0.1:9410)\n"
+          "  --watch DIR            extract the split archives that show\n"
+          "                         up in DIR once all their parts are\n"
+          "                         there, can be given more than once\n"
+          "  -o, --output DIR       where they go, in a folder each, next\n"
+          "                         to their parts by default\n"
+          "  -j, --jobs N           archives to extract at once (2)\n"
+          "  --queue N              archives waiting at most (64)\n"
+          "  --per-device N         archives to extract at once from or to\n"
+          "                         one disk, apart for CPU and I/O bound\n"
+          "                         ones (1)\n"
+          "  --readahead BYTES      read-ahead of each archive (262144)\n"
+          "GET /metrics for Prometheus, GET /jobs for the jobs as JSON and,\n"
+          "on a Unix socket only, POST /jobs with the output folder and the\n"
+          "parts, one a line, to extract an archive.\n");
+  return out == stderr ? 2 : 0;
+}
+
+bool Cli::value(const char *name, const char *short_name, std::string *out) {
+  const char *arg = argv[i];
+  size_t len = strlen(name);
+  if (!strncmp(arg, name, len) and arg[len] == '=') {
+    *out = arg + len + 1;
+    return true;
+  }
+  if (strcmp(arg, name) and
+      (short_name == nullptr or strcmp(arg, short_name)))
+    return false;
+  if (i + 1 >= argc)
+    throw Extractor::Error(std::string("missing value for ") + arg);
+  *out = argv[++i];
+  return true;
+}
+
+void Cli::extract_one(std::list<std::string> *parts, std::string zip,
+                      Job *job) {
+  Mystream z(parts);
+  Archive a(&z);
+  std::unique_ptr<Extractor> xp;
+  if (job->sink != nullptr)
+    xp.reset(new Extractor(&a, job->sink, zip));
+  else
+    xp.reset(new Extractor(&a, job->out_dir, zip));
+  Extractor &x = *xp;
+  setup(&x, job);
+  running = &x;
+  try {
+    x.extract(progress_cb, exists_cb, job);
+  } catch (...) {
+    job->report(zip, x.metrics, false);
+    throw;
+  }
+  running = nullptr;
+  job->report(zip, x.metrics, true);
+}
+
+void Cli::Job::report(const std::string &zip, const JobMetrics &m, bool ok) {
+  // parts of a single archive go by the name of the first one
+  reports.push_back(m.report(zip.empty() ? parts.front() : zip, ok));
+}
+
+bool Cli::Job::save_reports() {
+  if (metrics_path.empty())
+    return true;
+  FILE *f = metrics_path == "-" ? stderr : fopen(metrics_path.c_str(), "w");
+  if (f == nullptr)
+    return false;
+  fputs(JobMetrics::run_json(reports).c_str(), f);
+  return f == stderr ? fflush(f) == 0 : fclose(f) == 0;
+}
+
+int Cli::extract_stream(Job *job) {
+  if (job->each or job->resumable or
+      job->incremental != Extractor::Incremental::OFF) {
+    fprintf(stderr, "--each, --resume and --skip-unchanged need files\n");
+    return 2;
+  }
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  try {
+    std::unique_ptr<StreamExtractor> xp;
+    if (job->sink != nullptr)
+      xp.reset(new StreamExtractor(fileno(stdin), job->sink));
+    else
+      xp.reset(new StreamExtractor(fileno(stdin), job->out_dir));
+    StreamExtractor &x = *xp;
+    x.syncer.policy = job->sync;
+    for (auto &f : job->filters)
+      x.filter.add(f.first, f.second);
+    streaming = &x;
+    try {
+      x.extract(progress_cb, exists_cb, job);
+    } catch (...) {
+      job->report("-", x.metrics, false);
+      throw;
+    }
+    streaming = nullptr;
+    job->report("-", x.metrics, true);
+    if (job->sink != nullptr)
+      job->sink->finish();
+  } catch (std::exception &e) {
+    streaming = nullptr;
+    fprintf(stderr, "%s\n", e.what());
+    fprintf(stderr, "Extraction completed with 1 error(s).\n");
+    job->save_reports();
+    return 1;
+  }
+  fprintf(stderr, "Extraction completed with 0 error(s).\n");
+  if (!job->save_reports()) {
+    fprintf(stderr, "Failed to write %s\n", job->metrics_path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int Cli::extract() {
+  Job job;
+  std::string v;
+  for (; i < argc; i++) {
+    const char *arg = argv[i];
+    if (value("--output", "-o", &job.out_dir)) {
+    } else if (value("--include", "-i", &v)) {
+      job.filters.push_back({v, false});
+    } else if (value("--exclude", "-x", &v)) {
+      job.filters.push_back({v, true});
+    } else if (value("--metrics", nullptr, &job.metrics_path)) {
+    } else if (value("--sync", nullptr, &v)) {
+      if (v == "none")
+        job.sync = SyncPolicy::NONE;
+      else if (v == "file")
+        job.sync = SyncPolicy::PER_FILE;
+      else if (v == "batch")
+        job.sync = SyncPolicy::BATCHED;
+      else if (v == "end")
+        job.sync = SyncPolicy::END_OF_JOB;
+      else
+        throw Extractor::Error("unknown sync policy " + v);
+    } else if (!strcmp(arg, "--skip-unchanged")) {
+      job.incremental = Extractor::Incremental::METADATA;
+    } else if (!strcmp(arg, "--skip-unchanged=crc")) {
+      job.incremental = Extractor::Incremental::CRC;
+    } else if (!strcmp(arg, "--each")) {
+      job.each = true;
+    } else if (!strcmp(arg, "--tar")) {
+      job.tar = true;
+    } else if (!strcmp(arg, "--keep")) {
+      job.keep = true;
+    } else if (!strcmp(arg, "--resume")) {
+      job.resumable = true;
+    } else if (!strcmp(arg, "-h") or !strcmp(arg, "--help")) {
+      return usage(stdout);
+    } else if (arg[0] == '-' and arg[1] != '\0') {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return usage(stderr);
+    } else {
+      job.parts.push_back(arg);
+    }
+  }
+  if ((job.out_dir.empty() and !job.tar) or job.parts.empty())
+    return usage(stderr);
+  TarSink tar(stdout);
+  if (job.tar) {
+    if (!job.out_dir.empty() or job.resumable or
+        job.incremental != Extractor::Incremental::OFF) {
+      fprintf(stderr, "--tar can't be used with -o, --resume or "
+                      "--skip-unchanged\n");
+      return 2;
+    }
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    job.sink = &tar;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  if (job.parts.size() == 1 and job.parts.front() == "-")
+    return extract_stream(&job);
+  int errors = 0;
+  if (job.each) {
+    for (auto &part : job.parts) {
+      try {
+        std::list<std::string> p = {part};
+        extract_one(&p, part, &job);
+      } catch (std::exception &e) {
+        running = nullptr;
+        fprintf(stderr, "%s: %s\n", part.c_str(), e.what());
+        errors++;
+      }
+    }
+  } else {
+    try {
+      job.parts.sort();
+      extract_one(&job.parts, "", &job);
+    } catch (std::exception &e) {
+      running = nullptr;
+      fprintf(stderr, "%s\n", e.what());
+      errors++;
+    }
+  }
+  if (job.sink != nullptr) {
+    try {
+      job.sink->finish();
+    } catch (std::exception &e) {
+      fprintf(stderr, "%s\n", e.what());
+      errors++;
+    }
+  }
+  fprintf(stderr, "Extraction completed with %d error(s).\n", errors);
+  if (!job.save_reports()) {
+    fprintf(stderr, "Failed to write %s\n", job.metrics_path.c_str());
+    errors++;
+  }
+  return errors == 0 ? 0 : 1;
+}
+
+int Cli::list() {
+  Lister lister;
+  std::list<std::string> parts;
+  for (; i < argc; i++) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--json")) {
+      lister.format = Lister::Format::JSON;
+    } else if (!strcmp(arg, "--tsv")) {
+      lister.format = Lister::Format::TSV;
+    } else if (!strcmp(arg, "-h") or !strcmp(arg, "--help")) {
+      return usage(stdout);
+    } else if (arg[0] == '-' and arg[1] != '\0') {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return usage(stderr);
+    } else {
+      parts.push_back(arg);
+    }
+  }
+  if (parts.empty())
+    return usage(stderr);
+  parts.sort();
+  Mystream z(&parts);
+  Archive a(&z);
+  if (lister.list(&a) != MZ_OK) {
+    fprintf(stderr, "Failed to read the central directory\n");
+    return 1;
+  }
+  return ferror(stdout) ? 1 : 0;
+}
+
+void Cli::report(Tester *t, const std::string &zip) {
+  for (auto &f : t->failures) {
+    if (f.name.empty()) {
+      fprintf(stderr, "%s%s%s\n", zip.c_str(), zip.empty() ? "" : ": ",
+              f.error.c_str());
+      continue;
+    }
+    printf("%s\t%s\t%lld\t%s\n", f.name.c_str(), f.volume.c_str(),
+           (long long)f.volume_offset, f.error.c_str());
+  }
+  for (auto &name : t->unchecked)
+    fprintf(stderr, "%s: encrypted, not checked\n", name.c_str());
+  fprintf(stderr, "%s%s%llu entries tested, %zu corrupt", zip.c_str(),
+          zip.empty() ? "" : ": ",
+          (unsigned long long)(t->tested - t->unchecked.size()),
+          t->failures.size());
+  if (!t->unchecked.empty())
+    fprintf(stderr, ", %zu encrypted and not checked", t->unchecked.size());
+  fprintf(stderr, ".\n");
+}
+
+int Cli::test() {
+  std::list<std::string> parts;
+  bool each = false;
+  unsigned jobs = 0;
+  std::string v;
+  for (; i < argc; i++) {
+    const char *arg = argv[i];
+    if (value("--jobs", "-j", &v)) {
+      jobs = atoi(v.c_str());
+    } else if (!strcmp(arg, "--each")) {
+      each = true;
+    } else if (!strcmp(arg, "-h") or !strcmp(arg, "--help")) {
+      return usage(stdout);
+    } else if (arg[0] == '-' and arg[1] != '\0') {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return usage(stderr);
+    } else {
+      parts.push_back(arg);
+    }
+  }
+  if (parts.empty())
+    return usage(stderr);
+
+  std::vector<std::list<std::string>> sets;
+  if (each) {
+    for (auto &part : parts)
+      sets.push_back({part});
+  } else {
+    parts.sort();
+    sets.push_back(parts);
+  }
+  size_t corrupt = 0;
+  for (auto &set : sets) {
+    Tester t(set);
+    if (jobs > 0)
+      t.threads = jobs;
+    std::string zip = each ? set.front() : "";
+    try {
+      corrupt += t.run();
+    } catch (std::exception &e) {
+      fprintf(stderr, "%s%s%s\n", zip.c_str(), zip.empty() ? "" : ": ",
+              e.what());
+      corrupt++;
+      continue;
+    }
+    report(&t, zip);
+  }
+  return corrupt == 0 ? 0 : 1;
+}
+
+int Cli::cat() {
+  std::list<std::string> parts;
+  std::string name, v;
+  int64_t offset = 0, length = -1;
+  bool index = false;
+  for (; i < argc; i++) {
+    const char *arg = argv[i];
+    if (value("--offset", nullptr, &v)) {
+      offset = strtoll(v.c_str(), nullptr, 10);
+    } else if (value("--length", nullptr, &v)) {
+      length = strtoll(v.c_str(), nullptr, 10);
+    } else if (!strcmp(arg, "--index")) {
+      index = true;
+    } else if (!strcmp(arg, "-h") or !strcmp(arg, "--help")) {
+      return usage(stdout);
+    } else if (arg[0] == '-' and arg[1] != '\0') {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return usage(stderr);
+    } else if (name.empty()) {
+      name = arg;
+    } else {
+      parts.push_back(arg);
+    }
+  }
+  if (name.empty() or parts.empty() or offset < 0)
+    return usage(stderr);
+  parts.sort();
+  Mystream z(&parts);
+  Archive a(&z);
+  a.lazy_index = index;
+  Lookup l = {name.c_str()};
+  Archive::Entry e;
+  if (a.list(lookup_cb, &l) != MZ_OK or l.cd_pos == -1 or
+      a.go_to_entry(&e, l.cd_pos) != MZ_OK or e.load_info() != MZ_OK) {
+    fprintf(stderr, "%s: no such entry\n", name.c_str());
+    return 1;
+  }
+  if (length < 0 or length > e.size() - offset)
+    length = std::max<int64_t>(0, e.size() - offset);
+  int64_t n =
+      length == 0 ? 0 : e.read_range(offset, length, stdout_cb, nullptr);
+  if (n != length) {
+    fprintf(stderr, "%s: failed to read at %lld\n", name.c_str(),
+            (long long)(offset + std::max<int64_t>(n, 0)));
+    return 1;
+  }
+  return fflush(stdout) == 0 ? 0 : 1;
+}
+
+int Cli::daemon() {
+  Daemon d;
+  Watcher w(&d);
+  std::string v;
+  for (; i < argc; i++) {
+    const char *arg = argv[i];
+    if (value("--listen", nullptr, &d.listen)) {
+    } else if (value("--watch", nullptr, &v)) {
+      w.dirs.push_back(v);
+    } else if (value("--output", "-o", &w.out_dir)) {
+    } else if (value("--jobs", "-j", &v)) {
+      d.workers = std::max(1, atoi(v.c_str()));
+    } else if (value("--queue", nullptr, &v)) {
+      d.max_queue = std::max(1, atoi(v.c_str()));
+    } else if (value("--per-device", nullptr, &v)) {
+      d.sched.per_device = std::max(1, atoi(v.c_str()));
+    } else if (value("--readahead", nullptr, &v)) {
+      d.readahead = strtoull(v.c_str(), nullptr, 10);
+    } else if (!strcmp(arg, "-h") or !strcmp(arg, "--help")) {
+      return usage(stdout);
+    } else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return usage(stderr);
+    }
+  }
+  signal(SIGINT, [](int) { Daemon::stop(); });
+  signal(SIGTERM, [](int) { Daemon::stop(); });
+  std::thread watching;
+  int res = 0;
+  try {
+    if (!w.dirs.empty()) {
+      w.open();
+      watching = std::thread(&Watcher::run, &w);
+    }
+    d.run();
+  } catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    Daemon::stop();
+    res = 1;
+  }
+  if (watching.joinable())
+    watching.join();
+  return res;
+}
+
+int Cli::run(int argc, char *argv[]) {
+  // --trace and --max-mem go with every command, so they're taken out
+  // before the commands see them
+  std::string trace, max_mem;
+  std::vector<char *> args(argv, argv + 2);
+  for (int i = 2; i < argc; i++) {
+    if (!strncmp(argv[i], "--trace=", 8))
+      trace = argv[i] + 8;
+    else if (!strcmp(argv[i], "--trace") and i + 1 < argc)
+      trace = argv[++i];
+    else if (!strncmp(argv[i], "--max-mem=", 10))
+      max_mem = argv[i] + 10;
+    else if (!strcmp(argv[i], "--max-mem") and i + 1 < argc)
+      max_mem = argv[++i];
+    else
+      args.push_back(argv[i]);
+  }
+  args.push_back(nullptr);
+  if (!max_mem.empty() and
+      !MemoryPool::parse_size(max_mem, &MemoryPool::capacity)) {
+    fprintf(stderr, "bad size %s\n", max_mem.c_str());
+    return usage(stderr);
+  }
+  if (!trace.empty())
+    Trace::start();
+  int res = run_command(args.size() - 1, args.data());
+  if (!trace.empty() and !Trace::save(trace)) {
+    fprintf(stderr, "Failed to write %s\n", trace.c_str());
+    res = res == 0 ? 1 : res;
+  }
+  return res;
+}
+
+int Cli::run_command(int argc, char *argv[]) {
+  Cli cli{argc, argv};
+  try {
+    if (!strcmp(argv[1], "extract"))
+      return cli.extract();
+    if (!strcmp(argv[1], "list"))
+      return cli.list();
+    if (!strcmp(argv[1], "test"))
+      return cli.test();
+    if (!strcmp(argv[1], "cat"))
+      return cli.cat();
+    if (!strcmp(argv[1], "daemon"))
+      return cli.daemon();
+  } catch (std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 2;
+  }
+  return usage(stderr);
+}
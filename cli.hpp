@@ -0,0 +1,136 @@
+#pragma once
+
+// Command line front end. zipcombiner-cli is nothing else, the GUI executable
+// runs it when the first argument names a command.
+
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "zipcombiner.hpp"
+
+struct Cli {
+  int argc;
+  char **argv;
+  int i = 2;
+
+  static Extractor *running;
+  static StreamExtractor *streaming;
+
+  static bool is_command(const char *arg) {
+    return !strcmp(arg, "extract") or !strcmp(arg, "list") or
+           !strcmp(arg, "test") or !strcmp(arg, "cat") or
+           !strcmp(arg, "daemon");
+  }
+
+  static int usage(FILE *out);
+
+  // Matches --name VALUE, --name=VALUE and the short form -n VALUE.
+  bool value(const char *name, const char *short_name, std::string *out);
+
+  struct Job {
+    std::string out_dir;
+    // where entries go instead of out_dir, see --tar
+    OutputSink *sink = nullptr;
+    bool each = false;
+    bool tar = false;
+    bool keep = false;
+    bool resumable = false;
+    Extractor::Incremental incremental = Extractor::Incremental::OFF;
+    SyncPolicy sync = SyncPolicy::NONE;
+    std::vector<std::pair<std::string, bool>> filters;
+    std::list<std::string> parts;
+    uint64_t entries = 0;
+    // see --metrics, one JSON object per archive
+    std::string metrics_path;
+    std::vector<std::string> reports;
+
+    void report(const std::string &zip, const JobMetrics &m, bool ok);
+
+    // Writes the reports to metrics_path, - for stderr.
+    bool save_reports();
+  };
+
+  static void progress_cb(bool done, bool cancel, std::string zip, void *ctx) {
+    Job *job = (Job *)ctx;
+    if (!done) {
+      job->entries++;
+    } else if (cancel) {
+      fprintf(stderr, "%s: canceled\n", zip.c_str());
+    }
+  }
+
+  static bool exists_cb(const char *file_name, size_t file_name_len,
+                        bool is_dir, void *ctx) {
+    (void)file_name_len;
+    (void)is_dir;
+    Job *job = (Job *)ctx;
+    if (job->keep)
+      fprintf(stderr, "keeping %s\n", file_name);
+    return !job->keep;
+  }
+
+  static void on_signal(int sig) {
+    (void)sig;
+    if (running != nullptr)
+      running->cancel();
+    if (streaming != nullptr)
+      streaming->cancel();
+  }
+
+  void setup(Extractor *x, Job *job) {
+    x->syncer.policy = job->sync;
+    x->resumable = job->resumable;
+    x->incremental = job->incremental;
+    for (auto &f : job->filters)
+      x->filter.add(f.first, f.second);
+  }
+
+  void extract_one(std::list<std::string> *parts, std::string zip, Job *job);
+
+  // Extracts an archive piped to stdin, see StreamReader.
+  int extract_stream(Job *job);
+
+  int extract();
+
+  int list();
+
+  static void report(Tester *t, const std::string &zip);
+
+  int test();
+
+  struct Lookup {
+    const char *name;
+    int64_t cd_pos = -1;
+  };
+
+  static bool lookup_cb(Archive::Entry *e, void *ctx) {
+    Lookup *l = (Lookup *)ctx;
+    if (strcmp(e->get_name(), l->name))
+      return true;
+    l->cd_pos = e->archive->entry_pos();
+    return false;
+  }
+
+  static bool stdout_cb(void *ctx, const char *buf, size_t len, int64_t offt) {
+    (void)ctx;
+    (void)offt;
+    return write_file(stdout, buf, len) == len;
+  }
+
+  // Writes a byte range of one entry to stdout, decoding it once with
+  // Entry::read_range().
+  int cat();
+
+  // Extracts archives posted to it or dropped in watched folders and serves
+  // metrics, see Daemon and Watcher.
+  int daemon();
+
+  // Takes --trace and --max-mem out of the arguments and runs the command.
+  static int run(int argc, char *argv[]);
+
+  static int run_command(int argc, char *argv[]);
+};
@@ -0,0 +1,9 @@
+#include "cli.hpp"
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 and (!strcmp(argv[1], "-h") or !strcmp(argv[1], "--help")))
+    return Cli::usage(stdout);
+  if (argc < 2 or !Cli::is_command(argv[1]))
+    return Cli::usage(stderr);
+  return Cli::run(argc, argv);
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+// CRC-32 as used by ZIP and zlib, with a kernel picked at runtime for the
+// CPU: VPCLMULQDQ (AVX-512) or PCLMULQDQ folding on x86-64, the CRC32
+// instructions on ARMv8 and slice-by-16 tables everywhere else.
+//
+// All kernels take and return the finished value, like zlib's crc32(), so
+// crc32_update(0, buf, len) starts a new checksum.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32_ARM 1
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+struct Crc32Tables {
+  uint32_t t[16][256];
+
+  Crc32Tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+      t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int k = 1; k < 16; k++)
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+  }
+
+  static const Crc32Tables &get() {
+    static const Crc32Tables tables;
+    return tables;
+  }
+};
+
+// One table lookup per byte. Kept as the reference and for the benchmark.
+inline uint32_t crc32_bytewise(uint32_t crc, const void *buf, size_t len) {
+  const uint32_t(&t)[16][256] = Crc32Tables::get().t;
+  const uint8_t *p = (const uint8_t *)buf;
+  crc = ~crc;
+  while (len--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  return ~crc;
+}
+
+inline uint32_t crc32_slice16(uint32_t crc, const void *buf, size_t len) {
+  const uint32_t(&t)[16][256] = Crc32Tables::get().t;
+  const uint8_t *p = (const uint8_t *)buf;
+  crc = ~crc;
+  while (len >= 16) {
+    uint32_t w[4];
+    memcpy(w, p, 16);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (auto &x : w)
+      x = __builtin_bswap32(x);
+#endif
+    w[0] ^= crc;
+    crc = t[15][w[0] & 0xff] ^ t[14][(w[0] >> 8) & 0xff] ^
+          t[13][(w[0] >> 16) & 0xff] ^ t[12][w[0] >> 24] ^
+          t[11][w[1] & 0xff] ^ t[10][(w[1] >> 8) & 0xff] ^
+          t[9][(w[1] >> 16) & 0xff] ^ t[8][w[1] >> 24] ^ t[7][w[2] & 0xff] ^
+          t[6][(w[2] >> 8) & 0xff] ^ t[5][(w[2] >> 16) & 0xff] ^
+          t[4][w[2] >> 24] ^ t[3][w[3] & 0xff] ^ t[2][(w[3] >> 8) & 0xff] ^
+          t[1][(w[3] >> 16) & 0xff] ^ t[0][w[3] >> 24];
+    p += 16;
+    len -= 16;
+  }
+  while (len--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  return ~crc;
+}
+
+#ifdef CRC32_X86
+// Folding constants are x^(n) mod P, bit reflected and shifted left by one,
+// for n = distance + 32 (low) and distance - 32 (high). See Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+alignas(16) static const uint64_t crc32_k2048[2] = {0x11542778a, 0x1322d1430};
+alignas(16) static const uint64_t crc32_k512[2] = {0x154442bd4, 0x1c6e41596};
+alignas(16) static const uint64_t crc32_k128[2] = {0x1751997d0, 0x0ccaa009e};
+alignas(16) static const uint64_t crc32_k64[2] = {0x163cd6124, 0};
+alignas(16) static const uint64_t crc32_poly[2] = {0x1db710641, 0x1f7011641};
+
+__attribute__((target("pclmul,sse4.1"))) static inline __m128i
+crc32_fold(__m128i x, __m128i k, __m128i next) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// Reduces the 128 bit remainder x and the tail of the buffer to the CRC.
+__attribute__((target("pclmul,sse4.1"))) static inline uint32_t
+crc32_pclmul_tail(__m128i x, const uint8_t *p, size_t len) {
+  __m128i k = _mm_load_si128((const __m128i *)crc32_k128);
+  while (len >= 16) {
+    x = crc32_fold(x, k, _mm_loadu_si128((const __m128i *)p));
+    p += 16;
+    len -= 16;
+  }
+
+  // 128 -> 64 bits
+  __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i t = _mm_clmulepi64_si128(x, k, 0x10);
+  x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+  k = _mm_loadl_epi64((const __m128i *)crc32_k64);
+  t = _mm_srli_si128(x, 4);
+  x = _mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x00);
+  x = _mm_xor_si128(x, t);
+
+  // Barrett reduction to 32 bits
+  k = _mm_load_si128((const __m128i *)crc32_poly);
+  t = _mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask), k, 0x00);
+  x = _mm_xor_si128(x, t);
+  uint32_t crc = _mm_extract_epi32(x, 1);
+
+  if (len > 0)
+    crc = ~crc32_slice16(~crc, p, len);
+  return crc;
+}
+
+// Folds 64 bytes per iteration into four 128 bit accumulators.
+__attribute__((target("pclmul,sse4.1"))) inline uint32_t
+crc32_pclmul(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  if (len < 64)
+    return crc32_slice16(crc, buf, len);
+
+  __m128i x0 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+  x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(~crc));
+  p += 64;
+  len -= 64;
+
+  __m128i k = _mm_load_si128((const __m128i *)crc32_k512);
+  while (len >= 64) {
+    x0 = crc32_fold(x0, k, _mm_loadu_si128((const __m128i *)(p + 0x00)));
+    x1 = crc32_fold(x1, k, _mm_loadu_si128((const __m128i *)(p + 0x10)));
+    x2 = crc32_fold(x2, k, _mm_loadu_si128((const __m128i *)(p + 0x20)));
+    x3 = crc32_fold(x3, k, _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    p += 64;
+    len -= 64;
+  }
+
+  k = _mm_load_si128((const __m128i *)crc32_k128);
+  x0 = crc32_fold(x0, k, x1);
+  x0 = crc32_fold(x0, k, x2);
+  x0 = crc32_fold(x0, k, x3);
+  return ~crc32_pclmul_tail(x0, p, len);
+}
+
+#define CRC32_AVX512 "avx512f,avx512bw,vpclmulqdq,pclmul,sse4.1"
+
+__attribute__((target(CRC32_AVX512))) static inline __m512i
+crc32_fold512(__m512i x, __m512i k, __m512i next) {
+  __m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+  __m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+  return _mm512_ternarylogic_epi64(lo, hi, next, 0x96);
+}
+
+// Same scheme as crc32_pclmul() with 512 bit registers, 256 bytes per
+// iteration.
+__attribute__((target(CRC32_AVX512))) inline uint32_t
+crc32_vpclmul(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  if (len < 256)
+    return crc32_pclmul(crc, buf, len);
+
+  __m512i x0 = _mm512_loadu_si512(p + 0x00);
+  __m512i x1 = _mm512_loadu_si512(p + 0x40);
+  __m512i x2 = _mm512_loadu_si512(p + 0x80);
+  __m512i x3 = _mm512_loadu_si512(p + 0xc0);
+  x0 = _mm512_xor_si512(x0, _mm512_set_epi64(0, 0, 0, 0, 0, 0, 0, ~crc));
+  p += 256;
+  len -= 256;
+
+  __m512i k = _mm512_set_epi64(crc32_k2048[1], crc32_k2048[0], crc32_k2048[1],
+                               crc32_k2048[0], crc32_k2048[1], crc32_k2048[0],
+                               crc32_k2048[1], crc32_k2048[0]);
+  while (len >= 256) {
+    x0 = crc32_fold512(x0, k, _mm512_loadu_si512(p + 0x00));
+    x1 = crc32_fold512(x1, k, _mm512_loadu_si512(p + 0x40));
+    x2 = crc32_fold512(x2, k, _mm512_loadu_si512(p + 0x80));
+    x3 = crc32_fold512(x3, k, _mm512_loadu_si512(p + 0xc0));
+    p += 256;
+    len -= 256;
+  }
+
+  k = _mm512_set_epi64(crc32_k512[1], crc32_k512[0], crc32_k512[1],
+                       crc32_k512[0], crc32_k512[1], crc32_k512[0],
+                       crc32_k512[1], crc32_k512[0]);
+  x0 = crc32_fold512(x0, k, x1);
+  x0 = crc32_fold512(x0, k, x2);
+  x0 = crc32_fold512(x0, k, x3);
+
+  // four 128 bit lanes -> one
+  alignas(64) __m128i lanes[4];
+  _mm512_store_si512(lanes, x0);
+  __m128i k128 = _mm_load_si128((const __m128i *)crc32_k128);
+  __m128i x = lanes[0];
+  x = crc32_fold(x, k128, lanes[1]);
+  x = crc32_fold(x, k128, lanes[2]);
+  x = crc32_fold(x, k128, lanes[3]);
+  return ~crc32_pclmul_tail(x, p, len);
+}
+#endif
+
+#ifdef CRC32_ARM
+__attribute__((target("+crc"))) inline uint32_t
+crc32_armv8(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  crc = ~crc;
+  while (len >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    crc = __crc32d(crc, w);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = __crc32b(crc, *p++);
+  return ~crc;
+}
+#endif
+
+typedef uint32_t (*crc32_fn)(uint32_t, const void *, size_t);
+
+struct Crc32Kernel {
+  const char *name;
+  crc32_fn fn;
+};
+
+// The fastest kernel this CPU supports.
+inline Crc32Kernel crc32_pick() {
+#ifdef CRC32_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") and
+      __builtin_cpu_supports("avx512bw") and
+      __builtin_cpu_supports("vpclmulqdq"))
+    return {"vpclmulqdq", crc32_vpclmul};
+  if (__builtin_cpu_supports("pclmul") and __builtin_cpu_supports("sse4.1"))
+    return {"pclmulqdq", crc32_pclmul};
+#endif
+#ifdef CRC32_ARM
+#if defined(__APPLE__)
+  return {"armv8-crc", crc32_armv8};
+#elif defined(__linux__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    return {"armv8-crc", crc32_armv8};
+#endif
+#endif
+  return {"slice-by-16", crc32_slice16};
+}
+
+inline const Crc32Kernel &crc32_kernel() {
+  static const Crc32Kernel kernel = crc32_pick();
+  return kernel;
+}
+
+inline uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+  return crc32_kernel().fn(crc, buf, len);
+}
+
+// a * b modulo the CRC polynomial, both reflected like the CRC itself.
+inline uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+  }
+  return p;
+}
+
+// The CRC of A followed by B from the CRCs of both and the length of B, so
+// that pieces checksummed on different threads can be put together.
+inline uint32_t crc32_merge(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+  struct Powers {
+    uint32_t x2n[32]; // x^(2^n) mod P
+    Powers() {
+      x2n[0] = 1u << 30;
+      for (int n = 1; n < 32; n++)
+        x2n[n] = crc32_multmodp(x2n[n - 1], x2n[n - 1]);
+    }
+  };
+  static const Powers powers;
+  // x^(8 * len_b) mod P
+  uint32_t p = 1u << 31;
+  for (unsigned k = 3; len_b != 0; len_b >>= 1, k++) {
+    if (len_b & 1)
+      p = crc32_multmodp(powers.x2n[k & 31], p);
+  }
+  return crc32_multmodp(p, crc_a) ^ crc_b;
+}
@@ -0,0 +1,629 @@
+#include "daemon.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "archive.hpp"
+#include "mystream.hpp"
+
+uint64_t Daemon::submit(std::list<std::string> parts, std::string out_dir,
+                        std::string done_marker, std::string done_text) {
+  std::shared_ptr<Job> job(new Job);
+  job->parts = std::move(parts);
+  job->out_dir = std::move(out_dir);
+  job->done_marker = std::move(done_marker);
+  job->done_text = std::move(done_text);
+  {
+    std::lock_guard<std::mutex> g(lock);
+    if (sched.queue.size() + unprobed.size() >= max_queue)
+      return 0;
+    job->id = next_id++;
+    job->queued_ns = Metrics::now_ns();
+    unprobed.push_back(job);
+  }
+  to_probe.notify_one();
+  return job->id;
+}
+
+void Daemon::probe_jobs() {
+  std::unique_lock<std::mutex> g(lock);
+  while (true) {
+    to_probe.wait(g, [&] { return stopping or !unprobed.empty(); });
+    if (stopping)
+      return;
+    // it stays in unprobed meanwhile, so /jobs shows it
+    std::shared_ptr<Job> job = unprobed.front();
+    g.unlock();
+    Scheduler::probe(job.get());
+    g.lock();
+    unprobed.pop_front();
+    sched.queue.push_back(job);
+    more.notify_one();
+  }
+}
+
+void Daemon::work() {
+  std::unique_lock<std::mutex> g(lock);
+  while (true) {
+    std::shared_ptr<Job> job;
+    more.wait(g, [&] {
+      return stopping or (job = sched.pick(Metrics::now_ns())) != nullptr;
+    });
+    if (stopping)
+      return;
+    job->state = Job::State::RUNNING;
+    active.push_back(job);
+    g.unlock();
+    run_job(job.get());
+    g.lock();
+    sched.finished(*job);
+    // the devices it used may let a job that waits start
+    more.notify_all();
+    active.erase(std::find(active.begin(), active.end(), job));
+    finished.push_back(job);
+    if (finished.size() > KEEP_FINISHED)
+      finished.pop_front();
+  }
+}
+
+void Daemon::run_job(Job *job) {
+  bool ok = false;
+  std::string error, report;
+  std::vector<std::pair<std::string, uint64_t>> errors;
+  try {
+    // only the folders above it, a new output folder is published with a
+    // single rename of the staging folder
+    fs::path out = fs::absolute(job->out_dir);
+    if (!out.has_filename())
+      out = out.parent_path();
+    fs::create_directories(out.parent_path());
+    Mystream z(&job->parts);
+    z.readahead = readahead;
+    Archive a(&z);
+    Extractor x(&a, job->out_dir, "");
+    {
+      std::lock_guard<std::mutex> g(lock);
+      job->running = &x;
+      if (stopping)
+        x.cancel();
+    }
+    try {
+      x.extract();
+      ok = !a.cancel;
+      if (!ok)
+        error = "canceled";
+    } catch (std::exception &e) {
+      error = e.what();
+    }
+    {
+      std::lock_guard<std::mutex> g(lock);
+      job->running = nullptr;
+    }
+    report = x.metrics.report(job->parts.front(), ok);
+    if (ok and !job->done_marker.empty())
+      mark_done(*job);
+    for (size_t i = 0; i < z.parts.size(); i++) {
+      if (z.io[i].errors > 0)
+        errors.push_back({z.parts[i].path, z.io[i].errors});
+    }
+  } catch (std::exception &e) {
+    error = e.what();
+  }
+  std::lock_guard<std::mutex> g(lock);
+  job->state = ok ? Job::State::DONE : Job::State::FAILED;
+  job->error = error;
+  job->report = report;
+  (ok ? jobs_ok : jobs_failed)++;
+  fprintf(stderr, "job %llu: %s%s\n", (unsigned long long)job->id,
+          ok ? "done" : "failed: ", error.c_str());
+  for (auto &e : errors) {
+    bool known = part_errors.count(e.first) > 0;
+    part_errors[known or part_errors.size() < PART_LABELS ? e.first : ""] +=
+        e.second;
+  }
+}
+
+void Daemon::mark_done(const Job &job) noexcept {
+  std::string tmp = job.done_marker + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr)
+    return;
+  bool ok = fwrite(job.done_text.data(), 1, job.done_text.size(), f) ==
+            job.done_text.size();
+  ok = fclose(f) == 0 and ok;
+  std::error_code ec;
+  if (ok)
+    fs::rename(tmp, job.done_marker, ec);
+  if (!ok or ec)
+    fs::remove(tmp, ec);
+}
+
+void Daemon::sample() {
+  Sample s = {Metrics::now_ns(), Metrics::read.bytes, Metrics::written.bytes};
+  std::lock_guard<std::mutex> g(lock);
+  samples.push_back(s);
+  if (samples.size() > RATE_SAMPLES)
+    samples.pop_front();
+}
+
+double Daemon::rate(bool written) {
+  if (samples.size() < 2)
+    return 0;
+  const Sample &a = samples.front(), &b = samples.back();
+  uint64_t bytes = written ? b.written - a.written : b.read - a.read;
+  return bytes / ((b.ns - a.ns) / 1e9);
+}
+
+static void head(std::string *out, const char *name, const char *type,
+                 const char *help) {
+  *out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name +
+          " " + type + "\n";
+}
+
+static void line(std::string *out, const char *name, const std::string &labels,
+                 uint64_t v) {
+  *out += name + labels + " " + std::to_string(v) + "\n";
+}
+
+static void line(std::string *out, const char *name, const std::string &labels,
+                 double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), " %g\n", v);
+  *out += name + labels + buf;
+}
+
+// {name="value"} with value escaped as the text format wants.
+static std::string label(const char *name, const std::string &value) {
+  std::string s = std::string("{") + name + "=\"";
+  for (char c : value) {
+    if (c == '\\' or c == '"')
+      s += '\\';
+    if (c == '\n')
+      s += "\\n";
+    else
+      s += c;
+  }
+  return s + "\"}";
+}
+
+std::string Daemon::metrics() {
+  std::lock_guard<std::mutex> g(lock);
+  std::string out;
+  head(&out, "zipcombiner_queue_depth", "gauge", "Jobs waiting for a worker.");
+  line(&out, "zipcombiner_queue_depth", "",
+       (uint64_t)(sched.queue.size() + unprobed.size()));
+  head(&out, "zipcombiner_active_jobs", "gauge", "Jobs being extracted.");
+  line(&out, "zipcombiner_active_jobs", "", (uint64_t)active.size());
+  head(&out, "zipcombiner_device_jobs", "gauge",
+       "Running jobs that read or write a device, by st_dev and kind.");
+  for (auto &d : sched.running) {
+    std::string dev = "{device=\"" + std::to_string(d.first) + "\",kind=";
+    line(&out, "zipcombiner_device_jobs", dev + "\"io\"}",
+         (uint64_t)d.second[0]);
+    line(&out, "zipcombiner_device_jobs", dev + "\"cpu\"}",
+         (uint64_t)d.second[1]);
+  }
+  head(&out, "zipcombiner_workers", "gauge", "Jobs that can run at once.");
+  line(&out, "zipcombiner_workers", "", (uint64_t)workers);
+  head(&out, "zipcombiner_jobs_total", "counter", "Jobs finished.");
+  line(&out, "zipcombiner_jobs_total", label("result", "ok"), jobs_ok);
+  line(&out, "zipcombiner_jobs_total", label("result", "failed"), jobs_failed);
+
+  IoTotals read(Metrics::read), written(Metrics::written),
+      synced(Metrics::synced);
+  head(&out, "zipcombiner_read_bytes_total", "counter",
+       "Bytes read from archive parts.");
+  line(&out, "zipcombiner_read_bytes_total", "", read.bytes);
+  head(&out, "zipcombiner_read_calls_total", "counter",
+       "Reads of archive parts.");
+  line(&out, "zipcombiner_read_calls_total", "", read.calls);
+  head(&out, "zipcombiner_read_wait_seconds_total", "counter",
+       "Time spent reading archive parts.");
+  line(&out, "zipcombiner_read_wait_seconds_total", "", read.wait_ns / 1e9);
+  head(&out, "zipcombiner_read_bytes_per_second", "gauge",
+       "Bytes read a second over the last 10 seconds.");
+  line(&out, "zipcombiner_read_bytes_per_second", "", rate(false));
+  head(&out, "zipcombiner_part_errors_total", "counter",
+       "Failed reads by part file.");
+  for (auto &e : part_errors)
+    line(&out, "zipcombiner_part_errors_total", label("part", e.first),
+         e.second);
+
+  head(&out, "zipcombiner_written_bytes_total", "counter",
+       "Bytes of extracted files written.");
+  line(&out, "zipcombiner_written_bytes_total", "", written.bytes);
+  head(&out, "zipcombiner_write_wait_seconds_total", "counter",
+       "Time spent writing extracted files.");
+  line(&out, "zipcombiner_write_wait_seconds_total", "", written.wait_ns / 1e9);
+  head(&out, "zipcombiner_write_errors_total", "counter", "Failed writes.");
+  line(&out, "zipcombiner_write_errors_total", "", written.errors);
+  head(&out, "zipcombiner_written_bytes_per_second", "gauge",
+       "Bytes written a second over the last 10 seconds.");
+  line(&out, "zipcombiner_written_bytes_per_second", "", rate(true));
+  head(&out, "zipcombiner_sync_wait_seconds_total", "counter",
+       "Time spent flushing extracted files to disk.");
+  line(&out, "zipcombiner_sync_wait_seconds_total", "", synced.wait_ns / 1e9);
+
+  uint64_t hits = Metrics::readahead.hits, misses = Metrics::readahead.misses;
+  head(&out, "zipcombiner_readahead_hits_total", "counter",
+       "Stream reads served from the read-ahead buffer.");
+  line(&out, "zipcombiner_readahead_hits_total", "", hits);
+  head(&out, "zipcombiner_readahead_misses_total", "counter",
+       "Stream reads that had to read the part.");
+  line(&out, "zipcombiner_readahead_misses_total", "", misses);
+  head(&out, "zipcombiner_readahead_hit_ratio", "gauge",
+       "Share of stream reads served from the read-ahead buffer.");
+  line(&out, "zipcombiner_readahead_hit_ratio", "",
+       hits + misses ? (double)hits / (hits + misses) : 0.0);
+
+  uint64_t used, peak, waits;
+  {
+    std::lock_guard<std::mutex> g(MemoryPool::lock);
+    used = MemoryPool::used;
+    peak = MemoryPool::peak;
+    waits = MemoryPool::waits;
+  }
+  head(&out, "zipcombiner_memory_budget_bytes", "gauge",
+       "Memory for buffers at most, 0 if there is no budget.");
+  line(&out, "zipcombiner_memory_budget_bytes", "",
+       (uint64_t)MemoryPool::capacity);
+  head(&out, "zipcombiner_memory_used_bytes", "gauge",
+       "Memory taken for buffers.");
+  line(&out, "zipcombiner_memory_used_bytes", "", used);
+  head(&out, "zipcombiner_memory_peak_bytes", "gauge",
+       "Most memory taken for buffers at once.");
+  line(&out, "zipcombiner_memory_peak_bytes", "", peak);
+  head(&out, "zipcombiner_memory_waits_total", "counter",
+       "Times work waited for memory to be given back.");
+  line(&out, "zipcombiner_memory_waits_total", "", waits);
+  return out;
+}
+
+static const char *state_name(Daemon::Job::State s) {
+  switch (s) {
+  case Daemon::Job::State::QUEUED:
+    return "queued";
+  case Daemon::Job::State::RUNNING:
+    return "running";
+  case Daemon::Job::State::DONE:
+    return "done";
+  case Daemon::Job::State::FAILED:
+    return "failed";
+  }
+  return "";
+}
+
+static void job_json(std::string *out, const Daemon::Job &j) {
+  *out += "{\"id\": " + std::to_string(j.id) + ", \"state\": \"" +
+          state_name(j.state) + "\", \"out\": ";
+  Lister::json_string(out, j.out_dir.c_str());
+  *out += ", \"parts\": [";
+  for (auto &p : j.parts) {
+    if (&p != &j.parts.front())
+      *out += ", ";
+    Lister::json_string(out, p.c_str());
+  }
+  *out += "], \"bytes\": " + std::to_string(j.bytes) + ", \"kind\": \"" +
+          (j.cpu_bound ? "cpu" : "io") + "\"";
+  if (!j.error.empty()) {
+    *out += ", \"error\": ";
+    Lister::json_string(out, j.error.c_str());
+  }
+  if (!j.report.empty())
+    *out += ", \"report\": " + j.report;
+  *out += "}";
+}
+
+std::string Daemon::jobs_json() {
+  std::lock_guard<std::mutex> g(lock);
+  std::vector<const Job *> all;
+  for (auto &j : finished)
+    all.push_back(j.get());
+  for (auto &j : active)
+    all.push_back(j.get());
+  for (auto &j : sched.queue)
+    all.push_back(j.get());
+  for (auto &j : unprobed)
+    all.push_back(j.get());
+  std::string out = "{\"version\": 1, \"jobs\": [";
+  for (size_t k = 0; k < all.size(); k++) {
+    out += k == 0 ? "\n  " : ",\n  ";
+    job_json(&out, *all[k]);
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+std::string Daemon::respond(const std::string &method, const std::string &path,
+                            const std::string &body, bool can_submit,
+                            int *status, const char **type) {
+  *status = 200;
+  *type = "application/json";
+  if (path == "/metrics" and method == "GET") {
+    *type = "text/plain; version=0.0.4; charset=utf-8";
+    return metrics();
+  }
+  if (path == "/jobs" and method == "GET")
+    return jobs_json();
+  if (path == "/jobs" and method == "POST" and !can_submit) {
+    *status = 403;
+    return "{\"error\": \"jobs can only be posted on a Unix socket\"}\n";
+  }
+  if (path == "/jobs" and method == "POST") {
+    std::list<std::string> lines;
+    size_t at = 0;
+    while (at < body.size()) {
+      size_t end = std::min(body.find('\n', at), body.size());
+      std::string l = body.substr(at, end - at);
+      if (!l.empty() and l.back() == '\r')
+        l.pop_back();
+      if (!l.empty())
+        lines.push_back(l);
+      at = end + 1;
+    }
+    if (lines.size() < 2) {
+      *status = 400;
+      return "{\"error\": \"expected the output folder and the parts, one "
+             "a line\"}\n";
+    }
+    std::string out_dir = lines.front();
+    lines.pop_front();
+    // in the order the CLI takes them
+    lines.sort();
+    uint64_t id = submit(lines, out_dir);
+    if (id == 0) {
+      *status = 503;
+      return "{\"error\": \"the queue is full\"}\n";
+    }
+    *status = 202;
+    return "{\"id\": " + std::to_string(id) + "}\n";
+  }
+  if (path == "/metrics" or path == "/jobs") {
+    *status = 405;
+    return "{\"error\": \"method not allowed\"}\n";
+  }
+  *status = 404;
+  return "{\"error\": \"not found\"}\n";
+}
+
+#ifndef _WIN32
+static const char *reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 202:
+    return "Accepted";
+  case 400:
+    return "Bad Request";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
+  case 503:
+    return "Service Unavailable";
+  }
+  return "";
+}
+
+static void send_all(int fd, const std::string &s) {
+  for (size_t done = 0; done < s.size();) {
+    ssize_t n = send(fd, s.data() + done, s.size() - done, 0);
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    done += n;
+  }
+}
+
+// Content-Length of the headers in head, 0 without one.
+static size_t content_length(std::string head) {
+  for (auto &c : head)
+    c = tolower((unsigned char)c);
+  size_t at = head.find("\r\ncontent-length:");
+  if (at == std::string::npos)
+    return 0;
+  return strtoull(head.c_str() + at + 17, nullptr, 10);
+}
+
+void Daemon::serve(int fd, bool can_submit) {
+  // a client that stops sending holds up the others for this long at most
+  struct timeval tv = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  std::string req;
+  size_t head_end = std::string::npos, body_len = 0;
+  char buf[4096];
+  int status = 0;
+  const char *type = "application/json";
+  std::string body;
+  while (head_end == std::string::npos or
+         req.size() < head_end + 4 + body_len) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    req.append(buf, n);
+    if (head_end == std::string::npos) {
+      head_end = req.find("\r\n\r\n");
+      if (head_end == std::string::npos and req.size() > MAX_REQUEST)
+        return;
+      if (head_end != std::string::npos)
+        body_len = content_length(req.substr(0, head_end + 2));
+      if (body_len > MAX_REQUEST) {
+        status = 413;
+        body = "{\"error\": \"request too large\"}\n";
+        break;
+      }
+    }
+  }
+  if (status == 0) {
+    size_t sp1 = req.find(' ');
+    size_t sp2 = req.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos or sp2 == std::string::npos or
+        sp2 > head_end) {
+      status = 400;
+      body = "{\"error\": \"bad request line\"}\n";
+    } else {
+      std::string path = req.substr(sp1 + 1, sp2 - sp1 - 1);
+      path = path.substr(0, path.find('?'));
+      body = respond(req.substr(0, sp1), path,
+                     req.substr(head_end + 4, body_len), can_submit, &status,
+                     &type);
+    }
+  }
+  char hdr[256];
+  snprintf(hdr, sizeof(hdr),
+           "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+           "Connection: close\r\n\r\n",
+           status, reason(status), type, body.size());
+  send_all(fd, hdr + body);
+}
+
+static bool is_unix_socket(const std::string &listen) {
+  return listen.find('/') != std::string::npos;
+}
+
+static int listen_unix(const std::string &path) {
+  struct sockaddr_un a;
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(a.sun_path))
+    throw Daemon::Error("Socket path too long: " + path);
+  memcpy(a.sun_path, path.c_str(), path.size());
+  // a socket left behind by a daemon that didn't exit cleanly
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      throw Daemon::Error(path + " exists and isn't a socket");
+    unlink(path.c_str());
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  // bind() makes the socket with the umask's mode, so it's never open to
+  // others even before the chmod; no other threads run yet
+  mode_t mask = umask(077);
+  bool bound = fd >= 0 and bind(fd, (struct sockaddr *)&a, sizeof(a)) == 0;
+  int bind_errno = errno;
+  umask(mask);
+  errno = bind_errno;
+  if (!bound or chmod(path.c_str(), 0600) != 0 or ::listen(fd, 16) != 0) {
+    std::string err = strerror(errno);
+    if (fd >= 0)
+      close(fd);
+    throw Daemon::Error("Can't listen on " + path + ": " + err);
+  }
+  return fd;
+}
+
+// Listens on a loopback address only, the counters are nobody else's
+// business and there is no authentication. Jobs aren't taken here.
+static int listen_tcp(const std::string &spec, std::string *bound) {
+  std::string host = "127.0.0.1", port = spec;
+  size_t colon = spec.rfind(':');
+  if (colon != std::string::npos) {
+    host = spec.substr(0, colon);
+    port = spec.substr(colon + 1);
+  }
+  if (host == "localhost")
+    host = "127.0.0.1";
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  char *end;
+  long p = strtol(port.c_str(), &end, 10);
+  if (port.empty() or *end != 0 or p < 0 or p > 65535)
+    throw Daemon::Error("Bad port " + port);
+  a.sin_port = htons(p);
+  if (inet_pton(AF_INET, host.c_str(), &a.sin_addr) != 1 or
+      ntohl(a.sin_addr.s_addr) >> 24 != 127)
+    throw Daemon::Error("Only loopback addresses can be listened on, not " +
+                        host);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  socklen_t len = sizeof(a);
+  if (fd < 0 or
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 or
+      bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 or
+      ::listen(fd, 16) != 0 or
+      getsockname(fd, (struct sockaddr *)&a, &len) != 0) {
+    std::string err = strerror(errno);
+    if (fd >= 0)
+      close(fd);
+    throw Daemon::Error("Can't listen on " + spec + ": " + err);
+  }
+  // port 0 takes any free one
+  *bound = host + ":" + std::to_string(ntohs(a.sin_port));
+  return fd;
+}
+#endif
+
+void Daemon::run() {
+#ifdef _WIN32
+  throw Error("The daemon isn't available on Windows");
+#else
+  std::string bound = listen;
+  int fd = is_unix_socket(listen) ? listen_unix(listen)
+                                  : listen_tcp(listen, &bound);
+  // a client that goes away mid-answer mustn't take the daemon with it
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "listening on %s\n", bound.c_str());
+  stopping = false;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < std::max(1u, workers); i++)
+    threads.emplace_back(&Daemon::work, this);
+  threads.emplace_back(&Daemon::probe_jobs, this);
+  sample();
+  uint64_t sampled = Metrics::now_ns();
+  while (!stopping) {
+    struct pollfd p = {fd, POLLIN, 0};
+    int r = poll(&p, 1, 250);
+    if (Metrics::now_ns() - sampled >= 1000000000) {
+      sample();
+      sampled = Metrics::now_ns();
+    }
+    if (r <= 0)
+      continue;
+    int c = accept(fd, nullptr, nullptr);
+    if (c < 0)
+      continue;
+    serve(c, is_unix_socket(listen));
+    close(c);
+  }
+  close(fd);
+  if (is_unix_socket(listen))
+    unlink(listen.c_str());
+  {
+    std::lock_guard<std::mutex> g(lock);
+    for (auto &j : active) {
+      if (j->running != nullptr)
+        j->running->cancel();
+    }
+    size_t queued = sched.queue.size() + unprobed.size();
+    if (queued != 0)
+      fprintf(stderr, "dropping %zu queued job(s)\n", queued);
+  }
+  more.notify_all();
+  to_probe.notify_all();
+  for (auto &t : threads)
+    t.join();
+#endif
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+// A long running extractor that serves counters and gauges about its work in
+// the Prometheus text format, so a deployment can be watched while it runs.
+// It listens on a loopback port or a Unix socket and nowhere else:
+//
+//   GET  /metrics   the counters and gauges
+//   GET  /jobs      queued, running and recently finished jobs as JSON
+//   POST /jobs      queues a job, the output folder on the first line of the
+//                   body and the parts of the archive on the next ones
+//
+// Jobs can only be posted on a Unix socket, which only its owner can
+// connect to. Any local program, or a web page through the browser, can
+// reach a loopback port, so that serves the GET requests alone.
+//
+// Jobs also come from a Watcher. A thread of their own probes them, see
+// Scheduler::probe(), and they run on workers threads in the order the
+// Scheduler picks. Requests are answered one at a time by the thread that
+// called run().
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "extract.hpp"
+#include "scheduler.hpp"
+
+struct Daemon {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "The daemon failed") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  using Job = ExtractJob;
+
+  // The byte counters at one point, for the rates.
+  struct Sample {
+    uint64_t ns;
+    uint64_t read;
+    uint64_t written;
+  };
+
+  enum { KEEP_FINISHED = 100, PART_LABELS = 1000, RATE_SAMPLES = 11 };
+  enum { MAX_REQUEST = 1 << 20 };
+
+  // HOST:PORT or PORT on 127.0.0.0/8, or the path of a Unix socket
+  std::string listen = "127.0.0.1:9410";
+  unsigned workers = 2;
+  // jobs waiting at most, submit() turns more away
+  size_t max_queue = 64;
+  // see Mystream::readahead
+  size_t readahead = 256 << 10;
+
+  std::mutex lock;
+  std::condition_variable more;
+  // submitted jobs not probed yet, they count as queued but can't be picked
+  std::deque<std::shared_ptr<Job>> unprobed;
+  std::condition_variable to_probe;
+  Scheduler sched;
+  std::vector<std::shared_ptr<Job>> active;
+  std::deque<std::shared_ptr<Job>> finished;
+  uint64_t next_id = 1;
+  uint64_t jobs_ok = 0;
+  uint64_t jobs_failed = 0;
+  // read errors by part file over all jobs, the ones past PART_LABELS files
+  // go under ""
+  std::map<std::string, uint64_t> part_errors;
+  // one a second, the oldest first
+  std::deque<Sample> samples;
+
+  // set from signal handlers, hence static
+  static inline std::atomic<bool> stopping{false};
+
+  // Queues an extraction of the archive made of parts, in that order, into
+  // out_dir and returns its id, or 0 if the queue is full. If it succeeds,
+  // done_text is written to done_marker, if given.
+  uint64_t submit(std::list<std::string> parts, std::string out_dir,
+                  std::string done_marker = "", std::string done_text = "");
+
+  // Runs jobs and answers requests until stop(), then cancels the running
+  // jobs and waits for them. Queued jobs are dropped. Throws Error if it
+  // can't listen.
+  void run();
+
+  static void stop() { stopping = true; }
+
+  // The text served at /metrics.
+  std::string metrics();
+
+  std::string jobs_json();
+
+  void work();
+
+  // Probes the submitted jobs in order and queues them for the workers.
+  void probe_jobs();
+
+  void run_job(Job *job);
+
+  // Writes the done marker of a job that succeeded. Failing to only means
+  // its set is extracted again after a restart.
+  static void mark_done(const Job &job) noexcept;
+
+  void sample();
+
+  // bytes a second over the samples, of what was read or written
+  double rate(bool written);
+
+  // Answers the request on the connection fd, taking jobs only if
+  // can_submit.
+  void serve(int fd, bool can_submit);
+
+  std::string respond(const std::string &method, const std::string &path,
+                      const std::string &body, bool can_submit, int *status,
+                      const char **type);
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+// What the decoders of entry data have in common. They read the compressed
+// data at offsets, so that several threads can read one entry, and hand the
+// output to a sink together with its offset, so that it can be written out
+// of order.
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+
+struct DecodeError : std::exception {
+  std::string message;
+  DecodeError(std::string m = "Entry data is corrupt") { message = m; }
+  const char *what() const noexcept override { return message.c_str(); }
+};
+
+// Reads len bytes at offt of the compressed data, returns the count read.
+typedef int64_t (*decode_read_fn)(void *ctx, char *buf, int64_t len,
+                                  int64_t offt);
+// Takes len bytes of output found at offt. Returning false stops decoding.
+typedef bool (*decode_sink_fn)(void *ctx, const char *buf, size_t len,
+                               int64_t offt);
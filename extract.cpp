@@ -0,0 +1,1074 @@
+#include "extract.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#endif
+
+#include "crc32.hpp"
+#include "lzma_zip.hpp"
+#include "trace.hpp"
+#include "zstd_frames.hpp"
+
+const char *Inflater::inflate(Archive::Entry *e) {
+  Trace::Scope ts("Inflater::inflate");
+  ts.bytes = e->size();
+  int64_t csize = e->compressed_size();
+  if (in.size < (size_t)csize or in.get() == nullptr)
+    in.reset(std::max<size_t>(csize, MIN_BUF));
+  int64_t got = 0;
+  while (got < csize) {
+    int32_t n = e->read(in.get() + got, csize - got);
+    if (n <= 0)
+      return "Failed to read entry data";
+    got += n;
+  }
+  size_t size = e->size();
+  if (out.size < size or out.get() == nullptr)
+    out.reset(std::max<size_t>(size, MIN_BUF));
+  size_t actual;
+  if (libdeflate_deflate_decompress(d, in.get(), csize, out.get(), size,
+                                    &actual) != LIBDEFLATE_SUCCESS or
+      actual != size)
+    return "Entry data is corrupt";
+  e->crc_value = crc32_update(0, out.get(), size);
+  e->read_bytes = size;
+  return nullptr;
+}
+
+void HugeInflater::inflate(Archive::Entry *e, OutputSink *sink) {
+  Trace::Scope ts("HugeInflater::inflate");
+  ts.bytes = e->size();
+  EntryData data(e, sink);
+  if (data.base == -1)
+    throw DecodeError("Bad local header");
+  IndexFile *indexes = e->archive->index_file();
+  const InflateIndex *index = indexes->find(e->offset(), e->size(), e->crc());
+  if (index != nullptr) {
+    if (!index->decode_all(EntryData::read_cb, &data, threads,
+                           EntryData::write_at_cb, &data, &e->crc_value))
+      return;
+  } else {
+    InflateIndex built;
+    if (!built.build(EntryData::read_cb, &data, e->compressed_size(),
+                     InflateIndex::span_for(e->size()),
+                     EntryData::write_at_cb, &data))
+      return;
+    if (built.out_size != e->size())
+      throw DecodeError("Entry size doesn't match");
+    e->crc_value = built.crc;
+    if (built.crc == e->crc())
+      indexes->add(e->offset(), std::move(built));
+  }
+  e->read_bytes = e->size();
+}
+
+void Unpacker::unpack(Archive::Entry *e, OutputSink *out) {
+  Trace::Scope ts("Unpacker::unpack");
+  ts.bytes = e->size();
+  EntryData data(e, out);
+  if (data.base == -1)
+    throw DecodeError("Bad local header");
+  decode_sink_fn sink =
+      out != nullptr ? EntryData::write_at_cb : EntryData::discard_cb;
+  bool done;
+  if (e->method() == MZ_COMPRESS_METHOD_LZMA) {
+    done = LzmaDecoder::decode(EntryData::read_cb, &data,
+                               e->compressed_size(), e->size(), sink, &data,
+                               &e->crc_value);
+  } else {
+    ZstdFrames frames;
+    frames.in_size = e->compressed_size();
+    // only worth walking the block headers if there is more than a thread
+    if (threads > 1 and e->size() >= HugeInflater::BIG)
+      frames.scan(EntryData::read_cb, &data, e->compressed_size());
+    if (frames.sized and frames.out_size != e->size())
+      throw DecodeError("Entry size doesn't match");
+    done = frames.decode_all(EntryData::read_cb, &data, threads, sink, &data,
+                             &e->crc_value);
+  }
+  if (done)
+    e->read_bytes = e->size();
+}
+
+void DestIndex::scan(const std::string &rel) {
+  if (!scanned.insert(rel).second)
+    return;
+#ifndef _WIN32
+  DIR *dir = opendir((root + rel).c_str());
+  if (dir == nullptr)
+    return;
+  int fd = dirfd(dir);
+  struct dirent *de;
+  while ((de = readdir(dir)) != nullptr) {
+#ifdef DT_DIR
+    if (de->d_type == DT_DIR or de->d_type == DT_LNK)
+      continue;
+#endif
+    struct stat st;
+    if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 or
+        !S_ISREG(st.st_mode))
+      continue;
+    files[rel + de->d_name] = {(int64_t)st.st_size, st.st_mtime};
+  }
+  closedir(dir);
+#endif
+}
+
+bool DestIndex::find(const std::string &name, Stat *out) {
+  auto it = files.find(name);
+  if (it != files.end()) {
+    *out = it->second;
+    return true;
+  }
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64((root + name).c_str(), &st) == 0 and
+      (st.st_mode & _S_IFREG)) {
+    *out = {(int64_t)st.st_size, (time_t)st.st_mtime};
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool Filter::Set::match(const char *name) {
+  if (names.count(name))
+    return true;
+  const char *base = strrchr(name, '/');
+  // "dir/" entries are matched by their folder name
+  if (base != nullptr and base[1] == '\0') {
+    const char *p = base;
+    while (p > name and p[-1] != '/')
+      p--;
+    base = p;
+  } else {
+    base = base == nullptr ? name : base + 1;
+  }
+  for (auto &g : globs) {
+    // like .gitignore, a pattern without '/' applies at any depth
+    const char *subject = g.find('/') == std::string::npos ? base : name;
+    if (glob(g.c_str(), subject))
+      return true;
+  }
+  for (auto &r : regexes) {
+    if (std::regex_search(name, r))
+      return true;
+  }
+  return false;
+}
+
+bool Filter::glob(const char *pat, const char *s) {
+  while (*pat) {
+    if (pat[0] == '*' and pat[1] == '*') {
+      pat += 2;
+      if (*pat == '/')
+        pat++;
+      for (const char *t = s;; t++) {
+        if (glob(pat, t))
+          return true;
+        if (*t == '\0')
+          return false;
+      }
+    }
+    if (*pat == '*') {
+      pat++;
+      for (const char *t = s;; t++) {
+        if (glob(pat, t))
+          return true;
+        if (*t == '\0' or *t == '/')
+          return false;
+      }
+    }
+    if (*s == '\0')
+      return false;
+    if (*pat == '?') {
+      if (*s == '/')
+        return false;
+    } else if (*pat == '[') {
+      const char *p = pat + 1;
+      bool negate = *p == '!' or *p == '^';
+      if (negate)
+        p++;
+      bool found = false;
+      do {
+        if (p[1] == '-' and p[2] != ']' and p[2] != '\0') {
+          found |= *s >= p[0] and *s <= p[2];
+          p += 3;
+        } else {
+          found |= *s == *p;
+          p++;
+        }
+      } while (*p != ']' and *p != '\0');
+      if (*p == '\0' or found == negate)
+        return false;
+      pat = p;
+    } else if (*pat != *s) {
+      return false;
+    }
+    pat++;
+    s++;
+  }
+  return *s == '\0';
+}
+
+void Filter::add(const std::string &spec, bool excluding) {
+  Set &set = excluding ? exclude : include;
+  if (spec.rfind("re:", 0) == 0) {
+    try {
+      set.regexes.emplace_back(spec.substr(3), std::regex::ECMAScript |
+                                                   std::regex::optimize);
+    } catch (std::regex_error &e) {
+      throw Error("Invalid regular expression: " + spec.substr(3));
+    }
+  } else if (spec.rfind("@", 0) == 0) {
+    FILE *file = fopen(spec.c_str() + 1, "r");
+    if (file == nullptr)
+      throw Error(generic_error_msg() + ": " + spec.substr(1));
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+      size_t len = strcspn(line, "\r\n");
+      if (len > 0)
+        set.names.insert(std::string(line, len));
+    }
+    fclose(file);
+  } else if (!spec.empty()) {
+    set.globs.push_back(spec);
+  }
+}
+
+void Filter::add_all(const std::string &specs, bool excluding) {
+  size_t begin = 0;
+  while (begin <= specs.size()) {
+    size_t end = specs.find(';', begin);
+    if (end == std::string::npos)
+      end = specs.size();
+    add(specs.substr(begin, end - begin), excluding);
+    begin = end + 1;
+  }
+}
+
+void Journal::load(const std::string &p, uint64_t id) {
+  path = p;
+  done.clear();
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+    return;
+  unsigned char hdr[HDRSIZ];
+  uint32_t magic;
+  uint64_t fid;
+  if (fread(hdr, 1, HDRSIZ, f) == HDRSIZ) {
+    memcpy(&magic, hdr, 4);
+    memcpy(&fid, hdr + 4, 8);
+    unsigned char rec[RECSIZ];
+    // a torn record at the end is simply ignored
+    while (magic == MAGIC and fid == id and
+           fread(rec, 1, RECSIZ, f) == RECSIZ) {
+      Record r;
+      memcpy(&r.index, rec, 8);
+      memcpy(&r.cd_pos, rec + 8, 8);
+      memcpy(&r.crc, rec + 16, 4);
+      memcpy(&r.size, rec + 20, 8);
+      done.push_back(r);
+    }
+  }
+  fclose(f);
+}
+
+static void write_record(FILE *f, const Journal::Record &r, IoCounters *job) {
+  unsigned char rec[Journal::RECSIZ];
+  memcpy(rec, &r.index, 8);
+  memcpy(rec + 8, &r.cd_pos, 8);
+  memcpy(rec + 16, &r.crc, 4);
+  memcpy(rec + 20, &r.size, 8);
+  write_file(f, (const char *)rec, Journal::RECSIZ, job);
+}
+
+// fflush() and fsync() of f
+static bool sync_file(FILE *f, IoCounters *job) {
+  if (fflush(f) != 0)
+    return false;
+  uint64_t start = Metrics::now_ns();
+  int res = Syncer::sync_fd(fileno(f));
+  uint64_t ns = Metrics::now_ns() - start;
+  Metrics::synced.add(0, ns);
+  if (job != nullptr)
+    job->add(0, ns);
+  return res == 0;
+}
+
+void Journal::start(size_t n, uint64_t id) {
+  done.resize(std::min(n, done.size()));
+  unsynced.clear();
+  pending_bytes = 0;
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr)
+    throw FileError("Failed to create the extraction journal");
+  unsigned char hdr[HDRSIZ];
+  uint32_t magic = MAGIC;
+  memcpy(hdr, &magic, 4);
+  memcpy(hdr + 4, &id, 8);
+  bool ok;
+  try {
+    write_file(f, (const char *)hdr, HDRSIZ, written);
+    for (auto &r : done)
+      write_record(f, r, written);
+    ok = sync_file(f, synced);
+  } catch (FileError &e) {
+    ok = false;
+  }
+  ok = fclose(f) == 0 and ok;
+  std::error_code ec;
+  if (ok)
+    fs::rename(tmp, path, ec);
+  if (!ok or ec) {
+    fs::remove(tmp, ec);
+    throw FileError("Failed to write the extraction journal");
+  }
+  Syncer::sync_dir(fs::path(path).parent_path().string(), synced);
+  file = fopen(path.c_str(), "ab");
+  if (file == nullptr)
+    throw FileError("Failed to open the extraction journal");
+}
+
+void Journal::flush() {
+  if (file == nullptr or unsynced.empty())
+    return;
+#ifndef _WIN32
+  // one syncfs() for all the files of the records, Extractor::begin() has
+  // every file synced by itself where there is no syncfs()
+  int fd = ::open(data_dir.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw FileError("Failed to sync the staging folder");
+  int res = Syncer::sync_fs(fd, synced);
+  ::close(fd);
+  if (res != 0)
+    throw FileError("Failed to sync the staging folder");
+#endif
+  for (auto &r : unsynced)
+    write_record(file, r, written);
+  if (!sync_file(file, synced))
+    throw FileError("Failed to write the extraction journal");
+  unsynced.clear();
+  pending_bytes = 0;
+}
+
+Extractor::Extractor(Archive *a, std::string output_dir_path,
+                     std::string zip_path) {
+  if (!valid_output(output_dir_path)) {
+    throw Extractor::Error("Output folder isn't valid.");
+  }
+  out_path = output_dir_path;
+  zip = zip_path;
+#ifdef _WIN32
+  out_path.append("\\");
+#else
+  out_path.append("/");
+#endif
+  dir_path = out_path;
+  archive = a;
+  metrics.stream = a->stream;
+  metrics.written_from = &dir_sink.written;
+  metrics.synced_from = &syncer.synced;
+  journal.written = &dir_sink.written;
+  journal.synced = &syncer.synced;
+  dir_sink.root = dir_path;
+  dir_sink.out_path = out_path;
+}
+
+Extractor::Extractor(Archive *a, OutputSink *s, std::string zip_path) {
+  archive = a;
+  metrics.stream = a->stream;
+  sink = s;
+  zip = zip_path;
+  if (!sink->random_access()) {
+    huge.threads = 1;
+    unpacker.threads = 1;
+  }
+}
+
+void Extractor::begin() {
+  if (!to_dir())
+    return;
+  try {
+    std::string prefix;
+    fs::path base = staging_base(out_path, &prefix, &whole);
+    sweep_trash(base);
+    if (resumable) {
+      // a fixed name, so that a later run finds what this one left behind
+      char id[17];
+      snprintf(id, sizeof(id), "%016llx", (unsigned long long)archive->id());
+      staging = base / (prefix + "-" + id);
+      fs::create_directory(staging);
+      journal.load(staging.string() + ".journal", archive->id());
+      journal.data_dir = staging.string();
+#ifndef __linux__
+      syncer.policy = SyncPolicy::PER_FILE;
+#endif
+    } else {
+      staging = create_temp_work_dir(prefix, base);
+    }
+  } catch (std::filesystem::filesystem_error &e) {
+    throw Extractor::Error("Failed to create a staging folder.");
+  }
+  dir_path = (staging / "").string();
+  dir_sink.root = dir_path;
+}
+
+void Extractor::scan_dest() {
+  dest.root = out_path;
+  Archive::Entry entry;
+  int res = archive->go_to_first_entry(&entry);
+  while (res == MZ_OK and !archive->cancel) {
+    if (entry.load_info() == MZ_OK and filter.match(entry.get_name())) {
+      std::string name = entry.get_name();
+      size_t slash = name.rfind('/');
+      dest.scan(slash == std::string::npos ? "" : name.substr(0, slash + 1));
+    }
+    res = archive->get_next_entry(&entry);
+  }
+}
+
+bool Extractor::unchanged(Archive::Entry *entry) {
+  if (incremental == Incremental::OFF or entry->is_dir() or
+      entry->is_symlink())
+    return false;
+  DestIndex::Stat st;
+  if (!dest.find(entry->get_name(), &st) or
+      st.size != entry->entry->uncompressed_size)
+    return false;
+  if (incremental == Incremental::METADATA)
+    return st.mtime == entry->entry->modified_date;
+  uint32_t crc;
+  return file_crc32(out_path + entry->get_name(), &crc) and
+         crc == entry->entry->crc;
+}
+
+bool Extractor::verify(Archive::Entry *entry, const Journal::Record &r) {
+  if (archive->go_to_entry(entry, r.cd_pos) != MZ_OK or
+      entry->load_info() != MZ_OK)
+    return false;
+  std::error_code ec;
+  fs::path path = fs::path(dir_path) / entry->get_name();
+  auto st = fs::symlink_status(path, ec);
+  if (!fs::exists(st) and unchanged(entry))
+    return true;
+  if (entry->is_dir())
+    return fs::is_directory(st);
+  if (entry->is_symlink())
+    return fs::is_symlink(st);
+  // a record is only written once its data was synced, so nothing is read
+  // back here
+  return fs::is_regular_file(st) and
+         fs::file_size(path, ec) == (uintmax_t)r.size and
+         entry->entry->uncompressed_size == r.size and
+         entry->entry->crc == r.crc;
+}
+
+int Extractor::resume(Archive::Entry *entry, uint64_t *index,
+                      void (*cb)(bool, bool, std::string, void *), void *ctx) {
+  uint64_t id = archive->id();
+  for (size_t i = 0; i < journal.done.size(); i++) {
+    Journal::Record r = journal.done[i];
+    if (!verify(entry, r)) {
+      journal.start(i, id);
+      *index = r.index;
+      return archive->go_to_entry(entry, r.cd_pos);
+    }
+    cb(false, false, zip, ctx);
+  }
+  journal.start(journal.done.size(), id);
+  if (journal.done.empty()) {
+    *index = 0;
+    return archive->go_to_first_entry(entry);
+  }
+  Journal::Record last = journal.done.back();
+  *index = last.index + 1;
+  int res = archive->go_to_entry(entry, last.cd_pos);
+  if (res != MZ_OK)
+    return res;
+  return archive->get_next_entry(entry);
+}
+
+bool Extractor::extract_entry(Archive::Entry *entry,
+                              bool (*excb)(const char *, size_t, bool, void *),
+                              void *ctx) {
+  std::string name = entry->get_name();
+
+  // printf("extracting %s\n", name.c_str());
+
+  std::string shown;
+  if (sink->exists(name, &shown) and
+      !excb(shown.c_str(), shown.length(), entry->is_dir(), ctx))
+    return false;
+  time_t mtime = entry->mtime();
+  if (entry->is_dir()) {
+    sink->dir(name, mtime);
+    return false;
+  }
+  if (entry->is_symlink()) {
+    std::string link_data = "";
+    if (entry->r2s(&link_data) != 0) {
+      throw Extractor::Error("Failed to read a symlink");
+    }
+    sink->symlink(name, link_data, mtime);
+    return true;
+  }
+  sink->begin_file(name, entry->size(), mtime);
+  try {
+    if (entry->raw and
+        (HugeInflater::wants(entry) or Unpacker::wants(entry))) {
+      if (Unpacker::wants(entry))
+        unpacker.unpack(entry, sink);
+      else
+        huge.inflate(entry, sink);
+    } else if (entry->raw and !entry->is_stored()) {
+      const char *error = inflater.inflate(entry);
+      if (error != nullptr)
+        throw Extractor::Error(error);
+      sink->write(inflater.out.get(), entry->size());
+    } else if (entry->write_to(sink) == -1) {
+      throw Extractor::Error("Failed to write to file");
+    }
+  } catch (DecodeError &e) {
+    sink->abort_file();
+    throw Extractor::Error(e.message + " in " + name);
+  } catch (...) {
+    sink->abort_file();
+    throw;
+  }
+  sink->end_file();
+  return true;
+}
+
+void Extractor::replace(const fs::path &src, const fs::path &dst) {
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+  if (renameat2(AT_FDCWD, src.c_str(), AT_FDCWD, dst.c_str(),
+                RENAME_EXCHANGE) == 0)
+    return;
+  if (errno != EINVAL and errno != ENOSYS)
+    throw Extractor::Error("Failed to publish " + dst.string() + ": " +
+                           generic_error_msg());
+#endif
+  std::error_code ec;
+  fs::rename(src, dst, ec);
+  if (!ec)
+    return;
+  // rename() can't replace a folder with a file or vice versa
+  fs::remove_all(dst, ec);
+  fs::rename(src, dst, ec);
+  if (ec)
+    throw Extractor::Error("Failed to publish " + dst.string() + ": " +
+                           ec.message());
+}
+
+void Extractor::publish(const fs::path &src, const fs::path &dst,
+                        Syncer *syncer, std::vector<fs::path> *left) {
+  std::vector<fs::directory_entry> children;
+  try {
+    for (auto &child : fs::directory_iterator(src))
+      children.push_back(child);
+  } catch (...) {
+    left->push_back(src);
+    throw;
+  }
+  for (size_t i = 0; i < children.size(); i++) {
+    auto &child = children[i];
+    fs::path to = dst / child.path().filename();
+    // a folder being merged adds what it didn't move itself
+    size_t kept = i;
+    try {
+      std::error_code ec;
+      auto st = fs::symlink_status(to, ec);
+      if (!fs::exists(st)) {
+        fs::rename(child.path(), to, ec);
+        if (ec)
+          throw Extractor::Error("Failed to publish " + to.string() + ": " +
+                                 ec.message());
+      } else if (child.is_directory() and !child.is_symlink() and
+                 fs::is_directory(st)) {
+        kept = i + 1;
+        publish(child.path(), to, syncer, left);
+      } else {
+        replace(child.path(), to);
+      }
+    } catch (...) {
+      for (size_t k = kept; k < children.size(); k++)
+        left->push_back(children[k].path());
+      throw;
+    }
+  }
+  syncer->published(dst.string());
+}
+
+bool Extractor::valid_output(const std::string &out_path) {
+  std::error_code ec;
+  if (fs::is_directory(out_path, ec))
+    return true;
+  fs::path out = fs::absolute(out_path, ec);
+  if (ec)
+    return false;
+  if (!out.has_filename())
+    out = out.parent_path();
+  return fs::symlink_status(out, ec).type() == fs::file_type::not_found and
+         fs::is_directory(out.parent_path(), ec);
+}
+
+fs::path Extractor::staging_base(const std::string &out_path,
+                                 std::string *prefix, bool *whole) {
+  fs::path out = fs::absolute(out_path);
+  if (!out.has_filename())
+    out = out.parent_path();
+  std::error_code ec;
+  *whole = fs::symlink_status(out, ec).type() == fs::file_type::not_found;
+  if (!*whole) {
+    *prefix = ".zipcombiner";
+    return out;
+  }
+  *prefix = "." + out.filename().string() + ".zipcombiner";
+  return out.parent_path();
+}
+
+void Extractor::publish_staging(const fs::path &staging,
+                                const std::string &out_path, bool whole,
+                                Syncer *syncer) {
+  if (whole) {
+    fs::path out = fs::absolute(out_path);
+    if (!out.has_filename())
+      out = out.parent_path();
+    std::error_code ec;
+    fs::rename(staging, out, ec);
+    if (!ec) {
+      syncer->published(out.parent_path().string());
+      return;
+    }
+    // out_path was made since, staging is merged into it
+  }
+  std::vector<fs::path> left;
+  try {
+    publish(staging, out_path, syncer, &left);
+  } catch (std::exception &e) {
+    enum { SHOWN = 10 };
+    std::string message = e.what();
+    message += ". Not published, still in " + staging.string() + ":";
+    for (size_t i = 0; i < left.size() and i < SHOWN; i++)
+      message += " " + left[i].lexically_relative(staging).string();
+    if (left.size() > SHOWN)
+      message += " and " + std::to_string(left.size() - SHOWN) + " more";
+    throw Extractor::Error(message);
+  }
+  // what was replaced ended up in there
+  discard_dir(staging);
+}
+
+void Extractor::commit() {
+  if (!to_dir())
+    return;
+  syncer.finish(dir_path);
+  try {
+    publish_staging(staging, out_path, whole, &syncer);
+  } catch (...) {
+    // what's in staging now may be all that's left of some entries, so
+    // undo() must not drop it
+    staging.clear();
+    throw;
+  }
+  if (resumable)
+    journal.remove();
+  staging.clear();
+}
+
+void Extractor::extract(void (*cb)(bool, bool, std::string, void *),
+                        bool (*excb)(const char *, size_t, bool, void *),
+                        void *ctx) {
+  int res;
+  Archive::Entry entry;
+  uint64_t index = 0;
+  metrics.begin();
+  begin();
+  try {
+    if (incremental != Incremental::OFF)
+      scan_dest();
+    if (resumable) {
+      res = resume(&entry, &index, cb, ctx);
+    } else {
+      res = archive->go_to_first_entry(&entry);
+    }
+    while (res == MZ_OK and !archive->cancel) {
+      int64_t cd_pos = archive->entry_pos();
+      // entries that are left out cost a central directory record only,
+      // their local header and data are never read
+      if (entry.load_info() == MZ_OK and
+          (!filter.match(entry.get_name()) or unchanged(&entry))) {
+        index++;
+        cb(false, false, zip, ctx);
+        res = archive->get_next_entry(&entry);
+        continue;
+      }
+      uint64_t started = Metrics::now_ns();
+      // stored data, small and huge deflated files, zstd and LZMA bypass
+      // minizip, see Archive::Entry::raw
+      bool file = !entry.is_dir() and !entry.is_symlink();
+      res = entry.read_open(entry.is_stored() or
+                            (file and (Inflater::wants(&entry) or
+                                       HugeInflater::wants(&entry) or
+                                       Unpacker::wants(&entry))));
+      if (res != MZ_OK)
+        throw Extractor::Error();
+      bool read = extract_entry(&entry, excb, ctx);
+      res = entry.read_close();
+      if (!archive->cancel and read and
+          (res == MZ_CRC_ERROR or !entry.crc_ok())) {
+        throw Extractor::Error(std::string("CRC mismatch in ") +
+                               entry.get_name());
+      }
+      metrics.entry_done(started);
+      if (resumable) {
+        journal.append({index, cd_pos, entry.entry->crc,
+                        entry.entry->uncompressed_size});
+      }
+      index++;
+      cb(false, false, zip, ctx);
+      res = archive->get_next_entry(&entry);
+    }
+
+    if (res == MZ_END_OF_LIST) {
+      commit();
+      metrics.end();
+      cb(true, false, zip, ctx);
+    } else if (archive->cancel) {
+      if (resumable)
+        keep();
+      else
+        undo();
+      metrics.end();
+      cb(true, true, zip, ctx);
+    } else {
+      if (res != MZ_OK) {
+        throw Extractor::Error();
+      }
+    }
+  } catch (...) {
+    metrics.end();
+    if (resumable)
+      keep();
+    else
+      undo();
+    throw;
+  }
+}
+
+void Extractor::keep() noexcept {
+  try {
+    journal.flush();
+  } catch (std::exception &e) {
+  }
+  journal.close();
+}
+
+void Extractor::undo() noexcept {
+  if (staging.empty())
+    return;
+  discard_dir(staging);
+  staging.clear();
+  if (resumable)
+    journal.remove();
+}
+
+size_t StreamReader::fill(size_t n) {
+  if (end - pos >= n or eof)
+    return end - pos;
+  memmove(buf.get(), buf.get() + pos, end - pos);
+  end -= pos;
+  pos = 0;
+  while (end < n and !eof) {
+#ifdef _WIN32
+    uint64_t start = Metrics::now_ns();
+    int r = _read(fd, buf.get() + end, buf.size - end);
+    io.add(r > 0 ? r : 0, Metrics::now_ns() - start);
+#else
+    uint64_t start = Metrics::now_ns();
+    ssize_t r = ::read(fd, buf.get() + end, buf.size - end);
+    io.add(r > 0 ? r : 0, Metrics::now_ns() - start);
+    if (r < 0 and errno == EINTR)
+      continue;
+#endif
+    if (r < 0) {
+      io.error();
+      throw FileError("Failed to read the archive stream");
+    }
+    if (r == 0)
+      eof = true;
+    end += r;
+  }
+  return end - pos;
+}
+
+void StreamReader::take(char *dst, int64_t len) {
+  while (len > 0) {
+    size_t n = std::min<int64_t>(fill(1), len);
+    if (n == 0)
+      throw Error("The archive stream ended early");
+    memcpy(dst, buf.get() + pos, n);
+    consume(n);
+    dst += n;
+    len -= n;
+  }
+}
+
+void StreamReader::skip(int64_t len) {
+  while (len > 0) {
+    size_t n = std::min<int64_t>(fill(1), len);
+    if (n == 0)
+      throw Error("The archive stream ended early");
+    consume(n);
+    len -= n;
+  }
+}
+
+bool StreamReader::next(Header *h) {
+  if (fill(4) < 4)
+    return false;
+  uint32_t sig = le32(buf.get() + pos);
+  // split archives start with a marker
+  if (offset == 0 and (sig == DESCRIPTOR_SIG or sig == SPAN_SIG)) {
+    consume(4);
+    if (fill(4) < 4)
+      return false;
+    sig = le32(buf.get() + pos);
+  }
+  if (sig == CENTRAL_SIG or sig == END_SIG)
+    return false;
+  if (sig != LOCAL_SIG)
+    throw Error("Bad local header at offset " + std::to_string(offset));
+  if (fill(30) < 30)
+    throw Error("The archive stream ended early");
+  const char *p = buf.get() + pos;
+  size_t name_len = le16(p + 26), extra_len = le16(p + 28);
+  size_t hdr_len = 30 + name_len + extra_len;
+  if (fill(hdr_len) < hdr_len)
+    throw Error("The archive stream ended early");
+  p = buf.get() + pos;
+  h->flag = le16(p + 6);
+  h->method = le16(p + 8);
+  h->mtime = mz_zip_dosdate_to_time_t(le32(p + 10));
+  h->crc = le32(p + 14);
+  h->compressed_size = le32(p + 18);
+  h->size = le32(p + 22);
+  h->name.assign(p + 30, name_len);
+  h->zip64 = false;
+  // the zip64 extra field has the sizes that didn't fit, in this order
+  const char *x = p + 30 + name_len, *x_end = x + extra_len;
+  while (x + 4 <= x_end) {
+    uint16_t id = le16(x), len = le16(x + 2);
+    const char *f = x + 4, *f_end = std::min(f + len, x_end);
+    if (id == 0x0001) {
+      h->zip64 = true;
+      if (h->size == 0xffffffff and f + 8 <= f_end) {
+        h->size = le64(f);
+        f += 8;
+      }
+      if (h->compressed_size == 0xffffffff and f + 8 <= f_end)
+        h->compressed_size = le64(f);
+    }
+    x = f_end;
+  }
+  consume(hdr_len);
+  data_start = offset;
+  return true;
+}
+
+int64_t StreamReader::inflate_data(Header *h, decode_sink_fn sink, void *ctx,
+                                   uint32_t *crc) {
+  Trace::Scope ts("StreamReader::inflate_data");
+  z_stream strm = {};
+  if (inflateInit2(&strm, -15) != Z_OK)
+    throw Error("Out of memory");
+  PoolBuffer out(BUFSIZE);
+  int64_t total = 0;
+  int ret = Z_OK;
+  try {
+    while (ret != Z_STREAM_END) {
+      size_t avail = fill(1);
+      if (avail == 0)
+        throw Error("The archive stream ended early");
+      strm.next_in = (Bytef *)buf.get() + pos;
+      strm.avail_in = avail;
+      strm.next_out = (Bytef *)out.get();
+      strm.avail_out = out.size;
+      ret = inflate(&strm, Z_NO_FLUSH);
+      if (ret != Z_OK and ret != Z_STREAM_END and ret != Z_BUF_ERROR)
+        throw Error("Entry data is corrupt in " + h->name);
+      consume(avail - strm.avail_in);
+      size_t got = out.size - strm.avail_out;
+      if (got == 0)
+        continue;
+      *crc = crc32_update(*crc, out.get(), got);
+      if (!sink(ctx, out.get(), got, total)) {
+        inflateEnd(&strm);
+        return -1;
+      }
+      total += got;
+    }
+  } catch (...) {
+    inflateEnd(&strm);
+    throw;
+  }
+  inflateEnd(&strm);
+  return total;
+}
+
+bool StreamReader::read_data(Header *h, decode_sink_fn sink, void *ctx) {
+  if (h->flag & 1)
+    throw Error(h->name + ": encrypted entries can't be read from a stream");
+  if (h->has_descriptor() and h->method != MZ_COMPRESS_METHOD_DEFLATE)
+    throw Error(h->name + ": only deflated entries with a data descriptor "
+                          "can be read from a stream");
+  uint32_t crc = 0;
+  int64_t size = h->size;
+  bool done = true;
+  switch (h->method) {
+  case MZ_COMPRESS_METHOD_STORE: {
+    int64_t left = h->compressed_size;
+    while (done and left > 0) {
+      size_t n = std::min<int64_t>(fill(1), left);
+      if (n == 0)
+        throw Error("The archive stream ended early");
+      crc = crc32_update(crc, buf.get() + pos, n);
+      done = sink(ctx, buf.get() + pos, n, h->compressed_size - left);
+      consume(n);
+      left -= n;
+    }
+    break;
+  }
+  case MZ_COMPRESS_METHOD_DEFLATE:
+    size = inflate_data(h, sink, ctx, &crc);
+    done = size != -1;
+    break;
+  case MZ_COMPRESS_METHOD_ZSTD:
+    done = ZstdFrames::decode(read_cb, this, 0, h->compressed_size, 0, sink,
+                              ctx, &crc);
+    break;
+  case MZ_COMPRESS_METHOD_LZMA:
+    done = LzmaDecoder::decode(read_cb, this, h->compressed_size, h->size,
+                               sink, ctx, &crc);
+    break;
+  default:
+    throw Error(h->name + ": compression method " +
+                Archive::Entry::method_name(h->method) +
+                " can't be read from a stream");
+  }
+  if (!done)
+    return false;
+  if (h->has_descriptor()) {
+    // the signature is optional, sizes are 8 bytes for zip64 entries
+    size_t len = h->zip64 ? 20 : 12;
+    if (fill(4) >= 4 and le32(buf.get() + pos) == DESCRIPTOR_SIG)
+      consume(4);
+    if (fill(len) < len)
+      throw Error("The archive stream ended early");
+    const char *p = buf.get() + pos;
+    h->crc = le32(p);
+    h->compressed_size = h->zip64 ? le64(p + 4) : le32(p + 4);
+    h->size = h->zip64 ? le64(p + 12) : le32(p + 8);
+    consume(len);
+  }
+  if (size != h->size)
+    throw Error("Size mismatch in " + h->name);
+  if (crc != h->crc)
+    throw Error("CRC mismatch in " + h->name);
+  return true;
+}
+
+void StreamExtractor::extract_entry(
+    StreamReader::Header *h, bool (*excb)(const char *, size_t, bool, void *),
+    void *ctx) {
+  std::string shown;
+  if (sink->exists(h->name, &shown) and
+      !excb(shown.c_str(), shown.length(), h->is_dir(), ctx)) {
+    reader.skip_data(h);
+    return;
+  }
+  if (h->is_dir()) {
+    sink->dir(h->name, h->mtime);
+    reader.skip_data(h);
+    return;
+  }
+  uint64_t started = Metrics::now_ns();
+  sink->begin_file(h->name, h->has_descriptor() ? -1 : h->size, h->mtime);
+  try {
+    reader.read_data(h, write_cb, this);
+  } catch (...) {
+    sink->abort_file();
+    throw;
+  }
+  sink->end_file();
+  metrics.entry_done(started);
+}
+
+void StreamExtractor::extract(void (*cb)(bool, bool, std::string, void *),
+                              bool (*excb)(const char *, size_t, bool, void *),
+                              void *ctx) {
+  metrics.begin();
+  try {
+    if (to_dir()) {
+      std::string prefix;
+      fs::path base = Extractor::staging_base(out_path, &prefix, &whole);
+      sweep_trash(base);
+      staging = create_temp_work_dir(prefix, base);
+      dir_sink.root = (staging / "").string();
+    }
+  } catch (fs::filesystem_error &e) {
+    throw Extractor::Error("Failed to create a staging folder.");
+  }
+  try {
+    StreamReader::Header h;
+    while (!canceled and reader.next(&h)) {
+      if (filter.match(h.name.c_str()))
+        extract_entry(&h, excb, ctx);
+      else
+        reader.skip_data(&h);
+      cb(false, false, "-", ctx);
+    }
+    if (canceled) {
+      undo();
+      metrics.end();
+      cb(true, true, "-", ctx);
+      return;
+    }
+    reader.drain();
+    if (to_dir()) {
+      syncer.finish(staging.string());
+      try {
+        Extractor::publish_staging(staging, out_path, whole, &syncer);
+      } catch (...) {
+        // see Extractor::commit()
+        staging.clear();
+        throw;
+      }
+      staging.clear();
+    }
+    metrics.end();
+    cb(true, false, "-", ctx);
+  } catch (fs::filesystem_error &e) {
+    undo();
+    metrics.end();
+    throw Extractor::Error("Failed to publish extracted files.");
+  } catch (...) {
+    undo();
+    metrics.end();
+    throw;
+  }
+}
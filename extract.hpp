@@ -0,0 +1,552 @@
+#pragma once
+
+// Extractor writes the entries of an Archive to an OutputSink, StreamExtractor
+// does the same for an archive read front to back from a pipe. The decoders
+// they use and the bookkeeping for resuming and skipping come first.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <libdeflate.h>
+
+#include "archive.hpp"
+#include "decode.hpp"
+#include "fileio.hpp"
+#include "mempool.hpp"
+#include "metrics.hpp"
+#include "sink.hpp"
+
+// Small deflated entries are read whole and inflated by libdeflate in a single
+// call, which is a lot cheaper than streaming them through minizip and zlib
+// RBUFSIZ bytes at a time. The buffers come from the MemoryPool and are kept
+// for the next entry.
+struct Inflater {
+  enum { SMALL = 1 << 20, MIN_BUF = 64 << 10 };
+
+  libdeflate_decompressor *d;
+  PoolBuffer in;
+  PoolBuffer out;
+
+  Inflater() {
+    d = libdeflate_alloc_decompressor();
+    if (d == nullptr)
+      throw std::bad_alloc();
+  }
+
+  ~Inflater() { libdeflate_free_decompressor(d); }
+
+  Inflater(const Inflater &) = delete;
+  Inflater &operator=(const Inflater &) = delete;
+
+  static bool wants(Archive::Entry *e) {
+    return e->method() == MZ_COMPRESS_METHOD_DEFLATE and
+           !(e->entry->flag & MZ_ZIP_FLAG_ENCRYPTED) and
+           e->size() <= SMALL and e->compressed_size() <= SMALL + SMALL / 8;
+  }
+
+  // Inflates the raw-opened entry e into out, checking size and CRC.
+  // Returns nullptr on success or what went wrong.
+  const char *inflate(Archive::Entry *e);
+};
+
+// Where the decoders below read a raw-opened entry from and write it to.
+// They read the archive at offsets and may write the file out of order, so
+// they don't go through minizip's stream.
+struct EntryData {
+  Archive *archive;
+  int64_t base;
+  OutputSink *sink;
+
+  // base is -1 if the local header is bad
+  EntryData(Archive::Entry *e, OutputSink *s) {
+    archive = e->archive;
+    base = archive->data_offset(e);
+    sink = s;
+  }
+
+  static int64_t read_cb(void *ctx, char *buf, int64_t len, int64_t offt) {
+    EntryData *d = (EntryData *)ctx;
+    return d->archive->stream->read_at(buf, len, d->base + offt);
+  }
+
+  static bool write_at_cb(void *ctx, const char *buf, size_t len,
+                          int64_t offt) {
+    EntryData *d = (EntryData *)ctx;
+    d->sink->write_at(buf, len, offt);
+    return !d->archive->cancel;
+  }
+
+  // for testing, when only the CRC of the output is needed
+  static bool discard_cb(void *ctx, const char *buf, size_t len,
+                         int64_t offt) {
+    (void)buf;
+    (void)len;
+    (void)offt;
+    return !((EntryData *)ctx)->archive->cancel;
+  }
+};
+
+// Deflated entries of BIG bytes or more go through an InflateIndex. The first
+// time an entry is inflated on one thread while its checkpoints are recorded
+// and saved to the IndexFile, after that it's inflated by several threads at
+// once, each one writing its own part of the file.
+struct HugeInflater {
+  enum : int64_t { BIG = 64ll << 20 };
+
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+  static bool wants(Archive::Entry *e) {
+    return e->method() == MZ_COMPRESS_METHOD_DEFLATE and
+           !(e->entry->flag & MZ_ZIP_FLAG_ENCRYPTED) and e->size() >= BIG;
+  }
+
+  // Inflates the raw-opened entry e into the file sink began last and sets
+  // its crc_value. Throws DecodeError if the data is bad.
+  void inflate(Archive::Entry *e, OutputSink *sink);
+};
+
+// zstd and LZMA entries are decoded here rather than by minizip, with larger
+// buffers and, for zstd data made of sized frames, on several threads.
+struct Unpacker {
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+  static bool wants(Archive::Entry *e) {
+    return (e->method() == MZ_COMPRESS_METHOD_ZSTD or
+            e->method() == MZ_COMPRESS_METHOD_LZMA) and
+           !(e->entry->flag & MZ_ZIP_FLAG_ENCRYPTED);
+  }
+
+  // Decodes the raw-opened entry e into the file out began last, or only
+  // checks it if out is nullptr, and sets its crc_value. Throws DecodeError if
+  // the data is bad.
+  void unpack(Archive::Entry *e, OutputSink *out);
+};
+
+// Size and mtime of the regular files already present in an output folder,
+// gathered one folder at a time instead of one stat() per entry path.
+struct DestIndex {
+  struct Stat {
+    int64_t size;
+    time_t mtime;
+  };
+
+  std::string root;
+  std::unordered_map<std::string, Stat> files;
+  std::unordered_set<std::string> scanned;
+
+  // rel is a folder relative to root, empty or ending with '/'.
+  void scan(const std::string &rel);
+
+  bool find(const std::string &name, Stat *out);
+};
+
+// Decides which entries get extracted. An entry is taken when it matches an
+// include (or there are none) and no exclude. Patterns are globs, "re:" makes
+// them an ECMAScript regex and "@" reads exact entry names from a file.
+struct Filter {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "Invalid filter") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  struct Set {
+    std::vector<std::string> globs;
+    std::vector<std::regex> regexes;
+    std::unordered_set<std::string> names;
+
+    bool empty() {
+      return globs.empty() and regexes.empty() and names.empty();
+    }
+
+    bool match(const char *name);
+  };
+
+  Set include;
+  Set exclude;
+
+  // '*' and '?' stop at '/', "**" doesn't. "[...]" is a character class.
+  static bool glob(const char *pat, const char *s);
+
+  void add(const std::string &spec, bool excluding);
+
+  // Adds each of the ';' separated patterns in specs.
+  void add_all(const std::string &specs, bool excluding);
+
+  bool match(const char *name) {
+    if (!include.empty() and !include.match(name))
+      return false;
+    return exclude.empty() or !exclude.match(name);
+  }
+};
+
+// Append-only list of the entries a job has finished, kept next to its staging
+// folder so that an interrupted extraction can continue where it stopped.
+// Records wait in unsynced until flush(), which first puts the files they
+// stand for on disk and then syncs the journal, so that a record never
+// outlives its data in a power loss, and resuming only has to check that the
+// staged files are there with their sizes.
+struct Journal {
+  struct Record {
+    uint64_t index;
+    int64_t cd_pos;
+    uint32_t crc;
+    int64_t size;
+  };
+
+  enum { MAGIC = 0x314a435a, HDRSIZ = 12, RECSIZ = 28 };
+  enum { FLUSH_EVERY = 64, FLUSH_BYTES = 64 << 20 };
+
+  std::string path;
+  // the staging folder the records are about
+  std::string data_dir;
+  FILE *file = nullptr;
+  std::vector<Record> done;
+  std::vector<Record> unsynced;
+  int64_t pending_bytes = 0;
+  // the job's counters, besides Metrics'
+  IoCounters *written = nullptr;
+  IoCounters *synced = nullptr;
+
+  // Loads the records of a previous run of job id, if any.
+  void load(const std::string &p, uint64_t id);
+
+  // Keeps the first n loaded records and opens the journal for appending.
+  // The kept ones are written to a new file that replaces the old one with
+  // a rename, so a crash meanwhile loses nothing.
+  void start(size_t n, uint64_t id);
+
+  void append(const Record &r) {
+    unsynced.push_back(r);
+    pending_bytes += r.size;
+    if (unsynced.size() >= FLUSH_EVERY or pending_bytes >= FLUSH_BYTES)
+      flush();
+  }
+
+  void flush();
+
+  void close() noexcept {
+    if (file == nullptr)
+      return;
+    fclose(file);
+    file = nullptr;
+  }
+
+  void remove() noexcept {
+    close();
+    unsynced.clear();
+    std::error_code ec;
+    fs::remove(path, ec);
+  }
+};
+
+struct Extractor {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "An error ocurred while extracting") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  Archive *archive;
+  // entries are written below dir_path, a staging folder inside out_path,
+  // and only moved into out_path once the whole archive went through. If
+  // out_path doesn't exist yet, staging is next to it and whole is set.
+  std::string dir_path;
+  std::string out_path;
+  fs::path staging;
+  bool whole = false;
+  std::string zip;
+  Syncer syncer;
+  bool resumable = false;
+  Journal journal;
+  // OFF extracts everything. METADATA skips files whose size and mtime already
+  // match the entry, CRC skips files whose size and content CRC match.
+  enum class Incremental { OFF, METADATA, CRC };
+  Incremental incremental = Incremental::OFF;
+  DestIndex dest;
+  Filter filter;
+  Inflater inflater;
+  HugeInflater huge;
+  Unpacker unpacker;
+  // entries go to dir_sink unless another sink was given, in which case
+  // there is no staging folder and nothing to resume or skip
+  DirSink dir_sink{&syncer};
+  OutputSink *sink = &dir_sink;
+  // filled in by extract(), also when it fails
+  JobMetrics metrics;
+
+  Extractor(Archive *a, std::string output_dir_path, std::string zip_path);
+
+  Extractor(Archive *a, OutputSink *s, std::string zip_path);
+
+  bool to_dir() { return sink == &dir_sink; }
+
+  void begin();
+
+  // Reads every folder the archive will write to once, up front.
+  void scan_dest();
+
+  // True if the output folder already holds this entry, so it needs neither
+  // decompressing nor writing. Only looks at the central directory record.
+  bool unchanged(Archive::Entry *entry);
+
+  // True if what a previous run staged for r is still there.
+  bool verify(Archive::Entry *entry, const Journal::Record &r);
+
+  // Positions the archive on the first entry that still has to be extracted,
+  // jumping over finished ones without reading any of their data.
+  int resume(Archive::Entry *entry, uint64_t *index,
+             void (*cb)(bool, bool, std::string, void *), void *ctx);
+
+  // Returns false if no data was read, for a folder or a file that excb said
+  // to leave alone.
+  bool extract_entry(Archive::Entry *entry,
+                     bool (*excb)(const char *, size_t, bool, void *),
+                     void *ctx);
+
+  // Swaps src into dst. Whatever was at dst ends up at src, i.e. inside the
+  // staging folder, and is deleted together with it.
+  static void replace(const fs::path &src, const fs::path &dst);
+
+  // Moves the staged tree src into dst. Folders that already exist in dst
+  // are merged, everything else is moved with a single rename. If a move
+  // fails, what wasn't moved yet is added to left before it throws.
+  static void publish(const fs::path &src, const fs::path &dst, Syncer *syncer,
+                      std::vector<fs::path> *left);
+
+  // True if out_path is a folder, or doesn't exist but its parent does.
+  static bool valid_output(const std::string &out_path);
+
+  // The folder a staging folder for out_path goes in and the start of its
+  // name: out_path itself, or next to it if out_path doesn't exist, in
+  // which case *whole is set.
+  static fs::path staging_base(const std::string &out_path,
+                               std::string *prefix, bool *whole);
+
+  // Moves staging into out_path, with a single rename if whole, and deletes
+  // what's left of it. If merging fails midway, staging is kept with what
+  // wasn't published and the error lists that.
+  static void publish_staging(const fs::path &staging,
+                              const std::string &out_path, bool whole,
+                              Syncer *syncer);
+
+  void commit();
+
+  static void no_progress_cb(bool done, bool cancel, std::string zip,
+                             void *ctx) {
+    (void)done;
+    (void)cancel;
+    (void)zip;
+    (void)ctx;
+  }
+
+  static bool replace_cb(const char *file_name, size_t file_name_len,
+                         bool is_dir, void *ctx) {
+    (void)file_name;
+    (void)file_name_len;
+    (void)is_dir;
+    (void)ctx;
+    return true;
+  }
+
+  // For callers that need no progress and replace what's already there.
+  void extract() { extract(no_progress_cb, replace_cb, nullptr); }
+
+  void extract(void (*cb)(bool, bool, std::string, void *),
+               bool (*excb)(const char *, size_t, bool, void *), void *ctx);
+
+  // Drops everything written so far. Nothing was published yet, so the output
+  // folder is left exactly as it was before the extraction started. The
+  // staging folder is renamed away and deleted in the background.
+  void undo() noexcept;
+
+  // Leaves the staging folder and journal for a later run to resume from.
+  void keep() noexcept;
+
+  void cancel() { archive->cancel = true; }
+};
+
+// Reads an archive front to back from a pipe, going by the local headers
+// alone since the central directory only comes at the end and nothing can be
+// read twice. Sizes of entries with a data descriptor only follow their data,
+// so those have to be deflated, which marks its own end. Symlinks can't be
+// told from files, their attributes being in the central directory only.
+struct StreamReader {
+  enum { BUFSIZE = 256 << 10 };
+  enum : uint32_t {
+    LOCAL_SIG = 0x04034b50,
+    DESCRIPTOR_SIG = 0x08074b50,
+    CENTRAL_SIG = 0x02014b50,
+    END_SIG = 0x06054b50,
+    SPAN_SIG = 0x30304b50,
+  };
+
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "The archive stream is corrupt") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  struct Header {
+    std::string name;
+    uint16_t flag;
+    uint16_t method;
+    uint32_t crc;
+    int64_t compressed_size;
+    int64_t size;
+    time_t mtime;
+    bool zip64;
+
+    bool is_dir() { return !name.empty() and name.back() == '/'; }
+    bool has_descriptor() { return flag & 8; }
+  };
+
+  int fd;
+  PoolBuffer buf;
+  // what was read from fd
+  IoCounters io;
+  size_t pos = 0;
+  size_t end = 0;
+  bool eof = false;
+  // bytes consumed so far
+  int64_t offset = 0;
+  // where the data of the current entry starts
+  int64_t data_start = 0;
+
+  StreamReader(int in) : fd(in), buf(BUFSIZE) {}
+
+  static uint16_t le16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | u[1] << 8;
+  }
+
+  static uint32_t le32(const char *p) {
+    return le16(p) | (uint32_t)le16(p + 2) << 16;
+  }
+
+  static uint64_t le64(const char *p) {
+    return le32(p) | (uint64_t)le32(p + 4) << 32;
+  }
+
+  // Makes n bytes available, or fewer if the stream ends first. Takes what
+  // the pipe has instead of waiting for the buffer to fill up.
+  size_t fill(size_t n);
+
+  void consume(size_t n) {
+    pos += n;
+    offset += n;
+  }
+
+  // Copies exactly len bytes out of the stream.
+  void take(char *dst, int64_t len);
+
+  void skip(int64_t len);
+
+  // Reads whatever is left, so that the writer of a pipe isn't cut off.
+  void drain() {
+    while (fill(1) != 0)
+      consume(end - pos);
+  }
+
+  // Reads the next local header. Returns false at the central directory or
+  // at the end of the stream.
+  bool next(Header *h);
+
+  // For the decoders: the entry's data read in order, offt is where in it.
+  static int64_t read_cb(void *ctx, char *buf, int64_t len, int64_t offt) {
+    StreamReader *r = (StreamReader *)ctx;
+    if (r->data_start + offt != r->offset)
+      return -1;
+    r->take(buf, len);
+    return len;
+  }
+
+  static bool skip_cb(void *ctx, const char *buf, size_t len, int64_t offt) {
+    (void)ctx;
+    (void)buf;
+    (void)len;
+    (void)offt;
+    return true;
+  }
+
+  int64_t inflate_data(Header *h, decode_sink_fn sink, void *ctx,
+                       uint32_t *crc);
+
+  // Decodes the data of h into sink, then reads its data descriptor if it
+  // has one and checks the CRC. Returns false if sink stopped it.
+  bool read_data(Header *h, decode_sink_fn sink, void *ctx);
+
+  // Moves past the data of h without keeping it.
+  void skip_data(Header *h) {
+    if (h->has_descriptor())
+      read_data(h, skip_cb, nullptr);
+    else
+      skip(h->compressed_size);
+  }
+};
+
+// Extracts what a StreamReader reads as it arrives, with constant memory.
+// Like Extractor, files go to a staging folder inside the output folder and
+// are only published once the whole archive went through.
+struct StreamExtractor {
+  StreamReader reader;
+  std::string out_path;
+  fs::path staging;
+  bool whole = false;
+  Syncer syncer;
+  Filter filter;
+  volatile bool canceled = false;
+  DirSink dir_sink{&syncer};
+  OutputSink *sink = &dir_sink;
+  JobMetrics metrics;
+
+  StreamExtractor(int in, std::string output_dir_path) : reader(in) {
+    if (!Extractor::valid_output(output_dir_path))
+      throw Extractor::Error("Output folder isn't valid.");
+    out_path = (fs::path(output_dir_path) / "").string();
+    dir_sink.out_path = out_path;
+    metrics.piped = &reader.io;
+    metrics.written_from = &dir_sink.written;
+    metrics.synced_from = &syncer.synced;
+  }
+
+  StreamExtractor(int in, OutputSink *s) : reader(in) {
+    sink = s;
+    metrics.piped = &reader.io;
+  }
+
+  bool to_dir() { return sink == &dir_sink; }
+
+  static bool write_cb(void *ctx, const char *buf, size_t len, int64_t offt) {
+    (void)offt;
+    StreamExtractor *x = (StreamExtractor *)ctx;
+    x->sink->write(buf, len);
+    return !x->canceled;
+  }
+
+  void extract_entry(StreamReader::Header *h,
+                     bool (*excb)(const char *, size_t, bool, void *),
+                     void *ctx);
+
+  void extract(void (*cb)(bool, bool, std::string, void *),
+               bool (*excb)(const char *, size_t, bool, void *), void *ctx);
+
+  void undo() noexcept {
+    if (staging.empty())
+      return;
+    discard_dir(staging);
+    staging.clear();
+  }
+
+  void cancel() { canceled = true; }
+};
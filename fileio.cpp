@@ -0,0 +1,315 @@
+#include "fileio.hpp"
+
+#include <cerrno>
+#include <random>
+#include <system_error>
+#include <thread>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#endif
+
+#include "crc32.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+std::string generic_error_msg() {
+  return std::error_code(errno, std::generic_category()).message();
+}
+
+std::string random_suffix(int length) {
+  static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  std::string s;
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<> dis(0, sizeof(chars) - 2);
+  for (int i = 0; i < length; ++i)
+    s += chars[dis(gen)];
+  return s;
+}
+
+fs::path create_temp_work_dir(const std::string &prefix, fs::path base) {
+  fs::path work_dir;
+
+  do {
+    work_dir = base / (prefix + "-" + random_suffix());
+  } while (fs::exists(work_dir));
+
+  fs::create_directory(work_dir);
+  return work_dir;
+}
+
+static const char TRASH_SUFFIX[] = ".zctrash";
+
+static void remove_later(const fs::path &dir) {
+  try {
+    std::thread([dir] {
+      std::error_code ec;
+      fs::remove_all(dir, ec);
+    }).detach();
+  } catch (std::system_error &e) {
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+  }
+}
+
+void discard_dir(const fs::path &dir) noexcept {
+  std::error_code ec;
+  fs::path trash = dir;
+  trash += "-" + random_suffix() + TRASH_SUFFIX;
+  fs::rename(dir, trash, ec);
+  if (ec) {
+    // Windows can't rename a folder with open files in it
+    fs::remove_all(dir, ec);
+    return;
+  }
+  remove_later(trash);
+}
+
+void sweep_trash(const fs::path &base) noexcept {
+  std::error_code ec;
+  size_t n = sizeof(TRASH_SUFFIX) - 1;
+  for (auto &f : fs::directory_iterator(base, ec)) {
+    std::string name = f.path().filename().string();
+    if (name.size() > n and name.compare(name.size() - n, n, TRASH_SUFFIX) == 0)
+      remove_later(f.path());
+  }
+}
+
+// adds a call to Metrics' counters and the job's
+static void count(IoCounters *all, IoCounters *job, uint64_t n, uint64_t ns) {
+  all->add(n, ns);
+  if (job != nullptr)
+    job->add(n, ns);
+}
+
+static void count_error(IoCounters *all, IoCounters *job) {
+  all->error();
+  if (job != nullptr)
+    job->error();
+}
+
+uint64_t write_file(FILE *f, const char *buf, uint64_t len, IoCounters *job) {
+  Trace::Scope ts("write_file");
+  ts.bytes = len;
+  uint64_t start = Metrics::now_ns();
+  uint64_t written = 0;
+  while (written < len) {
+    uint64_t amnt = len - written;
+    uint64_t n = fwrite(buf + written, 1, amnt, f);
+    if (n != amnt) {
+      if (ferror(f)) {
+        count_error(&Metrics::written, job);
+        throw FileError();
+      }
+      break;
+    }
+    written += n;
+  }
+  count(&Metrics::written, job, written, Metrics::now_ns() - start);
+  return written;
+}
+
+void write_file_at(FILE *f, const char *buf, uint64_t len, int64_t offt,
+                   std::mutex *lock, IoCounters *job) {
+  Trace::Scope ts("write_file_at");
+  ts.bytes = len;
+#ifndef _WIN32
+  (void)lock;
+  uint64_t start = Metrics::now_ns();
+  uint64_t written = 0;
+  while (written < len) {
+    ssize_t n = ::pwrite(fileno(f), buf + written, len - written,
+                         offt + written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      count_error(&Metrics::written, job);
+      throw FileError();
+    }
+    written += n;
+  }
+  count(&Metrics::written, job, written, Metrics::now_ns() - start);
+#else
+  std::lock_guard<std::mutex> guard(*lock);
+  if (_fseeki64(f, offt, SEEK_SET) != 0 or write_file(f, buf, len, job) != len)
+    throw FileError();
+#endif
+}
+
+int Syncer::sync_fs(int fd, IoCounters *job) {
+  uint64_t start = Metrics::now_ns();
+#if defined(__linux__)
+  int res = syncfs(fd);
+#elif defined(_WIN32)
+  int res = sync_fd(fd);
+#else
+  (void)fd;
+  sync();
+  int res = 0;
+#endif
+  count(&Metrics::synced, job, 0, Metrics::now_ns() - start);
+  return res;
+}
+
+void Syncer::sync_dir(const std::string &path, IoCounters *job) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw FileError("Failed to sync a folder");
+  uint64_t start = Metrics::now_ns();
+  int res = fsync(fd);
+  count(&Metrics::synced, job, 0, Metrics::now_ns() - start);
+  ::close(fd);
+  if (res != 0)
+    throw FileError("Failed to sync a folder");
+#else
+  (void)path;
+  (void)job;
+#endif
+}
+
+void Syncer::wrote(FILE *file, uint64_t n) {
+  written += n;
+#ifdef __linux__
+  if (policy != SyncPolicy::BATCHED or written - submitted < WINDOW)
+    return;
+  if (fflush(file) != 0)
+    throw FileError();
+  int fd = fileno(file);
+  uint64_t start = Metrics::now_ns();
+  // start writeback of the new window, then wait for the previous one so
+  // that dirty pages stay bounded without stalling on the current write.
+  sync_file_range(fd, submitted, written - submitted, SYNC_FILE_RANGE_WRITE);
+  if (submitted >= WINDOW) {
+    sync_file_range(fd, submitted - WINDOW, WINDOW,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+  }
+  count(&Metrics::synced, &synced, 0, Metrics::now_ns() - start);
+  submitted = written;
+#else
+  (void)file;
+#endif
+}
+
+void Syncer::end_file(FILE *file, const std::string &path) {
+  if (policy == SyncPolicy::NONE)
+    return;
+  if (policy == SyncPolicy::END_OF_JOB) {
+#ifdef _WIN32
+    pending.push_back(path);
+#endif
+    return;
+  }
+  if (fflush(file) != 0)
+    throw FileError();
+  int fd = fileno(file);
+  if (policy == SyncPolicy::PER_FILE) {
+    uint64_t start = Metrics::now_ns();
+    int res = sync_fd(fd);
+    count(&Metrics::synced, &synced, 0, Metrics::now_ns() - start);
+    if (res != 0)
+      throw FileError("Failed to sync a file");
+    sync_dir(fs::path(path).parent_path().string(), &synced);
+    return;
+  }
+#ifdef __linux__
+  if (written > submitted) {
+    sync_file_range(fd, submitted, written - submitted,
+                    SYNC_FILE_RANGE_WRITE);
+  }
+#endif
+#ifdef _WIN32
+  pending.push_back(path);
+#endif
+  unsynced += written;
+  if (unsynced >= batch_bytes) {
+#ifdef _WIN32
+    (void)fd;
+    sync_pending();
+#else
+    if (sync_fs(fd, &synced) != 0)
+      throw FileError("Failed to sync the output folder");
+#endif
+    unsynced = 0;
+  }
+}
+
+void Syncer::finish(const std::string &dir_path) {
+  if (policy != SyncPolicy::BATCHED and policy != SyncPolicy::END_OF_JOB)
+    return;
+#ifndef _WIN32
+  int fd = ::open(dir_path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw FileError("Failed to sync the output folder");
+  int res = sync_fs(fd, &synced);
+  ::close(fd);
+  if (res != 0)
+    throw FileError("Failed to sync the output folder");
+#else
+  (void)dir_path;
+  sync_pending();
+#endif
+  unsynced = 0;
+}
+
+void Syncer::sync_pending() {
+  for (auto &path : pending) {
+#ifdef _WIN32
+    // _commit() needs a descriptor open for writing
+    int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+#else
+    int fd = ::open(path.c_str(), O_WRONLY);
+#endif
+    if (fd == -1)
+      throw FileError("Failed to sync a file");
+    uint64_t start = Metrics::now_ns();
+    int res = sync_fd(fd);
+    count(&Metrics::synced, &synced, 0, Metrics::now_ns() - start);
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+    if (res != 0)
+      throw FileError("Failed to sync a file");
+  }
+  pending.clear();
+}
+
+int set_mtime(const std::string &path, time_t mtime) {
+#ifdef _WIN32
+  struct _utimbuf t = {mtime, mtime};
+  return _utime(path.c_str(), &t);
+#else
+  struct timespec ts[2];
+  ts[0].tv_sec = 0;
+  ts[0].tv_nsec = UTIME_OMIT;
+  ts[1].tv_sec = mtime;
+  ts[1].tv_nsec = 0;
+  return utimensat(AT_FDCWD, path.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+bool file_crc32(const std::string &path, uint32_t *crc) {
+  enum { CRCBUFSIZ = 128 << 10 };
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr)
+    return false;
+  std::vector<char> buf(CRCBUFSIZ);
+  uint32_t value = 0;
+  size_t n;
+  while ((n = fread(buf.data(), 1, buf.size(), file)) > 0)
+    value = crc32_update(value, buf.data(), n);
+  bool ok = !ferror(file);
+  fclose(file);
+  *crc = value;
+  return ok;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+// File helpers shared by the engine, and Syncer, which decides when extracted
+// data is pushed to disk.
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#endif
+
+#include "metrics.hpp"
+
+namespace fs = std::filesystem;
+
+struct FileError : std::exception {
+  const char *message;
+  FileError(const char *m = "An I/O error ocurred") { message = m; }
+  const char *what() const noexcept override { return message; }
+};
+
+std::string generic_error_msg();
+
+std::string random_suffix(int length = 6);
+
+fs::path create_temp_work_dir(const std::string &prefix = "myapp",
+                              fs::path base = fs::temp_directory_path());
+
+// Renames dir to a trash name next to it and deletes it on a background
+// thread, so dropping a staging folder costs one rename however many files
+// it holds. What a process didn't get to delete is left for sweep_trash().
+void discard_dir(const fs::path &dir) noexcept;
+
+// Deletes what discard_dir() left in base, in the background.
+void sweep_trash(const fs::path &base) noexcept;
+
+// Writes are counted in Metrics::written and, for the job they are part of,
+// in job too if given.
+uint64_t write_file(FILE *f, const char *buf, uint64_t len,
+                    IoCounters *job = nullptr);
+
+// Writes len bytes at offt of f without moving its position, so threads can
+// fill different parts of one file. lock serializes the fallback where there
+// is no pwrite().
+void write_file_at(FILE *f, const char *buf, uint64_t len, int64_t offt,
+                   std::mutex *lock, IoCounters *job = nullptr);
+
+enum class SyncPolicy { NONE, PER_FILE, BATCHED, END_OF_JOB };
+
+// Decides when extracted data is pushed to stable storage. BATCHED starts
+// writeback with sync_file_range() while a file is being written and only
+// waits for the whole filesystem once every batch_bytes.
+struct Syncer {
+  enum { WINDOW = 8 << 20 };
+
+  SyncPolicy policy = SyncPolicy::NONE;
+  uint64_t batch_bytes = 64ull << 20;
+  uint64_t unsynced = 0;
+
+  // per file state
+  uint64_t written = 0;
+  uint64_t submitted = 0;
+  // this Syncer's share of Metrics::synced
+  IoCounters synced;
+  // files written since the last sync where a filesystem can't be synced as
+  // a whole (Windows), to be committed one by one
+  std::vector<std::string> pending;
+
+  static int sync_fd(int fd) {
+#ifdef _WIN32
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+  }
+
+  // Both count in Metrics::synced and in job if given.
+  static int sync_fs(int fd, IoCounters *job = nullptr);
+
+  static void sync_dir(const std::string &path, IoCounters *job = nullptr);
+
+  void begin_file() {
+    written = 0;
+    submitted = 0;
+  }
+
+  void wrote(FILE *file, uint64_t n);
+
+  // Called before fclose(). path is the file that was written.
+  void end_file(FILE *file, const std::string &path);
+
+  // Called after entries were renamed into dir so the new names survive too.
+  void published(const std::string &dir) {
+    if (policy != SyncPolicy::NONE)
+      sync_dir(dir, &synced);
+  }
+
+  // Called once the whole job is written to dir_path.
+  void finish(const std::string &dir_path);
+
+  // Syncs the files in pending.
+  void sync_pending();
+};
+
+int set_mtime(const std::string &path, time_t mtime);
+
+// CRC-32 of the file at path, or false if it can't be read.
+bool file_crc32(const std::string &path, uint32_t *crc);
@@ -0,0 +1,302 @@
+#pragma once
+
+// Checkpoints into a raw deflate stream, along the lines of zlib's zran.c.
+// A point is a deflate block boundary: its offsets in the compressed input
+// and in the output plus the 32 KiB of output in front of it, which is all
+// inflate needs to start over from there. With points every few MiB a single
+// huge entry can be decoded by several threads at once, each starting at its
+// own point, and a range in the middle can be read without decoding from
+// the start.
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "crc32.hpp"
+#include "decode.hpp"
+#include "mempool.hpp"
+#include "trace.hpp"
+
+struct InflateIndex {
+  enum { WINSIZE = 32768, CHUNK = 256 << 10, BUFSIZE = 2 * CHUNK };
+
+  typedef DecodeError Error;
+  typedef decode_read_fn read_fn;
+  typedef decode_sink_fn sink_fn;
+
+  struct Point {
+    int64_t out;
+    int64_t in;
+    int bits; // unused bits of the byte before in
+    std::vector<unsigned char> window;
+  };
+
+  std::vector<Point> points;
+  int64_t in_size = 0;
+  int64_t out_size = 0;
+  uint32_t crc = 0;
+
+  // Points are at least this far apart, and there are at most ~MAX_POINTS
+  // of them so the index stays small next to the data.
+  enum { MIN_SPAN = 4 << 20, MAX_POINTS = 1024 };
+
+  static int64_t span_for(int64_t size) {
+    return std::max<int64_t>(MIN_SPAN, size / MAX_POINTS);
+  }
+
+  // Inflates the whole stream once, recording a point about every span bytes
+  // of output, and hands the output to sink if there is one. Returns false
+  // if sink stopped it.
+  bool build(read_fn read, void *rctx, int64_t size, int64_t span,
+             sink_fn sink = nullptr, void *sctx = nullptr) {
+    Trace::Scope ts("InflateIndex::build");
+    points.clear();
+    out_size = 0;
+    PoolBuffer inbuf(CHUNK);
+    unsigned char *in = (unsigned char *)inbuf.get();
+    std::vector<unsigned char> win(WINSIZE);
+    z_stream strm = {};
+    if (inflateInit2(&strm, -15) != Z_OK)
+      throw Error("Out of memory");
+    int64_t fed = 0, totin = 0, totout = 0, last = 0;
+    uint32_t c = 0;
+    int ret = Z_OK;
+    points.push_back({0, 0, 0, {}});
+    try {
+      while (ret != Z_STREAM_END) {
+        if (strm.avail_in == 0 and fed < size) {
+          int64_t want = std::min<int64_t>(CHUNK, size - fed);
+          if (read(rctx, (char *)in, want, fed) != want)
+            throw Error("Entry data is truncated");
+          strm.next_in = in;
+          strm.avail_in = want;
+          fed += want;
+        }
+        // the output goes round win so it always ends with the last 32 KiB
+        if (strm.avail_out == 0) {
+          strm.next_out = win.data();
+          strm.avail_out = WINSIZE;
+        }
+        unsigned char *from = strm.next_out;
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK);
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+        if (ret == Z_BUF_ERROR)
+          throw Error("Entry data is truncated");
+        if (ret != Z_OK and ret != Z_STREAM_END)
+          throw Error();
+        size_t got = strm.next_out - from;
+        if (got != 0) {
+          c = crc32_update(c, from, got);
+          if (sink != nullptr and
+              !sink(sctx, (const char *)from, got, totout - got)) {
+            inflateEnd(&strm);
+            return false;
+          }
+        }
+        // inflate stopped right after a block (bit 7) that wasn't the last
+        // one (bit 6)
+        if ((strm.data_type & 128) and !(strm.data_type & 64) and
+            totout - last >= span) {
+          Point p = {totout, totin, strm.data_type & 7, {}};
+          p.window.resize(WINSIZE);
+          size_t left = strm.avail_out;
+          memcpy(p.window.data(), win.data() + WINSIZE - left, left);
+          memcpy(p.window.data() + left, win.data(), WINSIZE - left);
+          points.push_back(std::move(p));
+          last = totout;
+        }
+      }
+    } catch (...) {
+      inflateEnd(&strm);
+      points.clear();
+      throw;
+    }
+    inflateEnd(&strm);
+    in_size = totin;
+    out_size = totout;
+    crc = c;
+    return true;
+  }
+
+  // Decodes from point i up to output offset end. The CRC of what was decoded
+  // goes to *crc_out. Returns false if sink stopped it. buf is BUFSIZE bytes
+  // to work in, or nullptr to take them from the MemoryPool.
+  bool decode(read_fn read, void *rctx, size_t i, int64_t end, sink_fn sink,
+              void *sctx, uint32_t *crc_out = nullptr,
+              PoolBuffer *buf = nullptr) const {
+    const Point &p = points[i];
+    Trace::Scope ts("InflateIndex::decode");
+    ts.bytes = end - p.out;
+    PoolBuffer own;
+    if (buf == nullptr) {
+      own.reset(BUFSIZE);
+      buf = &own;
+    }
+    unsigned char *in = (unsigned char *)buf->get();
+    unsigned char *out = in + CHUNK;
+    z_stream strm = {};
+    if (inflateInit2(&strm, -15) != Z_OK)
+      throw Error("Out of memory");
+    int64_t fed = p.in, totout = p.out;
+    uint32_t c = 0;
+    int ret = Z_OK;
+    try {
+      if (p.bits != 0) {
+        unsigned char byte;
+        if (read(rctx, (char *)&byte, 1, p.in - 1) != 1)
+          throw Error("Entry data is truncated");
+        inflatePrime(&strm, p.bits, byte >> (8 - p.bits));
+      }
+      if (!p.window.empty())
+        inflateSetDictionary(&strm, p.window.data(), p.window.size());
+      while (totout < end and ret != Z_STREAM_END) {
+        if (strm.avail_in == 0 and fed < in_size) {
+          int64_t want = std::min<int64_t>(CHUNK, in_size - fed);
+          if (read(rctx, (char *)in, want, fed) != want)
+            throw Error("Entry data is truncated");
+          strm.next_in = in;
+          strm.avail_in = want;
+          fed += want;
+        }
+        strm.next_out = out;
+        strm.avail_out = std::min<int64_t>(CHUNK, end - totout);
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR)
+          throw Error("Entry data is truncated");
+        if (ret != Z_OK and ret != Z_STREAM_END)
+          throw Error();
+        size_t got = strm.next_out - out;
+        if (got == 0)
+          continue;
+        c = crc32_update(c, out, got);
+        if (!sink(sctx, (const char *)out, got, totout)) {
+          inflateEnd(&strm);
+          return false;
+        }
+        totout += got;
+      }
+    } catch (...) {
+      inflateEnd(&strm);
+      throw;
+    }
+    inflateEnd(&strm);
+    if (totout != end)
+      throw Error("Entry data is truncated");
+    if (crc_out != nullptr)
+      *crc_out = c;
+    return true;
+  }
+
+  // Decodes everything on up to threads threads, each one a run of points
+  // with about the same amount of output. sink is called from all of them.
+  // The CRC of the whole output goes to *crc_out. The buffers of the threads
+  // are taken here, and there are only as many threads as the MemoryPool has
+  // buffers for.
+  bool decode_all(read_fn read, void *rctx, unsigned threads, sink_fn sink,
+                  void *sctx, uint32_t *crc_out) const {
+    size_t n = std::max<size_t>(1, std::min<size_t>(threads, points.size()));
+    std::vector<PoolBuffer> bufs(1);
+    bufs[0].reset(BUFSIZE);
+    while (bufs.size() < n) {
+      PoolBuffer b;
+      if (!b.try_reset(BUFSIZE))
+        break;
+      bufs.push_back(std::move(b));
+    }
+    n = bufs.size();
+    // first point of each run, the last run ends at out_size
+    std::vector<size_t> first = {0};
+    for (size_t i = 0, k = 1; k < n; k++) {
+      int64_t until = out_size / (int64_t)n * (int64_t)k;
+      while (i < points.size() and points[i].out < until)
+        i++;
+      if (i >= points.size())
+        break;
+      if (i != first.back())
+        first.push_back(i);
+    }
+    size_t runs = first.size();
+    std::vector<uint32_t> crcs(runs);
+    std::vector<std::exception_ptr> errors(runs);
+    std::atomic<bool> stopped{false};
+    auto run = [&](size_t k) {
+      try {
+        int64_t end = k + 1 < runs ? points[first[k + 1]].out : out_size;
+        if (!decode(read, rctx, first[k], end, sink, sctx, &crcs[k],
+                    &bufs[k]))
+          stopped = true;
+      } catch (...) {
+        errors[k] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t k = 1; k < runs; k++)
+      workers.emplace_back(run, k);
+    run(0);
+    for (auto &w : workers)
+      w.join();
+    for (auto &e : errors) {
+      if (e)
+        std::rethrow_exception(e);
+    }
+    if (stopped)
+      return false;
+    uint32_t c = crcs[0];
+    for (size_t k = 1; k < runs; k++) {
+      int64_t end = k + 1 < runs ? points[first[k + 1]].out : out_size;
+      c = crc32_merge(c, crcs[k], end - points[first[k]].out);
+    }
+    *crc_out = c;
+    return true;
+  }
+
+  // The index is stored as a count of points and then each point, with the
+  // sizes and CRC of the stream in front.
+  bool save(FILE *f) const {
+    uint32_t n = points.size();
+    bool ok = fwrite(&in_size, 8, 1, f) == 1 and
+              fwrite(&out_size, 8, 1, f) == 1 and fwrite(&crc, 4, 1, f) == 1 and
+              fwrite(&n, 4, 1, f) == 1;
+    for (size_t i = 0; ok and i < points.size(); i++) {
+      const Point &p = points[i];
+      uint32_t bits = p.bits, wsize = p.window.size();
+      ok = fwrite(&p.out, 8, 1, f) == 1 and fwrite(&p.in, 8, 1, f) == 1 and
+           fwrite(&bits, 4, 1, f) == 1 and fwrite(&wsize, 4, 1, f) == 1 and
+           fwrite(p.window.data(), 1, wsize, f) == wsize;
+    }
+    return ok;
+  }
+
+  bool load(FILE *f) {
+    uint32_t n;
+    points.clear();
+    if (fread(&in_size, 8, 1, f) != 1 or fread(&out_size, 8, 1, f) != 1 or
+        fread(&crc, 4, 1, f) != 1 or fread(&n, 4, 1, f) != 1 or n == 0 or
+        n > MAX_POINTS * 4)
+      return false;
+    for (uint32_t i = 0; i < n; i++) {
+      Point p;
+      uint32_t bits, wsize;
+      if (fread(&p.out, 8, 1, f) != 1 or fread(&p.in, 8, 1, f) != 1 or
+          fread(&bits, 4, 1, f) != 1 or fread(&wsize, 4, 1, f) != 1 or
+          bits > 7 or (wsize != 0 and wsize != WINSIZE))
+        return false;
+      p.bits = bits;
+      p.window.resize(wsize);
+      if (fread(p.window.data(), 1, wsize, f) != wsize)
+        return false;
+      points.push_back(std::move(p));
+    }
+    return true;
+  }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+// LZMA as stored in ZIP (method 14): two bytes of LZMA SDK version, two bytes
+// of properties size, the 5 properties bytes and then a bare LZMA1 stream,
+// with or without an end marker. liblzma reads it as a .lzma file once the
+// properties are put in front of an unknown size. LZMA1 has no independent
+// blocks, so an entry is always decoded on one thread.
+
+#include <lzma.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "crc32.hpp"
+#include "decode.hpp"
+#include "mempool.hpp"
+#include "trace.hpp"
+
+struct LzmaDecoder {
+  enum { CHUNK = 256 << 10, HDRSIZ = 9, PROPSIZ = 5 };
+  // the dictionary is all the decoder needs besides its own state
+  enum : uint32_t { DICT_MAX = 1u << 28, STATE_SIZE = 128 << 10 };
+
+  typedef DecodeError Error;
+  typedef decode_read_fn read_fn;
+  typedef decode_sink_fn sink_fn;
+
+  // Decodes in_size bytes of entry data into out_size bytes. The CRC of the
+  // output goes to *crc_out. Returns false if sink stopped it.
+  static bool decode(read_fn read, void *rctx, int64_t in_size,
+                     int64_t out_size, sink_fn sink, void *sctx,
+                     uint32_t *crc_out) {
+    Trace::Scope ts("LzmaDecoder::decode");
+    ts.bytes = out_size;
+    unsigned char hdr[HDRSIZ];
+    if (in_size < HDRSIZ or read(rctx, (char *)hdr, HDRSIZ, 0) != HDRSIZ)
+      throw Error("Entry data is truncated");
+    if ((hdr[2] | hdr[3] << 8) != PROPSIZ)
+      throw Error("Unsupported LZMA properties");
+    // .lzma header: properties and the uncompressed size, all ones if unknown
+    unsigned char alone[PROPSIZ + 8];
+    memcpy(alone, hdr + 4, PROPSIZ);
+    memset(alone + PROPSIZ, 0xff, 8);
+    uint32_t dict =
+        hdr[5] | hdr[6] << 8 | hdr[7] << 16 | (uint32_t)hdr[8] << 24;
+    if (dict > DICT_MAX)
+      throw Error("LZMA dictionary is too large");
+    uint64_t memlimit = (uint64_t)std::max<uint32_t>(dict, 4096) + STATE_SIZE;
+    PoolCharge charge;
+    charge.set(memlimit);
+
+    PoolBuffer buf(2 * CHUNK);
+    unsigned char *in = (unsigned char *)buf.get();
+    unsigned char *out = in + CHUNK;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    if (lzma_alone_decoder(&strm, memlimit) != LZMA_OK)
+      throw Error("Out of memory");
+    strm.next_in = alone;
+    strm.avail_in = sizeof(alone);
+    int64_t fed = HDRSIZ, totout = 0;
+    uint32_t c = 0;
+    try {
+      while (totout < out_size) {
+        if (strm.avail_in == 0 and fed < in_size) {
+          int64_t want = std::min<int64_t>(CHUNK, in_size - fed);
+          if (read(rctx, (char *)in, want, fed) != want)
+            throw Error("Entry data is truncated");
+          strm.next_in = in;
+          strm.avail_in = want;
+          fed += want;
+        }
+        strm.next_out = out;
+        strm.avail_out = std::min<int64_t>(CHUNK, out_size - totout);
+        lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+        size_t got = strm.next_out - out;
+        if (got != 0) {
+          c = crc32_update(c, out, got);
+          if (!sink(sctx, (const char *)out, got, totout)) {
+            lzma_end(&strm);
+            return false;
+          }
+          totout += got;
+        }
+        if (ret == LZMA_STREAM_END)
+          break;
+        if (ret == LZMA_BUF_ERROR)
+          throw Error("Entry data is truncated");
+        if (ret == LZMA_MEM_ERROR)
+          throw Error("Out of memory");
+        if (ret == LZMA_MEMLIMIT_ERROR)
+          throw Error("LZMA dictionary is too large");
+        if (ret != LZMA_OK)
+          throw Error();
+      }
+    } catch (...) {
+      lzma_end(&strm);
+      throw;
+    }
+    lzma_end(&strm);
+    if (totout != out_size)
+      throw Error("Entry data is truncated");
+    *crc_out = c;
+    return true;
+  }
+};
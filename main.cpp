@@ -1,671 +1,30 @@
 #include "qabstractbutton.h"
 #include "qapplication.h"
 #include "qglobal.h"
-#include <cassert>
-#include <cstddef>
-#include <cstdint>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <exception>
-#include <ioapi.h>
-#include <mz.h>
-#include <mz_strm.h>
-
-#include <filesystem>
-#include <map>
-#include <mz_zip.h>
-#include <random>
-#include <stdio.h>
-#include <stdlib.h>
+#include <list>
+#include <memory>
 #include <string>
-#include <sys/types.h>
-#include <vector>
 
 #include <QApplication>
 #include <QPushButton>
-#ifndef _WIN32
-#include <unistd.h>
-#endif
 
+#include "cli.hpp"
+#include "zipcombiner.hpp"
 #include "res.cpp"
 
-#include <cerrno>
-#include <system_error>
-
-namespace fs = std::filesystem;
-
-struct FileError : std::exception {
-  const char *message;
-  FileError(const char *m = "An I/O error ocurred") { message = m; }
-  const char *what() const noexcept override { return message; }
-};
-
-static int32_t my_stream_is_open_cb(void *stream);
-static int32_t my_stream_open_cb(void *stream, const char *path, int32_t mode);
-static int32_t my_stream_read_cb(void *stream, void *buf, int32_t size);
-static int32_t my_stream_seek_cb(void *stream, int64_t offset, int32_t origin);
-static int32_t my_stream_write_cb(void *stream, const void *buf, int32_t size);
-static int64_t my_stream_tell_cb(void *stream);
-static int32_t my_stream_close_cb(void *stream);
-static int32_t my_stream_error_cb(void *stream);
-static void *my_stream_create_cb(void);
-static void my_stream_destroy_cb(void **stream);
-static int32_t my_stream_get_prop_int64_cb(void *stream, int32_t prop,
-                                           int64_t *value);
-static int32_t my_stream_set_prop_int64_cb(void *stream, int32_t prop,
-                                           int64_t value);
-std::string generic_error_msg() {
-  return std::error_code(errno, std::generic_category()).message();
-}
-
-std::string random_suffix(int length = 6) {
-  static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
-  std::string s;
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dis(0, sizeof(chars) - 2);
-  for (int i = 0; i < length; ++i)
-    s += chars[dis(gen)];
-  return s;
-}
-
-fs::path create_temp_work_dir(const std::string &prefix = "myapp") {
-  fs::path base = fs::temp_directory_path();
-  fs::path work_dir;
-
-  do {
-    work_dir = base / (prefix + "-" + random_suffix());
-  } while (fs::exists(work_dir));
-
-  fs::create_directory(work_dir);
-  return work_dir;
-}
-
-struct Mystream {
-  struct Error : std::exception {
-    std::string message;
-    Error(std::string m = "A stream error ocurred\n") { message = m; }
-    const char *what() const noexcept override { return message.c_str(); }
-  };
-
-  mz_stream_vtbl vtbl;
-
-  struct Ctx {
-    mz_stream_vtbl *vtbl;
-    struct mz_stream_s *base;
-    Mystream *_strm;
-  };
-  Ctx strm;
-  std::map<int32_t, int64_t> props;
-
-  struct Part {
-    off_t begin;
-    off_t end;
-    off_t file_size;
-    FILE *file;
-
-    static size_t init(Part *p, size_t begin, const char *file_path) {
-      p->file = fopen(file_path, "rb");
-      if (p->file == nullptr) {
-        std::string err_msg =
-            std::error_code(errno, std::generic_category()).message();
-        err_msg.append(": ");
-        err_msg.append(file_path);
-        throw Error(err_msg);
-      }
-
-      int res = fseek(p->file, 0, SEEK_END);
-      if (res != 0) {
-        throw Error(generic_error_msg() + ": " + file_path);
-      }
-      off_t file_size = ftello(p->file);
-      if (file_size == (off_t)-1) {
-        throw Error(generic_error_msg() + ": " + file_path);
-      }
-      res = fseek(p->file, 0, SEEK_SET);
-      if (res != 0) {
-        throw Error(generic_error_msg() + ": " + file_path);
-      }
-
-      p->begin = begin;
-      p->end = begin + file_size;
-      p->file_size = file_size;
-
-      return p->end;
-    }
-
-    bool has(off_t offt) noexcept { return offt >= begin and offt < end; }
-
-    int seek_to(off_t offt) noexcept { return fseek(file, offt, SEEK_SET); }
-
-    off_t local_offt(off_t global_offt) noexcept {
-      if (!has(global_offt)) {
-        return -1;
-      }
-      return global_offt - begin;
-    }
-
-    int32_t read(void *buf, int32_t len, off_t global_offt) noexcept {
-      off_t lofft = local_offt(global_offt);
-      if (lofft == -1) {
-        return -1;
-      }
-      if (seek_to(lofft) == -1) {
-        return -1;
-      };
-      int32_t read = 0;
-      while (read < len) {
-        size_t n = fread((char *)buf + read, 1, len - read, file);
-        read += n;
-        if (n == 0) {
-          if (ferror(file)) {
-            return -1;
-          }
-          break;
-        }
-      }
-      return read;
-    }
-  };
-
-  std::vector<Part> parts;
-  off_t whole_offt;
-  off_t whole_size;
-
-  Mystream(std::list<std::string> *part_paths) {
-    memset(&vtbl, 0, sizeof(vtbl));
-
-    vtbl.open = my_stream_open_cb;
-    vtbl.is_open = my_stream_is_open_cb;
-    vtbl.read = my_stream_read_cb;
-    vtbl.seek = my_stream_seek_cb;
-    vtbl.write = my_stream_write_cb;
-    vtbl.tell = my_stream_tell_cb;
-    vtbl.error = my_stream_error_cb;
-    vtbl.close = my_stream_close_cb;
-    vtbl.create = my_stream_create_cb;
-    vtbl.destroy = my_stream_destroy_cb;
-    vtbl.set_prop_int64 = my_stream_set_prop_int64_cb;
-    vtbl.get_prop_int64 = my_stream_get_prop_int64_cb;
-
-    strm.vtbl = &vtbl;
-    strm._strm = this;
-
-    Part tmp;
-    off_t offt = 0;
-    whole_size = 0;
-
-    auto it = part_paths->begin();
-
-    for (size_t i = 0; i < part_paths->size(); i++) {
-      off_t new_offt = Part::init(&tmp, offt, it->c_str());
-      printf("part: %s\n", it->c_str());
-      parts.push_back(tmp);
-      offt = new_offt;
-      whole_size += tmp.file_size;
-      std::advance(it, 1);
-    }
-
-    whole_offt = 0;
-  }
-
-  int64_t get_prop(int32_t key) { return props[key]; }
-
-  void set_prop(int32_t key, int64_t value) { props[key] = value; }
-
-  Part *find_part_wofft(off_t offt) {
-    for (size_t i = 0; i < parts.size(); i++) {
-      Part *tmp = &parts[i];
-      if (tmp->has(offt)) {
-        return tmp;
-      }
-    }
-    return nullptr;
-  }
-
-  int32_t open(const char *path, int32_t mode) {
-    (void)path;
-    (void)mode;
-    assert(false);
-    return -1;
-  }
-
-  int32_t read(void *buf, int32_t size) {
-    Part *part = find_part_wofft(whole_offt);
-    if (part == nullptr)
-      return -1;
-    int32_t n = part->read(buf, size, whole_offt);
-    whole_offt += n;
-    return n;
-  }
-
-  int32_t write(const void *buf, int32_t size) {
-    (void)buf;
-    (void)size;
-    assert(false);
-    return -1;
-  }
-
-  int32_t seek(int64_t offset, int32_t origin) {
-    switch (origin) {
-    case MZ_SEEK_SET:
-      if (offset > whole_size)
-        return -1;
-      this->whole_offt = offset;
-      break;
-    case MZ_SEEK_CUR:
-      if (offset > 0) {
-        if (whole_offt + offset > whole_size)
-          return -1;
-        this->whole_offt += offset;
-      } else {
-        if (whole_offt < offset)
-          return -1;
-        this->whole_offt -= offset;
-      }
-      break;
-    case MZ_SEEK_END:
-      if (offset > whole_size)
-        return -1;
-      this->whole_offt = whole_size - offset;
-      break;
-    default:
-      assert(false && "unknow origin");
-    }
-    return 0;
-  }
-
-  int64_t tell() { return whole_offt; }
-
-  int32_t close() {
-    assert(false);
-    return -1;
-  }
-
-  int32_t error() {
-    assert(false);
-    return -1;
-  }
-
-  void *create() { assert(false); }
-
-  void *destroy() { assert(false); }
-
-  mz_stream *get_mz_stream() { return (mz_stream *)&strm; }
-};
-
-static int32_t my_stream_get_prop_int64_cb(void *stream, int32_t prop,
-                                           int64_t *value) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  if (value != nullptr) {
-    *value = ctx->_strm->get_prop(prop);
-  }
-  return 0;
-}
-
-static int32_t my_stream_set_prop_int64_cb(void *stream, int32_t prop,
-                                           int64_t value) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  ctx->_strm->set_prop(prop, value);
-  return 0;
-}
-
-static void *my_stream_create_cb(void) {
-  // printf("%s()\n", __FUNCTION__);
-  assert(false);
-  return nullptr;
-}
-
-static void my_stream_destroy_cb(void **stream) {
-  // printf("%s()\n", __FUNCTION__);
-  (void)stream;
-  assert(false);
-}
-
-static int32_t my_stream_close_cb(void *stream) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->close();
-}
-
-static int32_t my_stream_error_cb(void *stream) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->error();
-}
-
-static int64_t my_stream_tell_cb(void *stream) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->tell();
-}
-
-static int32_t my_stream_write_cb(void *stream, const void *buf, int32_t size) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->write(buf, size);
-}
-
-static int32_t my_stream_seek_cb(void *stream, int64_t offset, int32_t origin) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->seek(offset, origin);
-}
-
-static int32_t my_stream_read_cb(void *stream, void *buf, int32_t size) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->read(buf, size);
-}
-
-static int32_t my_stream_is_open_cb(void *stream) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->parts.empty();
-}
-
-static int32_t my_stream_open_cb(void *stream, const char *path, int32_t mode) {
-  // printf("%s()\n", __FUNCTION__);
-  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
-  return ctx->_strm->open(path, mode);
-}
-uint64_t write_file(FILE *f, const char *buf, uint64_t len) {
-  uint64_t written = 0;
-  while (written < len) {
-    uint64_t amnt = len - written;
-    uint64_t n = fwrite(buf + written, 1, amnt, f);
-    if (n != amnt) {
-      if (ferror(f)) {
-        throw FileError();
-      }
-      break;
-    }
-    written += n;
-  }
-  return written;
-}
-
-struct Archive {
-  struct Error : std::exception {
-    const char *message;
-    Error(const char *m = "An error ocurred while opening the archive") {
-      message = m;
-    }
-    const char *what() const noexcept override { return message; }
-  };
-
-  void *zip;
-  Mystream *stream;
-  uint64_t num_entries;
-
-  struct Entry {
-    void *parent;
-    mz_zip_file *entry;
-    Archive *archive;
-
-    enum { RBUFSIZ = 4096 * 8 };
-
-    int read_open() {
-      int res = mz_zip_entry_read_open(parent, 0, nullptr);
-      if (res != MZ_OK)
-        return res;
-      return mz_zip_entry_get_info(parent, &entry);
-    }
-
-    int read_close() {
-      return mz_zip_entry_read_close(parent, &entry->crc,
-                                     &entry->compressed_size,
-                                     &entry->uncompressed_size);
-    }
-
-    const char *get_name() { return entry->filename; }
-
-    bool is_dir() { return !mz_zip_entry_is_dir(parent); }
-
-    bool is_symlink() { return !mz_zip_entry_is_symlink(parent); }
-
-    bool canceled() { return archive->cancel; }
-
-    int write_to_file(FILE *file) noexcept {
-      char *rbuf = (char *)malloc(RBUFSIZ);
-      if (rbuf == nullptr) {
-        return -1;
-      }
-
-      int64_t rem_entry = entry->uncompressed_size;
-      int32_t read_entry, write_entry;
-
-      while (rem_entry > 0 and !canceled()) {
-        read_entry = mz_zip_entry_read(parent, rbuf, RBUFSIZ);
-        if (read_entry < 0) {
-          return -1;
-        }
-        rem_entry -= read_entry;
-
-        if (rem_entry < 0) {
-          return -1;
-        }
-
-        write_entry = write_file(file, rbuf, read_entry);
-        if (write_entry != read_entry) {
-          return -1;
-        }
-      }
-      free(rbuf);
-      return 0;
-    }
-
-    int r2s(std::string *str) {
-      char *rbuf = (char *)malloc(RBUFSIZ);
-      if (rbuf == nullptr) {
-        return -1;
-      }
-
-      int64_t rem_entry = entry->uncompressed_size;
-      int32_t read_entry;
-
-      while (rem_entry > 0 and !canceled()) {
-        read_entry = mz_zip_entry_read(parent, rbuf, RBUFSIZ);
-        if (read_entry < 0) {
-          return -1;
-        }
-        rem_entry -= read_entry;
-
-        if (rem_entry < 0) {
-          return -1;
-        }
-
-        str->append(rbuf, read_entry);
-      }
-      free(rbuf);
-      return 0;
-    }
-  };
-
-  Entry *current_entry = nullptr;
-  bool cancel = false;
-
-  Archive(Mystream *strm, int32_t mode = ZLIB_FILEFUNC_MODE_READ)
-      : stream(strm) {
-    zip = mz_zip_create();
-    if (zip == nullptr) {
-      throw Error();
-    }
-    mz_stream *s = strm->get_mz_stream();
-    int res = mz_zip_open(zip, s, mode);
-    if (res != MZ_OK) {
-      throw Error();
-    }
-    res = mz_zip_get_number_entry(zip, &num_entries);
-    if (res != MZ_OK) {
-      throw Error();
-    }
-    res = mz_zip_goto_first_entry(zip);
-    if (res != MZ_OK) {
-      throw Error();
-    }
-    current_entry = 0;
-  }
-
-  int go_to_first_entry(Entry *e) {
-    int res = mz_zip_goto_first_entry(zip);
-    e->parent = zip;
-    current_entry = e;
-    e->archive = this;
-    return res;
-  }
-
-  int32_t get_next_entry(Entry *e) {
-    int res = mz_zip_goto_next_entry(zip);
-    e->parent = zip;
-    current_entry = e;
-    e->archive = this;
-    return res;
-  }
-};
-
-struct ProgressWindow;
-
-struct Extractor {
-  struct Error : std::exception {
-    std::string message;
-    Error(std::string m = "An error ocurred while extracting") { message = m; }
-    const char *what() const noexcept override { return message.c_str(); }
-  };
-
-  Archive *archive;
-  std::string dir_path;
-  std::string zip_root;
-  std::string zip;
-
-  Extractor(Archive *a, std::string output_dir_path, std::string zip_path) {
-    if (!std::filesystem::is_directory(output_dir_path)) {
-      throw Extractor::Error("Output folder isn't valid.");
-    }
-    dir_path = output_dir_path;
-    zip = zip_path;
-#ifdef _WIN32
-    dir_path.append("\\");
-#else
-    dir_path.append("/");
-#endif
-    archive = a;
-  }
-
-  void extract_entry(Archive::Entry *entry,
-                     bool (*excb)(const char *, size_t, bool, void *),
-                     void *ctx) {
-    int res;
-    const char *name_ptr = entry->get_name();
-
-    std::string name = std::string(dir_path.c_str(), dir_path.size());
-    name.append(name_ptr);
-
-    std::filesystem::path path(name);
-
-    try {
-      std::filesystem::create_directories(path.parent_path());
-    } catch (std::filesystem::filesystem_error &e) {
-      throw Extractor::Error("Failed to a create directory.");
-    }
-
-    // printf("extracting %s\n", name.c_str());
-
-    bool exists = std::filesystem::exists(name);
-
-    if (exists and !std::filesystem::is_directory(name)) {
-      if (!excb(name.c_str(), name.length(), entry->is_dir(), ctx))
-        return;
-    }
-    if (entry->is_dir()) {
-      std::filesystem::create_directory(name);
-    } else if (entry->is_symlink()) {
-      if (exists) {
-        if (!std::filesystem::remove(name)) {
-          throw Extractor::Error("Failed to overwrite a symbolic link");
-        }
-      }
-#ifdef _WIN32
-      throw Extractor::Error("Failed to create link");
-#else
-      std::string link_data = "";
-      res = entry->r2s(&link_data);
-      if (res != 0) {
-        throw Extractor::Error("Failed to read a symlink");
-      }
-      res = symlink(link_data.c_str(), name.c_str());
-      if (res != 0) {
-        throw Extractor::Error(
-            std::error_code(errno, std::generic_category()).message());
-      }
-#endif
-    } else {
-      FILE *file = fopen(name.c_str(), "wb");
-      if (file == nullptr)
-        throw Extractor::Error("Failed to open a file");
-      res = entry->write_to_file(file);
-      if (res == -1) {
-        throw Extractor::Error("Failed to write to file");
-      }
-      fclose(file);
-    }
-  }
-
-  void extract(void (*cb)(bool, bool, std::string, void *),
-               bool (*excb)(const char *, size_t, bool, void *), void *ctx) {
-    int res;
-    bool first = true;
-    Archive::Entry entry;
-    res = archive->go_to_first_entry(&entry);
-    while (res == MZ_OK and !archive->cancel) {
-      res = entry.read_open();
-      if (res != MZ_OK)
-        throw Extractor::Error();
-      if (first) {
-        zip_root = std::string(entry.get_name());
-        first = false;
-      }
-      extract_entry(&entry, excb, ctx);
-      res = entry.read_close();
-      cb(false, false, zip, ctx);
-      res = archive->get_next_entry(&entry);
-    }
-
-    if (res == MZ_END_OF_LIST) {
-      cb(true, false, zip, ctx);
-    } else if (archive->cancel) {
-      try {
-        undo();
-      } catch (std::exception &e) {
-      }
-      cb(true, true, zip, ctx);
-    } else {
-      if (res != MZ_OK) {
-        throw Extractor::Error();
-      }
-    }
-  }
-
-  void undo() {
-    if (zip_root.empty())
-      return;
-    // std::filesystem::remove_all(
-    //     std::filesystem::path(dir_path.append(zip_root)));
-  }
-
-  void cancel() { archive->cancel = true; }
-};
-
 #include <QButtonGroup>
 #include <QCheckBox>
+#include <QComboBox>
 #include <QDialogButtonBox>
 #include <QDragEnterEvent>
 #include <QDropEvent>
 #include <QFileDialog>
 #include <QLabel>
+#include <QLineEdit>
 #include <QMainWindow>
 #include <QMenuBar>
 #include <QMessageBox>
@@ -676,6 +35,7 @@ struct Extractor {
 #include <QTextBrowser>
 #include <QThread>
 #include <QToolBar>
+#include <QTreeWidget>
 #include <QVBoxLayout>
 #include <iterator>
 
@@ -866,6 +226,7 @@ struct ProgressWindow : public QDialog {
   QLabel label;
   QDialogButtonBox button_box;
   Extractor *x = nullptr;
+  Tester *t = nullptr;
   int pos;
   std::string file_name;
 
@@ -887,6 +248,21 @@ struct ProgressWindow : public QDialog {
     if (x != nullptr) {
       x->cancel();
     }
+    if (t != nullptr) {
+      t->stop();
+    }
+  }
+
+  void setTester(Tester *tester) {
+    t = tester;
+    setWindowTitle(t != nullptr ? "Testing" : "Extracting");
+  }
+
+  void progressTo(int value) {
+    if (value > pos and value <= progress_bar.maximum()) {
+      pos = value;
+      progress_bar.setValue(pos);
+    }
   }
 
   void setExtractor(Extractor *e, std::string fname = "") {
@@ -935,6 +311,88 @@ struct ProgressWindow : public QDialog {
   }
 };
 
+// Shows the central directory of the added ZIPs, see Archive::list().
+struct ListWindow : public QDialog {
+  QVBoxLayout layout;
+  QTreeWidget tree;
+  QLabel summary;
+  QTreeWidgetItem *top = nullptr;
+  Mystream *stream = nullptr;
+  uint64_t total = 0;
+
+  ListWindow(QWidget *parent) : QDialog(parent), layout(this), tree(this) {
+    setWindowTitle("Contents");
+    tree.setColumnCount(8);
+    tree.setHeaderLabels({"Name", "Size", "Compressed", "Ratio", "Method",
+                          "CRC", "Offset", "Volume"});
+    tree.setUniformRowHeights(true);
+    tree.setSortingEnabled(false);
+    layout.addWidget(&tree);
+    layout.addWidget(&summary);
+    resize(800, 500);
+  }
+
+  static bool add_cb(Archive::Entry *e, void *ctx) {
+    ListWindow *w = (ListWindow *)ctx;
+    QStringList cols;
+    double ratio = e->size() > 0 ? 100.0 * e->compressed_size() / e->size() : 0;
+    QString volume = "";
+    Mystream::Part *part = w->stream->find_part_wofft(e->offset());
+    if (part != nullptr)
+      volume = QString::fromStdString(fs::path(part->path).filename().string());
+    cols << QString::fromUtf8(e->get_name())
+         << QString::number((qlonglong)e->size())
+         << QString::number((qlonglong)e->compressed_size())
+         << QString::asprintf("%.1f%%", ratio)
+         << Archive::Entry::method_name(e->method())
+         << QString::asprintf("%08x", e->crc())
+         << QString::number((qlonglong)e->offset()) << volume;
+    new QTreeWidgetItem(w->top, cols);
+    w->total++;
+    return true;
+  }
+
+  void add_archive(std::list<std::string> *parts, QString title) {
+    top = new QTreeWidgetItem(&tree, QStringList(title));
+    try {
+      Mystream z(parts);
+      Archive a(&z);
+      stream = &z;
+      if (a.list(add_cb, this) != MZ_OK)
+        top->setText(1, "Failed to read the central directory");
+    } catch (std::exception &e) {
+      top->setText(1, e.what());
+    }
+    stream = nullptr;
+    top->setExpanded(true);
+  }
+
+  // Lists every ZIP on its own; if some can't be opened alone they are
+  // probably parts, so the sorted set is listed as one archive as well.
+  void show_archives(std::list<std::string> parts, QPoint const &point) {
+    tree.clear();
+    total = 0;
+    bool split = false;
+    for (auto &part : parts) {
+      std::list<std::string> p = {part};
+      add_archive(&p, QString::fromStdString(part));
+      split |= top->childCount() == 0 and !top->text(1).isEmpty();
+    }
+    if (split and parts.size() > 1) {
+      parts.sort();
+      add_archive(&parts, "All parts as one ZIP");
+    }
+    for (int c = 0; c < tree.columnCount(); c++)
+      tree.resizeColumnToContents(c);
+    summary.setText(
+        QString::asprintf("%llu entries", (unsigned long long)total));
+    move(point.x(), point.y());
+    show();
+    raise();
+    activateWindow();
+  }
+};
+
 struct LicenseDialog : public QDialog {
   QVBoxLayout layout;
   QTextBrowser tb;
@@ -1222,19 +680,47 @@ struct ZipType : QDialog {
   QRadioButton fulls;
   QDialogButtonBox button_box;
   QCheckBox del;
+  QCheckBox resume;
+  QComboBox incremental;
+  QComboBox sync;
+  QLineEdit include;
+  QLineEdit exclude;
   ZipType(QWidget *parent)
       : QDialog(parent), grp(this), splits("Treat as parts of a single ZIP."),
         fulls("Treat as full ZIP(s)."), button_box(QDialogButtonBox::Ok, this),
-        del("Delete ZIP(s) after extraction.", this) {
+        del("Delete ZIP(s) after extraction.", this),
+        resume("Resume an interrupted extraction.", this), incremental(this),
+        sync(this), include(this), exclude(this) {
 
     grp.addButton(&splits);
     grp.addButton(&fulls);
 
     fulls.click();
 
+    // order matches Extractor::Incremental
+    incremental.addItem("Extract all files");
+    incremental.addItem("Skip files with the same size and date");
+    incremental.addItem("Skip files with the same size and CRC");
+
+    // order matches SyncPolicy
+    sync.addItem("Don't sync to disk");
+    sync.addItem("Sync every file");
+    sync.addItem("Sync in batches");
+    sync.addItem("Sync when done");
+
     layout.addWidget(&splits);
     layout.addWidget(&fulls);
     layout.addWidget(&del);
+    layout.addWidget(&resume);
+    layout.addWidget(&incremental);
+    layout.addWidget(&sync);
+
+    include.setPlaceholderText("Only extract (e.g. *.txt;docs/**;re:^img/)");
+    exclude.setPlaceholderText("Don't extract (e.g. *.tmp)");
+    include.setClearButtonEnabled(true);
+    exclude.setClearButtonEnabled(true);
+    layout.addWidget(&include);
+    layout.addWidget(&exclude);
     layout.addWidget(&button_box);
 
     // button_box.button(QDialogButtonBox::Ok)->setText("");
@@ -1253,6 +739,18 @@ struct ZipType : QDialog {
   }
 
   bool deleteAfter() { return del.isChecked(); }
+
+  bool resumable() { return resume.isChecked(); }
+
+  Extractor::Incremental incrementalMode() {
+    return (Extractor::Incremental)incremental.currentIndex();
+  }
+
+  std::string includes() { return include.text().toStdString(); }
+
+  std::string excludes() { return exclude.text().toStdString(); }
+
+  SyncPolicy syncPolicy() { return (SyncPolicy)sync.currentIndex(); }
 };
 
 struct App : public QApplication {
@@ -1261,6 +759,8 @@ struct App : public QApplication {
   QMenu file_menu;
   QAction action_file_open;
   QAction action_extract;
+  QAction action_list;
+  QAction action_test;
   QAction action_license;
   DropBox drop_box;
   QToolBar toolbar;
@@ -1273,22 +773,32 @@ struct App : public QApplication {
   QMenu about_menu;
   AboutWindow about_window;
   ZipType zt;
+  ListWindow list_window;
 
   int errors = 0;
   int not_errors = 0;
 
   std::list<std::string> part_paths;
   bool canceled = false;
+  SyncPolicy sync_policy = SyncPolicy::NONE;
+  bool resumable = false;
+  Extractor::Incremental incremental = Extractor::Incremental::OFF;
+  std::string includes;
+  std::string excludes;
+  // JobMetrics::report() of each archive of the running extraction
+  std::vector<std::string> metrics;
 
   App(int argc, char *argv[])
       : QApplication(argc, argv), file_menu("File"), action_file_open("Add"),
-        action_extract("Extract"), action_license("About"),
+        action_extract("Extract"), action_list("List"), action_test("Test"),
+        action_license("About"),
         drop_box(&main_widget, &part_paths), toolbar(&window),
         file_dialog(&main_widget), progress_window(&main_widget),
         exist_dialog(&main_widget),
         // done_dialog(&main_widget),
         fail_dialog(&main_widget), about_menu("About", &window),
-        about_window(&main_widget), zt(&main_widget) {
+        about_window(&main_widget), zt(&main_widget),
+        list_window(&main_widget) {
     window.resize(600, 400);
     window.setCentralWidget(&main_widget);
 
@@ -1323,6 +833,11 @@ struct App : public QApplication {
       if (part_paths.empty())
         return;
       zt.exec();
+      sync_policy = zt.syncPolicy();
+      resumable = zt.resumable();
+      incremental = zt.incrementalMode();
+      includes = zt.includes();
+      excludes = zt.excludes();
       std::string out_dir = open_out_dir();
       if (!out_dir.empty()) {
         printf(" len %lu\n", part_paths.size());
@@ -1330,12 +845,27 @@ struct App : public QApplication {
       }
     });
 
+    QMainWindow::connect(&action_list, &QAction::triggered, [this]() {
+      if (part_paths.empty())
+        return;
+      list_window.show_archives(part_paths, window.geometry().topLeft());
+    });
+
+    QMainWindow::connect(&action_test, &QAction::triggered, [this]() {
+      if (part_paths.empty())
+        return;
+      zt.exec();
+      test(this, zt.grp.checkedButton() == &zt.fulls);
+    });
+
     QMainWindow::connect(&action_license, &QAction::triggered, [this]() {
       about_window.myShow(window.geometry().topLeft());
     });
 
     toolbar.addAction(&action_file_open);
     toolbar.addAction(&action_extract);
+    toolbar.addAction(&action_list);
+    toolbar.addAction(&action_test);
 
     about_menu.addAction(&action_license);
     window.menuBar()->addMenu(&about_menu);
@@ -1404,6 +934,7 @@ struct App : public QApplication {
   }
 
   void setupExtraction(Extractor *x, int num_entries, std::string file_name) {
+    Trace::Scope ts("App::setupExtraction");
     QMetaObject::invokeMethod((QObject *)this,
                               [this, x, num_entries, file_name]() {
                                 progress_window.setRange(0, num_entries);
@@ -1415,6 +946,7 @@ struct App : public QApplication {
   }
 
   static void extractCB(bool done, bool cancel, std::string zip, void *ctx) {
+    Trace::Scope ts("App::extractCB");
     QMetaObject::invokeMethod((QObject *)ctx,
                               [ctx, done, cancel, zip]() {
                                 App *a = (App *)ctx;
@@ -1433,6 +965,7 @@ struct App : public QApplication {
 
   static void extractSplitCB(bool done, bool cancel, std::string zip,
                              void *ctx) {
+    Trace::Scope ts("App::extractSplitCB");
     QMetaObject::invokeMethod((QObject *)ctx,
                               [ctx, done, cancel, zip]() {
                                 App *a = (App *)ctx;
@@ -1451,6 +984,7 @@ struct App : public QApplication {
 
   static bool existsCB(const char *file_name, size_t file_name_len, bool is_dir,
                        void *ctx) {
+    Trace::Scope ts("App::existsCB");
     int skip;
     QMetaObject::invokeMethod(
         (QObject *)ctx,
@@ -1475,14 +1009,30 @@ struct App : public QApplication {
     return skip == QMessageBox::Yes;
   }
 
+  // Applies the options picked in the ZipType dialog.
+  void configure(Extractor *x) {
+    x->syncer.policy = sync_policy;
+    x->resumable = resumable;
+    x->incremental = incremental;
+    x->filter.add_all(includes, false);
+    x->filter.add_all(excludes, true);
+  }
+
   void extractFull(std::string part_name, std::string od) {
     try {
       std::list<std::string> p = {part_name};
       Mystream z(&p);
       Archive a(&z);
       Extractor x(&a, od, part_name);
+      configure(&x);
       setupExtraction(&x, a.num_entries, part_name);
-      x.extract(extractCB, existsCB, this);
+      try {
+        x.extract(extractCB, existsCB, this);
+      } catch (...) {
+        metrics.push_back(x.metrics.report(part_name, false));
+        throw;
+      }
+      metrics.push_back(x.metrics.report(part_name, true));
     } catch (std::exception &e) {
       QMetaObject::invokeMethod((QObject *)this,
                                 [this, &e, &part_name]() {
@@ -1499,8 +1049,15 @@ struct App : public QApplication {
       Mystream z(p);
       Archive a(&z);
       Extractor x(&a, od, "");
+      configure(&x);
       setupExtraction(&x, a.num_entries, "");
-      x.extract(extractSplitCB, existsCB, this);
+      try {
+        x.extract(extractSplitCB, existsCB, this);
+      } catch (...) {
+        metrics.push_back(x.metrics.report(p->front(), false));
+        throw;
+      }
+      metrics.push_back(x.metrics.report(p->front(), true));
     } catch (std::exception &e) {
       QMetaObject::invokeMethod((QObject *)this,
                                 [this, &e, p]() {
@@ -1514,6 +1071,7 @@ struct App : public QApplication {
   static void extract(App *app, std::string od, bool fulls) {
     app->fail_dialog.alwaysAsk();
     app->exist_dialog.alwaysAsk();
+    app->metrics.clear();
     // app->done_dialog.alwaysAsk();
     std::thread([app, od = std::move(od), fulls]() {
       if (fulls) {
@@ -1533,11 +1091,16 @@ struct App : public QApplication {
               App *a = (App *)app;
               QString message = QString::asprintf(
                   "Extraction completed with %d error(s).", app->errors);
-              if (a->errors == 0) {
-                QMessageBox::information(&app->main_widget, "Done", message);
-              } else {
-                QMessageBox::warning(&app->main_widget, "Done", message);
-              }
+              QMessageBox box(a->errors == 0 ? QMessageBox::Information
+                                             : QMessageBox::Warning,
+                              "Done", message, QMessageBox::Ok,
+                              &app->main_widget);
+              // the same JSON as the CLI's --metrics, under Show Details
+              if (!a->metrics.empty())
+                box.setDetailedText(QString::fromStdString(
+                    JobMetrics::run_json(a->metrics)));
+              box.exec();
+              a->metrics.clear();
               app->errors = 0;
             },
             Qt::BlockingQueuedConnection);
@@ -1545,6 +1108,102 @@ struct App : public QApplication {
     }).detach();
   }
 
+  static void testCB(uint64_t done, void *ctx) {
+    QMetaObject::invokeMethod(
+        (QObject *)ctx,
+        [ctx, done]() { ((App *)ctx)->progress_window.progressTo(done); },
+        Qt::QueuedConnection);
+  }
+
+  // Checks the CRC of every entry of the added ZIPs, nothing is extracted.
+  static void test(App *app, bool fulls) {
+    std::vector<std::list<std::string>> sets;
+    if (fulls) {
+      for (auto &part : app->part_paths)
+        sets.push_back({part});
+    } else {
+      std::list<std::string> parts = app->part_paths;
+      parts.sort();
+      sets.push_back(parts);
+    }
+    std::thread([app, sets]() {
+      std::string details;
+      size_t corrupt = 0, unchecked = 0;
+      for (auto &set : sets) {
+        Tester t(set);
+        t.progress = testCB;
+        t.ctx = app;
+        std::string zip = set.size() == 1 ? set.front() : "";
+        try {
+          QMetaObject::invokeMethod(
+              (QObject *)app,
+              [app, &t, zip]() {
+                app->progress_window.setRange(0, 0);
+                app->progress_window.myShow(app->window.geometry().center());
+                app->progress_window.setExtractor(nullptr, zip);
+                app->progress_window.setTester(&t);
+              },
+              Qt::BlockingQueuedConnection);
+          {
+            // the entry count is only known once the central directory is
+            // read, see Tester::run()
+            Mystream z(&t.parts);
+            Archive a(&z);
+            QMetaObject::invokeMethod(
+                (QObject *)app,
+                [app, &a]() {
+                  app->progress_window.setRange(0, a.num_entries);
+                },
+                Qt::BlockingQueuedConnection);
+          }
+          corrupt += t.run();
+          for (auto &f : t.failures) {
+            details += f.name.empty()
+                           ? f.error
+                           : f.name + " (" + f.volume + " at offset " +
+                                 std::to_string(f.volume_offset) +
+                                 "): " + f.error;
+            details += "\n";
+          }
+          for (auto &name : t.unchecked)
+            details += name + ": encrypted, not checked\n";
+          unchecked += t.unchecked.size();
+        } catch (std::exception &e) {
+          corrupt++;
+          details += zip + ": " + e.what() + "\n";
+        }
+        QMetaObject::invokeMethod(
+            (QObject *)app,
+            [app]() {
+              app->progress_window.setTester(nullptr);
+              app->finishExtraction();
+            },
+            Qt::BlockingQueuedConnection);
+      }
+      QMetaObject::invokeMethod(
+          (QObject *)app,
+          [app, corrupt, unchecked, details]() {
+            QMessageBox box(&app->main_widget);
+            box.setWindowTitle("Test");
+            if (corrupt == 0) {
+              box.setIcon(QMessageBox::Information);
+              box.setText("No errors were found.");
+            } else {
+              box.setIcon(QMessageBox::Warning);
+              box.setText(QString::asprintf("%zu corrupt entries were found.",
+                                            corrupt));
+            }
+            if (unchecked != 0)
+              box.setInformativeText(QString::asprintf(
+                  "%zu encrypted entries were not checked.", unchecked));
+            if (!details.empty())
+              box.setDetailedText(QString::fromStdString(details));
+            box.exec();
+          },
+          Qt::BlockingQueuedConnection);
+    }).detach();
+  }
+
   auto get_file_at(size_t idx) {
     auto it = part_paths.begin();
     std::advance(it, idx);
@@ -1583,9 +1242,23 @@ struct App : public QApplication {
 };
 
 int main(int argc, char *argv[]) {
+  if (argc > 1 and Cli::is_command(argv[1]))
+    return Cli::run(argc, argv);
   qInitResources();
   // qDebug("====== APP STARTING =====\n");
   QCoreApplication::setAttribute(Qt::AA_DisableSessionManager);
+  // the GUI has no options, so tracing and a memory budget are asked for in
+  // the environment
+  const char *trace = getenv("ZIPCOMBINER_TRACE");
+  if (trace != nullptr and *trace != 0)
+    Trace::start();
+  const char *max_mem = getenv("ZIPCOMBINER_MAX_MEM");
+  if (max_mem != nullptr and
+      !MemoryPool::parse_size(max_mem, &MemoryPool::capacity))
+    fprintf(stderr, "Ignoring ZIPCOMBINER_MAX_MEM=%s\n", max_mem);
   App *app = new App(argc, argv);
-  return app->exec();
+  int res = app->exec();
+  if (trace != nullptr and *trace != 0 and !Trace::save(trace))
+    fprintf(stderr, "Failed to write %s\n", trace);
+  return res;
 }
@@ -0,0 +1,86 @@
+#include "mempool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include "trace.hpp"
+
+void MemoryPool::take(size_t n) {
+  if (n == 0)
+    return;
+  std::unique_lock<std::mutex> g(lock);
+  if (capacity != 0 and used + n > capacity and held == 0) {
+    Trace::Scope ts("MemoryPool::take");
+    ts.bytes = n;
+    waits++;
+    // a request larger than the whole budget goes once nothing else is
+    // taken, or it would never go
+    freed.wait(g, [n] {
+      return capacity == 0 or used + n <= capacity or used == 0;
+    });
+  }
+  used += n;
+  held += n;
+  if (used > peak)
+    peak = used;
+}
+
+bool MemoryPool::try_take(size_t n) {
+  std::lock_guard<std::mutex> g(lock);
+  if (capacity != 0 and used + n > capacity)
+    return false;
+  used += n;
+  held += n;
+  if (used > peak)
+    peak = used;
+  return true;
+}
+
+void MemoryPool::give(size_t n) {
+  if (n == 0)
+    return;
+  {
+    std::lock_guard<std::mutex> g(lock);
+    used -= std::min(used, n);
+    // what another thread took may be given back here
+    held -= std::min(held, n);
+  }
+  freed.notify_all();
+}
+
+bool MemoryPool::parse_size(const std::string &s, size_t *out) {
+  // strtoull would take "-1" and leading blanks too
+  if (s.empty() or s[0] < '0' or s[0] > '9')
+    return false;
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(s.c_str(), &end, 10);
+  if (errno == ERANGE)
+    return false;
+  int shift = 0;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (*end == 'B' or *end == 'b')
+    end++;
+  if (*end != '\0' or v > SIZE_MAX >> shift)
+    return false;
+  *out = (size_t)v << shift;
+  return true;
+}
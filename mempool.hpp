@@ -0,0 +1,137 @@
+#pragma once
+
+// A budget for the large buffers of the whole process: the read-ahead of
+// every Mystream, the input and output chunks of the decoders and the files
+// a sink holds until they end. With a budget set (--max-mem) a thread that
+// wants more than is left waits until others give some back, so many jobs at
+// once slow down rather than run a small container out of memory.
+//
+// A thread that already holds pool memory never waits, since it may be what
+// the others wait on; it goes over the budget instead, by at most what one
+// job needs next to its first buffer. So jobs are held back as they start,
+// and decoders that run on several threads take their buffers up front and
+// use fewer threads when the pool is short.
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct MemoryPool {
+  static inline std::mutex lock;
+  static inline std::condition_variable freed;
+  // bytes, 0 for no budget
+  static inline size_t capacity = 0;
+  static inline size_t used = 0;
+  static inline size_t peak = 0;
+  // times a thread had to wait for memory
+  static inline uint64_t waits = 0;
+  // what this thread took and didn't give back yet
+  static inline thread_local size_t held = 0;
+
+  // Takes n bytes of the budget, waiting for them if need be.
+  static void take(size_t n);
+
+  // Takes n bytes only if they are free now.
+  static bool try_take(size_t n);
+
+  static void give(size_t n);
+
+  // "512M" and the like, with k, M or G for powers of 1024.
+  static bool parse_size(const std::string &s, size_t *out);
+};
+
+// A buffer charged to the MemoryPool while it's allocated.
+struct PoolBuffer {
+  std::unique_ptr<char[]> data;
+  size_t size = 0;
+
+  PoolBuffer() {}
+
+  explicit PoolBuffer(size_t n) { reset(n); }
+
+  ~PoolBuffer() { reset(0); }
+
+  PoolBuffer(PoolBuffer &&o) noexcept : data(std::move(o.data)), size(o.size) {
+    o.size = 0;
+  }
+
+  PoolBuffer &operator=(PoolBuffer &&o) noexcept {
+    if (this != &o) {
+      reset(0);
+      data = std::move(o.data);
+      size = o.size;
+      o.size = 0;
+    }
+    return *this;
+  }
+
+  // Frees the buffer and allocates n bytes, waiting for the pool. What was
+  // in it is lost.
+  void reset(size_t n) {
+    data.reset();
+    MemoryPool::give(size);
+    size = 0;
+    if (n == 0)
+      return;
+    MemoryPool::take(n);
+    alloc(n);
+  }
+
+  // Like reset() but fails instead of waiting.
+  bool try_reset(size_t n) {
+    data.reset();
+    MemoryPool::give(size);
+    size = 0;
+    if (n != 0 and !MemoryPool::try_take(n))
+      return false;
+    alloc(n);
+    return true;
+  }
+
+  char *get() const { return data.get(); }
+
+private:
+  void alloc(size_t n) {
+    try {
+      data.reset(new char[n]);
+    } catch (...) {
+      MemoryPool::give(n);
+      throw;
+    }
+    size = n;
+  }
+};
+
+// Memory held some other way, a std::vector say, charged to the pool at
+// what set() was last told.
+struct PoolCharge {
+  size_t bytes = 0;
+
+  PoolCharge() {}
+
+  ~PoolCharge() { set(0); }
+
+  PoolCharge(const PoolCharge &) = delete;
+  PoolCharge &operator=(const PoolCharge &) = delete;
+
+  void set(size_t n) {
+    if (n > bytes)
+      MemoryPool::take(n - bytes);
+    else
+      MemoryPool::give(bytes - n);
+    bytes = n;
+  }
+
+  // Like set() but fails instead of waiting when it would grow.
+  bool try_set(size_t n) {
+    if (n > bytes and !MemoryPool::try_take(n - bytes))
+      return false;
+    if (n < bytes)
+      MemoryPool::give(bytes - n);
+    bytes = n;
+    return true;
+  }
+};
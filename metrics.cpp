@@ -0,0 +1,185 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#ifndef _WIN32
+#include <sys/resource.h>
+#else
+#include <windows.h>
+#endif
+
+#include "archive.hpp"
+#include "mystream.hpp"
+
+uint64_t Histogram::percentile(double p) const {
+  if (count == 0)
+    return 0;
+  uint64_t want = p * count;
+  if (want >= count)
+    return max;
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    // the highest value of the bucket, as HdrHistogram does
+    if (seen > want)
+      return i + 1 < BUCKETS ? std::min(lowest(i + 1) - 1, max) : max;
+  }
+  return max;
+}
+
+void Histogram::json(std::string *out) const {
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "{\"count\": %llu, \"min\": %llu, \"max\": %llu, \"mean\": %.1f, ",
+           (unsigned long long)count, (unsigned long long)(count ? min : 0),
+           (unsigned long long)max, count ? sum / count : 0.0);
+  *out += buf;
+  snprintf(buf, sizeof(buf),
+           "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, ",
+           (unsigned long long)percentile(0.5),
+           (unsigned long long)percentile(0.9),
+           (unsigned long long)percentile(0.99),
+           (unsigned long long)percentile(0.999));
+  *out += buf;
+  // the buckets that aren't empty, as [lowest value, count]
+  *out += "\"buckets\": [";
+  bool first = true;
+  for (int i = 0; i < BUCKETS; i++) {
+    if (counts[i] == 0)
+      continue;
+    snprintf(buf, sizeof(buf), "%s[%llu, %llu]", first ? "" : ", ",
+             (unsigned long long)lowest(i), (unsigned long long)counts[i]);
+    *out += buf;
+    first = false;
+  }
+  *out += "]}";
+}
+
+uint64_t Metrics::now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double Metrics::cpu_seconds() {
+#ifndef _WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+         ru.ru_stime.tv_usec / 1e6;
+#else
+  FILETIME created, exited, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    return 0;
+  auto secs = [](FILETIME t) {
+    return (((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime) / 1e7;
+  };
+  return secs(kernel) + secs(user);
+#endif
+}
+
+void JobMetrics::begin() {
+  if (!counted)
+    shared = running++ != 0;
+  counted = true;
+  start_seq = ++started;
+  start_ns = Metrics::now_ns();
+  start_cpu = Metrics::cpu_seconds();
+  written_base = IoTotals(*written_from);
+  synced_base = IoTotals(*synced_from);
+}
+
+void JobMetrics::end() {
+  wall_ns = Metrics::now_ns() - start_ns;
+  cpu = Metrics::cpu_seconds() - start_cpu;
+  // another job began after this one, or was running when it did
+  if (shared or started != start_seq)
+    cpu = -1;
+  if (counted)
+    running--;
+  counted = false;
+  written = IoTotals(*written_from) - written_base;
+  synced = IoTotals(*synced_from) - synced_base;
+}
+
+static void json_io(std::string *out, const IoTotals &t) {
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "\"calls\": %llu, \"bytes\": %llu, \"seeks\": %llu, "
+           "\"wait_s\": %.6f, \"errors\": %llu",
+           (unsigned long long)t.calls, (unsigned long long)t.bytes,
+           (unsigned long long)t.seeks, t.wait_ns / 1e9,
+           (unsigned long long)t.errors);
+  *out += buf;
+}
+
+std::string JobMetrics::json() const {
+  std::string out = "{";
+  char buf[200];
+  IoTotals read;
+  std::string parts = "[";
+  if (stream != nullptr) {
+    for (size_t i = 0; i < stream->parts.size(); i++) {
+      IoTotals t(stream->io[i]);
+      read.calls += t.calls;
+      read.bytes += t.bytes;
+      read.seeks += t.seeks;
+      read.wait_ns += t.wait_ns;
+      read.errors += t.errors;
+      if (i != 0)
+        parts += ", ";
+      parts += "{\"path\": ";
+      Lister::json_string(&parts, stream->parts[i].path.c_str());
+      snprintf(buf, sizeof(buf), ", \"size\": %lld, ",
+               (long long)stream->parts[i].file_size);
+      parts += buf;
+      json_io(&parts, t);
+      parts += "}";
+    }
+  } else if (piped != nullptr) {
+    read = IoTotals(*piped);
+    parts += "{\"path\": \"-\", ";
+    json_io(&parts, read);
+    parts += "}";
+  }
+  parts += "]";
+  double wait = (read.wait_ns + written.wait_ns + synced.wait_ns) / 1e9;
+  snprintf(buf, sizeof(buf), "\"wall_s\": %.6f, ", wall_ns / 1e9);
+  out += buf;
+  if (cpu >= 0) {
+    snprintf(buf, sizeof(buf), "\"cpu_s\": %.6f, ", cpu);
+    out += buf;
+  }
+  snprintf(buf, sizeof(buf), "\"io_wait_s\": %.6f, \"entries\": %llu, ",
+           wait, (unsigned long long)entries);
+  out += buf;
+  out += "\"read\": {";
+  json_io(&out, read);
+  out += ", \"parts\": " + parts + "}, \"written\": {";
+  json_io(&out, written);
+  out += "}, \"synced\": {";
+  json_io(&out, synced);
+  out += "}, \"entry_latency_us\": ";
+  entry_us.json(&out);
+  out += "}";
+  return out;
+}
+
+std::string JobMetrics::report(const std::string &zip, bool ok) const {
+  std::string r = "{\"zip\": ";
+  Lister::json_string(&r, zip.c_str());
+  r += ok ? ", \"ok\": true" : ", \"ok\": false";
+  r += ", \"metrics\": " + json() + "}";
+  return r;
+}
+
+std::string JobMetrics::run_json(const std::vector<std::string> &reports) {
+  std::string out = "{\"version\": 1, \"jobs\": [";
+  for (size_t k = 0; k < reports.size(); k++)
+    out += (k == 0 ? "\n  " : ",\n  ") + reports[k];
+  out += "\n]}\n";
+  return out;
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+// Numbers about a job for tuning a deployment: what was read from each part
+// and how, what was written, how long the job waited on reads and writes
+// against the CPU time it used, and how long entries took. Reads are counted
+// per Mystream part, writes process-wide by write_file() and friends and
+// also by the sink and Syncer of a job that writes files. JobMetrics takes
+// the difference over one job and writes it as JSON.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counts values in buckets that are 1/16 of a power of two wide, like
+// HdrHistogram with one significant digit and a bit, so percentiles are
+// within about 6% of the true value over any range.
+struct Histogram {
+  enum { SUB_BITS = 4, SUB = 1 << SUB_BITS };
+  enum { BUCKETS = (64 - SUB_BITS + 1) * SUB };
+
+  uint64_t counts[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  double sum = 0;
+
+  static int index(uint64_t v) {
+    if (v < SUB)
+      return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB + (int)((v >> (e - SUB_BITS)) & (SUB - 1));
+  }
+
+  // smallest value that goes in bucket i
+  static uint64_t lowest(int i) {
+    if (i < SUB)
+      return i;
+    int e = i / SUB + SUB_BITS - 1;
+    return ((uint64_t)(SUB + i % SUB)) << (e - SUB_BITS);
+  }
+
+  void add(uint64_t v) {
+    counts[index(v)]++;
+    count++;
+    sum += v;
+    if (v < min)
+      min = v;
+    if (v > max)
+      max = v;
+  }
+
+  // The value that a share p of the values are at or below.
+  uint64_t percentile(double p) const;
+
+  void json(std::string *out) const;
+};
+
+// Reads or writes on one file, or on all of them for writes. wait_ns is the
+// wall time spent inside the calls.
+struct IoCounters {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> seeks{0};
+  std::atomic<uint64_t> wait_ns{0};
+  std::atomic<uint64_t> errors{0};
+
+  void add(uint64_t n, uint64_t ns) {
+    calls.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(n, std::memory_order_relaxed);
+    wait_ns.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  void seek() { seeks.fetch_add(1, std::memory_order_relaxed); }
+
+  void error() { errors.fetch_add(1, std::memory_order_relaxed); }
+};
+
+// Lookups in a cache, a hit being one served without reading.
+struct CacheCounters {
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+
+  void add(bool hit) {
+    (hit ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+// A copy of IoCounters at one point, or the difference of two.
+struct IoTotals {
+  uint64_t calls = 0;
+  uint64_t bytes = 0;
+  uint64_t seeks = 0;
+  uint64_t wait_ns = 0;
+  uint64_t errors = 0;
+
+  IoTotals() {}
+
+  IoTotals(const IoCounters &c)
+      : calls(c.calls), bytes(c.bytes), seeks(c.seeks), wait_ns(c.wait_ns),
+        errors(c.errors) {}
+
+  IoTotals operator-(const IoTotals &o) const {
+    IoTotals d;
+    d.calls = calls - o.calls;
+    d.bytes = bytes - o.bytes;
+    d.seeks = seeks - o.seeks;
+    d.wait_ns = wait_ns - o.wait_ns;
+    d.errors = errors - o.errors;
+    return d;
+  }
+};
+
+struct Mystream;
+
+struct Metrics {
+  // everything Mystream read from parts, of all streams
+  static inline IoCounters read;
+  // Mystream::read() calls served from the read-ahead buffer or not
+  static inline CacheCounters readahead;
+  // everything written by write_file() and write_file_at()
+  static inline IoCounters written;
+  // fsync() and friends of the Syncer
+  static inline IoCounters synced;
+
+  static uint64_t now_ns();
+
+  // CPU time of the whole process, user and system
+  static double cpu_seconds();
+};
+
+// One extraction. begin() and end() go around it, entry_done() after each
+// entry. Reads come from the parts of stream, or from piped. Writes and syncs
+// are taken from the job's own counters where it has them. CPU time is only
+// known for the whole process, so it's left out if another job ran meanwhile.
+struct JobMetrics {
+  // jobs between begin() and end(), and how many ever got to begin()
+  static inline std::atomic<unsigned> running{0};
+  static inline std::atomic<uint64_t> started{0};
+
+  Mystream *stream = nullptr;
+  const IoCounters *piped = nullptr;
+  const IoCounters *written_from = &Metrics::written;
+  const IoCounters *synced_from = &Metrics::synced;
+  uint64_t start_ns = 0;
+  double start_cpu = 0;
+  uint64_t start_seq = 0;
+  bool shared = false;
+  // counted in running
+  bool counted = false;
+  IoTotals written_base;
+  IoTotals synced_base;
+
+  uint64_t wall_ns = 0;
+  // -1 if the process did other jobs meanwhile
+  double cpu = 0;
+  IoTotals written;
+  IoTotals synced;
+  uint64_t entries = 0;
+  // microseconds from an entry's local header being read to its data being
+  // written
+  Histogram entry_us;
+
+  ~JobMetrics() {
+    if (counted)
+      running--;
+  }
+
+  void begin();
+
+  void end();
+
+  void entry_done(uint64_t begin_ns) {
+    entry_us.add((Metrics::now_ns() - begin_ns) / 1000);
+    entries++;
+  }
+
+  std::string json() const;
+
+  // json() as one of the jobs of a run, under the name of its archive
+  std::string report(const std::string &zip, bool ok) const;
+
+  // What --metrics writes and the GUI shows: all jobs of a run.
+  static std::string run_json(const std::vector<std::string> &reports);
+};
@@ -0,0 +1,357 @@
+#include "mystream.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#endif
+
+static int32_t my_stream_is_open_cb(void *stream);
+
+static int32_t my_stream_open_cb(void *stream, const char *path, int32_t mode);
+
+static int32_t my_stream_read_cb(void *stream, void *buf, int32_t size);
+
+static int32_t my_stream_seek_cb(void *stream, int64_t offset, int32_t origin);
+
+static int32_t my_stream_write_cb(void *stream, const void *buf, int32_t size);
+
+static int64_t my_stream_tell_cb(void *stream);
+
+static int32_t my_stream_close_cb(void *stream);
+
+static int32_t my_stream_error_cb(void *stream);
+
+static void *my_stream_create_cb(void);
+
+static void my_stream_destroy_cb(void **stream);
+
+static int32_t my_stream_get_prop_int64_cb(void *stream, int32_t prop,
+                                           int64_t *value);
+
+static int32_t my_stream_set_prop_int64_cb(void *stream, int32_t prop,
+                                           int64_t value);
+
+size_t Mystream::Part::init(Part *p, size_t begin, const char *file_path) {
+  p->file = fopen(file_path, "rb");
+  if (p->file == nullptr) {
+    std::string err_msg =
+        std::error_code(errno, std::generic_category()).message();
+    err_msg.append(": ");
+    err_msg.append(file_path);
+    throw Error(err_msg);
+  }
+
+  int res = fseek(p->file, 0, SEEK_END);
+  if (res != 0) {
+    throw Error(generic_error_msg() + ": " + file_path);
+  }
+  off_t file_size = ftello(p->file);
+  if (file_size == (off_t)-1) {
+    throw Error(generic_error_msg() + ": " + file_path);
+  }
+  res = fseek(p->file, 0, SEEK_SET);
+  if (res != 0) {
+    throw Error(generic_error_msg() + ": " + file_path);
+  }
+
+  p->begin = begin;
+  p->end = begin + file_size;
+  p->file_size = file_size;
+  p->path = file_path;
+
+  return p->end;
+}
+
+int64_t Mystream::Part::pread(void *buf, int64_t len, off_t lofft,
+                              std::mutex *lock) noexcept {
+  int64_t done = 0;
+#ifndef _WIN32
+  (void)lock;
+  while (done < len) {
+    ssize_t n = ::pread(fileno(file), (char *)buf + done, len - done,
+                        lofft + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      break;
+    done += n;
+  }
+#else
+  std::lock_guard<std::mutex> guard(*lock);
+  if (_fseeki64(file, lofft, SEEK_SET) != 0)
+    return -1;
+  done = fread(buf, 1, len, file);
+  if (done < len and ferror(file))
+    return -1;
+#endif
+  return done;
+}
+
+Mystream::Mystream(std::list<std::string> *part_paths) {
+  memset(&vtbl, 0, sizeof(vtbl));
+
+  vtbl.open = my_stream_open_cb;
+  vtbl.is_open = my_stream_is_open_cb;
+  vtbl.read = my_stream_read_cb;
+  vtbl.seek = my_stream_seek_cb;
+  vtbl.write = my_stream_write_cb;
+  vtbl.tell = my_stream_tell_cb;
+  vtbl.error = my_stream_error_cb;
+  vtbl.close = my_stream_close_cb;
+  vtbl.create = my_stream_create_cb;
+  vtbl.destroy = my_stream_destroy_cb;
+  vtbl.set_prop_int64 = my_stream_set_prop_int64_cb;
+  vtbl.get_prop_int64 = my_stream_get_prop_int64_cb;
+
+  strm.vtbl = &vtbl;
+  strm._strm = this;
+
+  Part tmp;
+  off_t offt = 0;
+  whole_size = 0;
+
+  auto it = part_paths->begin();
+
+  try {
+    for (size_t i = 0; i < part_paths->size(); i++) {
+      off_t new_offt = Part::init(&tmp, offt, it->c_str());
+      // printf("part: %s\n", it->c_str());
+      parts.push_back(tmp);
+      offt = new_offt;
+      whole_size += tmp.file_size;
+      std::advance(it, 1);
+    }
+  } catch (...) {
+    // no destructor runs for a stream that wasn't made
+    for (auto &p : parts)
+      fclose(p.file);
+    throw;
+  }
+  io.reset(new IoCounters[parts.size()]);
+
+  whole_offt = 0;
+}
+
+Mystream::~Mystream() {
+  for (auto &p : parts)
+    fclose(p.file);
+}
+
+Mystream::Part *Mystream::find_part_wofft(off_t offt) {
+  for (size_t i = 0; i < parts.size(); i++) {
+    Part *tmp = &parts[i];
+    if (tmp->has(offt)) {
+      return tmp;
+    }
+  }
+  return nullptr;
+}
+
+int32_t Mystream::read(void *buf, int32_t size) {
+  Trace::Scope ts("Mystream::read");
+  int32_t done = 0;
+  bool hit = true;
+  while (done < size) {
+    if (whole_offt >= ahead_begin and whole_offt < ahead_begin + ahead_len) {
+      int64_t n = std::min<int64_t>(size - done,
+                                    ahead_begin + ahead_len - whole_offt);
+      memcpy((char *)buf + done, ahead.get() + (whole_offt - ahead_begin), n);
+      done += n;
+      whole_offt += n;
+      continue;
+    }
+    Part *part = find_part_wofft(whole_offt);
+    if (part == nullptr)
+      break;
+    hit = false;
+    bool direct = (size_t)(size - done) >= readahead;
+    int64_t want = part->end - whole_offt;
+    char *to = (char *)buf + done;
+    if (direct) {
+      want = std::min<int64_t>(want, size - done);
+    } else {
+      if (ahead.get() == nullptr)
+        ahead.reset(readahead);
+      if (whole_offt == ahead_begin + ahead_len)
+        window = std::min<size_t>(window * 2, readahead);
+      else
+        window = std::min<size_t>(MIN_WINDOW, readahead);
+      want = std::min<int64_t>(want, std::max<size_t>(window, size - done));
+      to = ahead.get();
+    }
+    uint64_t start = Metrics::now_ns();
+    int64_t n = part->pread(to, want, part->local_offt(whole_offt),
+                            &pread_lock);
+    uint64_t ns = Metrics::now_ns() - start;
+    io[part - parts.data()].add(n > 0 ? n : 0, ns);
+    Metrics::read.add(n > 0 ? n : 0, ns);
+    if (n < 0) {
+      io[part - parts.data()].error();
+      Metrics::read.error();
+      if (done == 0)
+        return -1;
+      break;
+    }
+    if (n == 0)
+      break;
+    if (direct) {
+      done += n;
+      whole_offt += n;
+    } else {
+      ahead_begin = whole_offt;
+      ahead_len = n;
+    }
+  }
+  Metrics::readahead.add(hit);
+  ts.bytes = done;
+  return done;
+}
+
+int64_t Mystream::read_at(void *buf, int64_t len, off_t offt) {
+  Trace::Scope ts("Mystream::read_at");
+  ts.bytes = len;
+  int64_t done = 0;
+  while (done < len) {
+    Part *part = find_part_wofft(offt + done);
+    if (part == nullptr)
+      break;
+    int64_t want = std::min<int64_t>(len - done, part->end - (offt + done));
+    uint64_t start = Metrics::now_ns();
+    int64_t n = part->pread((char *)buf + done, want,
+                            part->local_offt(offt + done), &pread_lock);
+    uint64_t ns = Metrics::now_ns() - start;
+    io[part - parts.data()].add(n > 0 ? n : 0, ns);
+    Metrics::read.add(n > 0 ? n : 0, ns);
+    if (n < 0) {
+      io[part - parts.data()].error();
+      Metrics::read.error();
+      return -1;
+    }
+    done += n;
+    if (n < want)
+      break;
+  }
+  return done;
+}
+
+int32_t Mystream::seek(int64_t offset, int32_t origin) {
+  off_t from = whole_offt;
+  switch (origin) {
+  case MZ_SEEK_SET:
+    if (offset > whole_size)
+      return -1;
+    this->whole_offt = offset;
+    break;
+  case MZ_SEEK_CUR:
+    if (offset > 0) {
+      if (whole_offt + offset > whole_size)
+        return -1;
+      this->whole_offt += offset;
+    } else {
+      if (whole_offt < offset)
+        return -1;
+      this->whole_offt -= offset;
+    }
+    break;
+  case MZ_SEEK_END:
+    if (offset > whole_size)
+      return -1;
+    this->whole_offt = whole_size - offset;
+    break;
+  default:
+    assert(false && "unknow origin");
+  }
+  // counted on the part the stream lands in
+  Part *part = whole_offt != from ? find_part_wofft(whole_offt) : nullptr;
+  if (part != nullptr)
+    io[part - parts.data()].seek();
+  return 0;
+}
+
+static int32_t my_stream_get_prop_int64_cb(void *stream, int32_t prop,
+                                           int64_t *value) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  if (value != nullptr) {
+    *value = ctx->_strm->get_prop(prop);
+  }
+  return 0;
+}
+
+static int32_t my_stream_set_prop_int64_cb(void *stream, int32_t prop,
+                                           int64_t value) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  ctx->_strm->set_prop(prop, value);
+  return 0;
+}
+
+static void *my_stream_create_cb(void) {
+  // printf("%s()\n", __FUNCTION__);
+  assert(false);
+  return nullptr;
+}
+
+static void my_stream_destroy_cb(void **stream) {
+  // printf("%s()\n", __FUNCTION__);
+  (void)stream;
+  assert(false);
+}
+
+static int32_t my_stream_close_cb(void *stream) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->close();
+}
+
+static int32_t my_stream_error_cb(void *stream) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->error();
+}
+
+static int64_t my_stream_tell_cb(void *stream) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->tell();
+}
+
+static int32_t my_stream_write_cb(void *stream, const void *buf, int32_t size) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->write(buf, size);
+}
+
+static int32_t my_stream_seek_cb(void *stream, int64_t offset, int32_t origin) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->seek(offset, origin);
+}
+
+static int32_t my_stream_read_cb(void *stream, void *buf, int32_t size) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->read(buf, size);
+}
+
+static int32_t my_stream_is_open_cb(void *stream) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->parts.empty();
+}
+
+static int32_t my_stream_open_cb(void *stream, const char *path, int32_t mode) {
+  // printf("%s()\n", __FUNCTION__);
+  Mystream::Ctx *ctx = (Mystream::Ctx *)stream;
+  return ctx->_strm->open(path, mode);
+}
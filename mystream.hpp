@@ -0,0 +1,153 @@
+#pragma once
+
+// Mystream: the parts of a split archive read as one minizip stream.
+
+#include <cassert>
+#include <cstdint>
+#include <exception>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mz.h>
+#include <mz_strm.h>
+#include <sys/types.h>
+
+#include "fileio.hpp"
+#include "mempool.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+struct Mystream {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "A stream error ocurred\n") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  mz_stream_vtbl vtbl;
+
+  struct Ctx {
+    mz_stream_vtbl *vtbl;
+    struct mz_stream_s *base;
+    Mystream *_strm;
+  };
+  Ctx strm;
+  // minizip's stream properties by id, MZ_STREAM_PROP_TOTAL_IN (1) up to
+  // MZ_STREAM_PROP_COMPRESS_WINDOW, looked up with a single compare. Ids
+  // past those, if a newer minizip has any, go in more_props.
+  static constexpr int32_t PROPS = MZ_STREAM_PROP_COMPRESS_WINDOW + 1;
+  int64_t props[PROPS] = {};
+  std::map<int32_t, int64_t> more_props;
+
+  struct Part {
+    off_t begin;
+    off_t end;
+    off_t file_size;
+    FILE *file;
+    std::string path;
+
+    static size_t init(Part *p, size_t begin, const char *file_path);
+
+    bool has(off_t offt) noexcept { return offt >= begin and offt < end; }
+
+    off_t local_offt(off_t global_offt) noexcept {
+      if (!has(global_offt)) {
+        return -1;
+      }
+      return global_offt - begin;
+    }
+
+    // Like read() but leaves the FILE position alone, so threads can share
+    // the part. lock serializes the fallback where there is no pread().
+    int64_t pread(void *buf, int64_t len, off_t lofft,
+                  std::mutex *lock) noexcept;
+  };
+
+  std::vector<Part> parts;
+  // reads of each part, by index in parts
+  std::unique_ptr<IoCounters[]> io;
+  std::mutex pread_lock;
+  off_t whole_offt;
+  off_t whole_size;
+  // minizip reads headers a few bytes at a time, so read() fetches a window
+  // of the part at once and serves the next reads from it. The window doubles
+  // up to readahead bytes while reads go on where the last fetch ended and
+  // drops back after a seek. Reads of readahead bytes or more skip the
+  // buffer, 0 turns it off. The buffer is taken from the MemoryPool on the
+  // first read, which is where a job waits if the pool is short.
+  enum { MIN_WINDOW = 16 << 10 };
+  size_t readahead = 256 << 10;
+  size_t window = MIN_WINDOW;
+  PoolBuffer ahead;
+  off_t ahead_begin = 0;
+  int64_t ahead_len = 0;
+
+  Mystream(std::list<std::string> *part_paths);
+
+  ~Mystream();
+
+  Mystream(const Mystream &) = delete;
+  Mystream &operator=(const Mystream &) = delete;
+
+  int64_t get_prop(int32_t key) const {
+    if ((uint32_t)key < (uint32_t)PROPS)
+      return props[key];
+    auto it = more_props.find(key);
+    return it != more_props.end() ? it->second : 0;
+  }
+
+  void set_prop(int32_t key, int64_t value) {
+    if ((uint32_t)key < (uint32_t)PROPS)
+      props[key] = value;
+    else
+      more_props[key] = value;
+  }
+
+  Part *find_part_wofft(off_t offt);
+
+  int32_t open(const char *path, int32_t mode) {
+    (void)path;
+    (void)mode;
+    assert(false);
+    return -1;
+  }
+
+  // Reads len bytes at offt of the whole stream, crossing into the next parts
+  // as needed. Doesn't move the stream position and is safe to call from
+  // several threads.
+  int64_t read_at(void *buf, int64_t len, off_t offt);
+
+  // Reads from the stream position on, through the read-ahead buffer.
+  int32_t read(void *buf, int32_t size);
+
+  int32_t write(const void *buf, int32_t size) {
+    (void)buf;
+    (void)size;
+    assert(false);
+    return -1;
+  }
+
+  int32_t seek(int64_t offset, int32_t origin);
+
+  int64_t tell() { return whole_offt; }
+
+  int32_t close() {
+    assert(false);
+    return -1;
+  }
+
+  int32_t error() {
+    assert(false);
+    return -1;
+  }
+
+  void *create() { assert(false); }
+
+  void *destroy() { assert(false); }
+
+  mz_stream *get_mz_stream() { return (mz_stream *)&strm; }
+};
@@ -0,0 +1,135 @@
+#include "scheduler.hpp"
+
+#include <set>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "archive.hpp"
+#include "fileio.hpp"
+#include "mystream.hpp"
+
+// The device and size of the file at path.
+static bool stat_path(const std::string &path, uint64_t *dev, uint64_t *size) {
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(path.c_str(), &st) != 0)
+    return false;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+#endif
+  *dev = st.st_dev;
+  *size = st.st_size;
+  return true;
+}
+
+void Scheduler::probe(ExtractJob *job) {
+  std::set<uint64_t> devices;
+  uint64_t dev, size;
+  for (auto &p : job->parts) {
+    if (stat_path(p, &dev, &size)) {
+      job->bytes += size;
+      devices.insert(dev);
+    }
+  }
+  // the output folder may not be there yet, the closest folder above it
+  // that is will be on the same device
+  for (fs::path out = job->out_dir; !out.empty(); out = out.parent_path()) {
+    if (stat_path(out.string(), &dev, &size)) {
+      devices.insert(dev);
+      break;
+    }
+    if (out == out.parent_path())
+      break;
+  }
+  job->devices.assign(devices.begin(), devices.end());
+
+  uint64_t packed = 0, unpacked = 0;
+  try {
+    Mystream z(&job->parts);
+    Archive a(&z);
+    Archive::Entry e;
+    for (int res = a.go_to_first_entry(&e); res == MZ_OK;
+         res = a.get_next_entry(&e)) {
+      if (e.load_info() != MZ_OK)
+        break;
+      packed += e.compressed_size();
+      unpacked += e.size();
+    }
+  } catch (std::exception &e) {
+    // the job will fail, it doesn't matter how
+  }
+  job->cpu_bound = unpacked >= CPU_RATIO * packed and unpacked > 0;
+}
+
+bool Scheduler::fits(const ExtractJob &job) const {
+  for (uint64_t d : job.devices) {
+    auto it = running.find(d);
+    if (it != running.end() and it->second[job.cpu_bound] >= per_device)
+      return false;
+  }
+  return true;
+}
+
+std::shared_ptr<ExtractJob> Scheduler::pick(uint64_t now_ns) {
+  auto best = queue.end();
+  std::set<uint64_t> held;
+  bool want_cpu = running_cpu < running_io;
+  for (auto it = queue.begin(); it != queue.end(); ++it) {
+    const ExtractJob &j = **it;
+    bool blocked = false;
+    for (uint64_t d : j.devices)
+      blocked = blocked or held.count(d) > 0;
+    if (blocked)
+      continue;
+    if (now_ns - j.queued_ns >= starve_s * 1e9) {
+      if (fits(j)) {
+        best = it;
+        break;
+      }
+      held.insert(j.devices.begin(), j.devices.end());
+      continue;
+    }
+    if (!fits(j))
+      continue;
+    if (best == queue.end()) {
+      best = it;
+      continue;
+    }
+    const ExtractJob &b = **best;
+    if ((j.cpu_bound == want_cpu) != (b.cpu_bound == want_cpu)) {
+      if (j.cpu_bound == want_cpu)
+        best = it;
+    } else if (j.bytes < b.bytes) {
+      best = it;
+    }
+  }
+  if (best == queue.end())
+    return nullptr;
+  // a starving job found later holds the devices of an earlier pick too
+  for (uint64_t d : (*best)->devices) {
+    if (held.count(d) > 0)
+      return nullptr;
+  }
+  std::shared_ptr<ExtractJob> job = *best;
+  queue.erase(best);
+  started(*job);
+  return job;
+}
+
+void Scheduler::started(const ExtractJob &job) {
+  for (uint64_t d : job.devices)
+    running[d][job.cpu_bound]++;
+  (job.cpu_bound ? running_cpu : running_io)++;
+}
+
+void Scheduler::finished(const ExtractJob &job) {
+  for (uint64_t d : job.devices) {
+    auto it = running.find(d);
+    it->second[job.cpu_bound]--;
+    if (it->second[0] == 0 and it->second[1] == 0)
+      running.erase(it);
+  }
+  (job.cpu_bound ? running_cpu : running_io)--;
+}
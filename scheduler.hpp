@@ -0,0 +1,74 @@
+#pragma once
+
+// Decides which queued extraction runs next, so that jobs extracted at once
+// don't fight over the same disk:
+//  - jobs that read or write the same device (st_dev) run per_device at a
+//    time, counted apart for CPU and I/O bound jobs, so one of each can
+//    share a disk while two that would both keep it busy can't
+//  - of the jobs that may start, the kind fewer running jobs are of goes
+//    first, then the smallest, which keeps the mean time to done down
+//  - a job that waited starve_s goes before any other, and holds off new
+//    jobs on its devices until it can start
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Extractor;
+
+struct ExtractJob {
+  enum class State { QUEUED, RUNNING, DONE, FAILED };
+  uint64_t id = 0;
+  State state = State::QUEUED;
+  std::list<std::string> parts;
+  std::string out_dir;
+  std::string error;
+  // JobMetrics::report() once it ran
+  std::string report;
+  // written with done_text once the job succeeded, if set
+  std::string done_marker;
+  std::string done_text;
+  Extractor *running = nullptr;
+
+  // what Scheduler::probe() found
+  uint64_t bytes = 0;
+  std::vector<uint64_t> devices;
+  bool cpu_bound = false;
+  uint64_t queued_ns = 0;
+};
+
+struct Scheduler {
+  // a job whose entries unpack to CPU_RATIO times what they take in the
+  // archive spends more time inflating than reading
+  enum { CPU_RATIO = 2 };
+
+  unsigned per_device = 1;
+  double starve_s = 300;
+  // in the order the jobs came in
+  std::deque<std::shared_ptr<ExtractJob>> queue;
+  // running jobs by device, I/O bound ones first
+  std::map<uint64_t, std::array<unsigned, 2>> running;
+  unsigned running_cpu = 0;
+  unsigned running_io = 0;
+
+  // Fills in the sizes, devices and kind of job. Reads the central
+  // directory, so Daemon does it on a thread of its own and not under a
+  // lock.
+  static void probe(ExtractJob *job);
+
+  // Whether job may start next to the running ones.
+  bool fits(const ExtractJob &job) const;
+
+  // Takes the job to run next off the queue, or returns nullptr if none may
+  // start now.
+  std::shared_ptr<ExtractJob> pick(uint64_t now_ns);
+
+  void started(const ExtractJob &job);
+
+  void finished(const ExtractJob &job);
+};
@@ -0,0 +1,249 @@
+#include "sink.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/utime.h>
+#endif
+
+void DirSink::symlink(const std::string &name, const std::string &target,
+                      time_t mtime) {
+  (void)mtime;
+#ifdef _WIN32
+  (void)name;
+  (void)target;
+  throw Error("Failed to create link");
+#else
+  if (::symlink(target.c_str(), make_path(name).c_str()) != 0)
+    throw Error(generic_error_msg());
+#endif
+}
+
+void DirSink::begin_file(const std::string &name, int64_t size, time_t mtime) {
+  path = make_path(name);
+  file = fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    throw Error("Failed to open a file");
+  this->size = size;
+  this->mtime = mtime;
+  scattered = false;
+  syncer->begin_file();
+}
+
+void DirSink::end_file() {
+  // written out of order, so it's all submitted at the end
+  if (scattered)
+    syncer->written = size;
+  try {
+    syncer->end_file(file, path);
+  } catch (...) {
+    abort_file();
+    throw;
+  }
+  fclose(file);
+  file = nullptr;
+  set_mtime(path, mtime);
+}
+
+void TarSink::block(const std::string &name, char type, int64_t size,
+                    time_t mtime, const std::string &link) {
+  char h[BLOCK] = {};
+  memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+  octal(h + 100, 8, type == '5' ? 0755 : type == '2' ? 0777 : 0644);
+  octal(h + 108, 8, 0);
+  octal(h + 116, 8, 0);
+  octal(h + 124, 12, size <= MAX_OCTAL ? size : 0);
+  octal(h + 136, 12, mtime >= 0 and mtime <= MAX_OCTAL ? mtime : 0);
+  h[156] = type;
+  memcpy(h + 157, link.data(), std::min<size_t>(link.size(), 100));
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+  // the checksum is taken with its own field all spaces
+  memset(h + 148, ' ', 8);
+  unsigned sum = 0;
+  for (int i = 0; i < BLOCK; i++)
+    sum += (unsigned char)h[i];
+  snprintf(h + 148, 8, "%06o", sum);
+  h[155] = ' ';
+  put(h, BLOCK);
+}
+
+void TarSink::header(const std::string &name, char type, int64_t size,
+                     time_t mtime, const std::string &link) {
+  std::string pax;
+  if (name.size() > 100)
+    pax_record(&pax, "path", name);
+  if (link.size() > 100)
+    pax_record(&pax, "linkpath", link);
+  if (size > MAX_OCTAL)
+    pax_record(&pax, "size", std::to_string(size));
+  if (mtime < 0 or mtime > MAX_OCTAL)
+    pax_record(&pax, "mtime", std::to_string((long long)mtime));
+  if (!pax.empty()) {
+    block(("PaxHeader/" + name).substr(0, 100), 'x', pax.size(), mtime, "");
+    put(pax.data(), pax.size());
+    pad(pax.size());
+  }
+  block(name, type, size, mtime, link);
+}
+
+void TarSink::begin_file(const std::string &name, int64_t size, time_t mtime) {
+  if (size >= 0)
+    header(name, '0', size, mtime);
+  this->name = name;
+  this->mtime = mtime;
+  this->size = size;
+  written = 0;
+  open = true;
+  drop_held();
+}
+
+void TarSink::write(const char *buf, size_t len) {
+  if (size < 0) {
+    size_t max = hold_max;
+    if (MemoryPool::capacity != 0)
+      max = std::min(max, MemoryPool::capacity);
+    if (spill == nullptr and held.size() + len > max)
+      spill_held();
+    if (spill != nullptr) {
+      write_file(spill, buf, len);
+    } else {
+      if (held.size() + len > held.capacity()) {
+        size_t cap = std::min(std::max(held.size() + len, held.capacity() * 2),
+                              max);
+        held_charge.set(cap);
+        held.reserve(cap);
+      }
+      held.insert(held.end(), buf, buf + len);
+    }
+    written += len;
+    return;
+  }
+  if (written + (int64_t)len > size)
+    throw Error("Entry is larger than its size");
+  put(buf, len);
+  written += len;
+}
+
+void TarSink::spill_held() {
+  spill = tmpfile();
+  if (spill == nullptr)
+    throw Error("Failed to create a temporary file");
+  write_file(spill, held.data(), held.size());
+  held.clear();
+  held.shrink_to_fit();
+  held_charge.set(0);
+}
+
+void TarSink::end_file() {
+  static const char zeros[BLOCK] = {};
+  open = false;
+  if (size < 0) {
+    size = written;
+    header(name, '0', size, mtime);
+    if (spill != nullptr) {
+      if (fflush(spill) != 0 or fseek(spill, 0, SEEK_SET) != 0)
+        throw Error("Failed to read back a temporary file");
+      PoolBuffer buf(std::min<int64_t>(size, 1 << 20));
+      for (int64_t at = 0; at < size;) {
+        size_t n = std::min<int64_t>(buf.size, size - at);
+        if (fread(buf.get(), 1, n, spill) != n)
+          throw Error("Failed to read back a temporary file");
+        put(buf.get(), n);
+        at += n;
+      }
+    } else {
+      put(held.data(), held.size());
+    }
+    drop_held();
+  }
+  while (written < size) {
+    int64_t n = std::min<int64_t>(BLOCK, size - written);
+    put(zeros, n);
+    written += n;
+  }
+  pad(size);
+}
+
+void TarSink::abort_file() noexcept {
+  if (!open)
+    return;
+  if (size < 0) {
+    // nothing of it was written yet
+    open = false;
+    drop_held();
+    return;
+  }
+  try {
+    end_file();
+  } catch (std::exception &e) {
+  }
+}
+
+char *MemorySink::take(size_t len) {
+  for (auto &a : arenas) {
+    if (a.size - a.used >= len) {
+      char *p = a.data + a.used;
+      a.used += len;
+      return p;
+    }
+  }
+  if (!grow)
+    throw Error("Out of memory for " + name);
+  size_t n = std::max(arena_size, len);
+  if (MemoryPool::capacity != 0 and n > MemoryPool::capacity)
+    throw Error(name + " is larger than the memory limit");
+  owned.emplace_back(n);
+  arenas.push_back({owned.back().get(), n, len});
+  return owned.back().get();
+}
+
+void MemorySink::write(const char *buf, size_t len) {
+  if (size >= 0) {
+    write_at(buf, len, written);
+    written += len;
+    return;
+  }
+  if (held.size() + len > held.capacity()) {
+    size_t cap = std::max(held.size() + len, held.capacity() * 2);
+    if (MemoryPool::capacity != 0)
+      cap = std::min(cap, std::max(held.size() + len, MemoryPool::capacity));
+    if (MemoryPool::capacity != 0 and cap > MemoryPool::capacity)
+      throw Error(name + " is larger than the memory limit");
+    held_charge.set(cap);
+    held.reserve(cap);
+  }
+  held.insert(held.end(), buf, buf + len);
+}
+
+void MemorySink::end_file() {
+  if (size < 0) {
+    size = held.size();
+    data = take(size);
+    if (size != 0)
+      memcpy(data, held.data(), size);
+  }
+  char *n = take(name.size());
+  memcpy(n, name.data(), name.size());
+  files.push_back({{n, name.size()}, {data, (size_t)size}});
+  sorted = false;
+  data = nullptr;
+}
+
+const std::string_view *MemorySink::find(std::string_view name) {
+  auto by_name = [](const File &a, const File &b) { return a.name < b.name; };
+  if (!sorted)
+    std::stable_sort(files.begin(), files.end(), by_name);
+  sorted = true;
+  auto it = std::upper_bound(files.begin(), files.end(), File{name, {}},
+                             by_name);
+  if (it == files.begin() or (it - 1)->name != name)
+    return nullptr;
+  return &(it - 1)->data;
+}
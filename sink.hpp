@@ -0,0 +1,351 @@
+#pragma once
+
+// Where extracted entries are written: a folder, a tar stream or memory.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fileio.hpp"
+#include "mempool.hpp"
+#include "trace.hpp"
+
+// Where extracted entries go. Names are paths inside the archive, with '/'
+// between folders. A file is begin_file(), any number of writes, then
+// end_file(), or abort_file() if something went wrong in between.
+struct OutputSink {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "Failed to write the output") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  virtual ~OutputSink() {}
+
+  // True if name is already there and would be replaced, with the path to
+  // show the user in *shown.
+  virtual bool exists(const std::string &name, std::string *shown) {
+    (void)name;
+    (void)shown;
+    return false;
+  }
+
+  virtual void dir(const std::string &name, time_t mtime) = 0;
+  virtual void symlink(const std::string &name, const std::string &target,
+                       time_t mtime) = 0;
+  // size is -1 if it's only known after the data, as for entries with a
+  // data descriptor read from a pipe.
+  virtual void begin_file(const std::string &name, int64_t size,
+                          time_t mtime) = 0;
+  virtual void write(const char *buf, size_t len) = 0;
+  // Writes at an offset of the current file. Sinks without random access
+  // only take the offsets in order, from one thread.
+  virtual void write_at(const char *buf, size_t len, int64_t offt) = 0;
+  virtual void end_file() = 0;
+  virtual void abort_file() noexcept = 0;
+
+  // Whether write_at() can be called out of order from several threads.
+  virtual bool random_access() { return false; }
+
+  // Called once after the last entry.
+  virtual void finish() {}
+};
+
+// Writes entries below root as files, folders and symlinks. Extractor points
+// root at its staging folder, out_path is where they end up once published.
+struct DirSink : OutputSink {
+  std::string root;
+  std::string out_path;
+  Syncer *syncer;
+
+  // the file being written
+  FILE *file = nullptr;
+  std::string path;
+  int64_t size = 0;
+  time_t mtime = 0;
+  std::atomic<bool> scattered{false};
+  std::mutex lock;
+  // this sink's share of Metrics::written
+  IoCounters written;
+
+  DirSink(Syncer *s) : syncer(s) {}
+
+  ~DirSink() { abort_file(); }
+
+  bool exists(const std::string &name, std::string *shown) override {
+    std::string dest = out_path + name;
+    std::error_code ec;
+    if (!fs::exists(dest, ec) or fs::is_directory(dest, ec))
+      return false;
+    *shown = dest;
+    return true;
+  }
+
+  // root + name, with the folders in front of it created
+  std::string make_path(const std::string &name) {
+    std::string p = root + name;
+    std::error_code ec;
+    Trace::Scope ts("create_directories");
+    fs::create_directories(fs::path(p).parent_path(), ec);
+    if (ec)
+      throw Error("Failed to a create directory.");
+    return p;
+  }
+
+  void dir(const std::string &name, time_t mtime) override {
+    (void)mtime;
+    std::error_code ec;
+    std::string p = make_path(name);
+    Trace::Scope ts("create_directory");
+    fs::create_directory(p, ec);
+    if (ec)
+      throw Error("Failed to a create directory.");
+  }
+
+  void symlink(const std::string &name, const std::string &target,
+               time_t mtime) override;
+
+  void begin_file(const std::string &name, int64_t size, time_t mtime) override;
+
+  void write(const char *buf, size_t len) override {
+    if (write_file(file, buf, len, &written) != len)
+      throw Error("Failed to write to file");
+    syncer->wrote(file, len);
+  }
+
+  void write_at(const char *buf, size_t len, int64_t offt) override {
+    write_file_at(file, buf, len, offt, &lock, &written);
+    scattered = true;
+  }
+
+  void end_file() override;
+
+  void abort_file() noexcept override {
+    if (file != nullptr)
+      fclose(file);
+    file = nullptr;
+  }
+
+  bool random_access() override { return true; }
+};
+
+// Writes entries as a POSIX tar stream, so an archive can be repacked through
+// a pipe without anything landing on disk. Files are written as they are
+// decoded and so have to come in order. Paths and link targets over 100
+// bytes, sizes of 8 GiB and more and odd dates go in a pax header in front.
+// A file of unknown size is held until its end, since the header with the
+// size has to come first: in memory up to hold_max or the MemoryPool budget,
+// whichever is less, and in a temporary file past that.
+struct TarSink : OutputSink {
+  enum { BLOCK = 512 };
+  enum : int64_t { MAX_OCTAL = 077777777777ll };
+
+  FILE *out;
+  // the file being written
+  std::string name;
+  time_t mtime = 0;
+  int64_t size = 0;
+  int64_t written = 0;
+  bool open = false;
+  std::vector<char> held;
+  // held is charged to the MemoryPool
+  PoolCharge held_charge;
+  size_t hold_max = 64 << 20;
+  // what didn't fit in held
+  FILE *spill = nullptr;
+
+  TarSink(FILE *f) : out(f) {}
+
+  ~TarSink() {
+    if (spill != nullptr)
+      fclose(spill);
+  }
+
+  // Moves what's held to a temporary file.
+  void spill_held();
+
+  void drop_held() noexcept {
+    held.clear();
+    held.shrink_to_fit();
+    held_charge.set(0);
+    if (spill != nullptr)
+      fclose(spill);
+    spill = nullptr;
+  }
+
+  void put(const char *buf, size_t len) {
+    if (write_file(out, buf, len) != len)
+      throw Error("Failed to write the tar stream");
+  }
+
+  // zeros up to the next block
+  void pad(int64_t len) {
+    static const char zeros[BLOCK] = {};
+    if (len % BLOCK != 0)
+      put(zeros, BLOCK - len % BLOCK);
+  }
+
+  static void octal(char *field, size_t width, int64_t v) {
+    snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)v);
+  }
+
+  // "LEN key=value\n" where LEN counts its own digits too
+  static void pax_record(std::string *pax, const char *key,
+                         const std::string &value) {
+    size_t len = strlen(key) + value.size() + 3;
+    size_t n = len + 1;
+    while (n != len + std::to_string(n).size())
+      n = len + std::to_string(n).size();
+    *pax += std::to_string(n) + " " + key + "=" + value + "\n";
+  }
+
+  void block(const std::string &name, char type, int64_t size, time_t mtime,
+             const std::string &link);
+
+  void header(const std::string &name, char type, int64_t size, time_t mtime,
+              const std::string &link = "");
+
+  void dir(const std::string &name, time_t mtime) override {
+    header(name.empty() or name.back() == '/' ? name : name + "/", '5', 0,
+           mtime);
+  }
+
+  void symlink(const std::string &name, const std::string &target,
+               time_t mtime) override {
+    header(name, '2', 0, mtime, target);
+  }
+
+  void begin_file(const std::string &name, int64_t size, time_t mtime) override;
+
+  void write(const char *buf, size_t len) override;
+
+  void write_at(const char *buf, size_t len, int64_t offt) override {
+    if (offt != written)
+      throw Error("Out of order write to a tar stream");
+    write(buf, len);
+  }
+
+  // A file that was cut short, by cancel or an error, is filled up with
+  // zeros to the size in its header so that the stream stays readable.
+  void end_file() override;
+
+  void abort_file() noexcept override;
+
+  // two zero blocks end the archive
+  void finish() override {
+    static const char zeros[BLOCK] = {};
+    put(zeros, BLOCK);
+    put(zeros, BLOCK);
+    if (fflush(out) != 0)
+      throw Error("Failed to write the tar stream");
+  }
+};
+
+// Keeps extracted files in memory, for bundles that never need to be on
+// disk. Files are packed one after the other into arenas, a few large blocks
+// that the caller can hand in with add_arena(); when those are full more are
+// allocated, arena_size bytes or the size of the file if that's larger, or
+// Error is thrown if grow is false. Names go in the arenas too, so files, a
+// flat list of name and bytes that find() looks up, allocates nothing per
+// file. Both stay valid as long as the sink and its arenas do.
+struct MemorySink : OutputSink {
+  struct Arena {
+    char *data;
+    size_t size;
+    size_t used;
+  };
+
+  struct File {
+    std::string_view name;
+    std::string_view data;
+  };
+
+  std::vector<Arena> arenas;
+  // arenas grown here, charged to the MemoryPool
+  std::vector<PoolBuffer> owned;
+  size_t arena_size = 4 << 20;
+  bool grow = true;
+  // in the order they ended until find() sorts them by name
+  std::vector<File> files;
+  bool sorted = true;
+  std::map<std::string, std::string> links;
+
+  // the file being written
+  std::string name;
+  char *data = nullptr;
+  int64_t size = 0;
+  int64_t written = 0;
+  // files of unknown size are gathered here first
+  std::vector<char> held;
+  // held is charged to the MemoryPool
+  PoolCharge held_charge;
+
+  void add_arena(char *buf, size_t len) { arenas.push_back({buf, len, 0}); }
+
+  // The bytes of the file called name, the last one if it came more than
+  // once, or nullptr.
+  const std::string_view *find(std::string_view name);
+
+  // len bytes in the first arena with room for them
+  char *take(size_t len);
+
+  // Gives back the last len bytes taken from the arena at p.
+  void give_back(char *p, size_t len) {
+    for (auto &a : arenas) {
+      if (p + len == a.data + a.used)
+        a.used -= len;
+    }
+  }
+
+  void dir(const std::string &name, time_t mtime) override {
+    (void)name;
+    (void)mtime;
+  }
+
+  void symlink(const std::string &name, const std::string &target,
+               time_t mtime) override {
+    (void)mtime;
+    links[name] = target;
+  }
+
+  void begin_file(const std::string &name, int64_t size,
+                  time_t mtime) override {
+    (void)mtime;
+    this->name = name;
+    this->size = size;
+    written = 0;
+    data = size >= 0 ? take(size) : nullptr;
+    held.clear();
+  }
+
+  void write(const char *buf, size_t len) override;
+
+  // Files have all their room from the start, so threads can fill
+  // different parts of one at once.
+  void write_at(const char *buf, size_t len, int64_t offt) override {
+    if (offt < 0 or offt + (int64_t)len > size)
+      throw Error(name + " is larger than its size");
+    memcpy(data + offt, buf, len);
+  }
+
+  void end_file() override;
+
+  void abort_file() noexcept override {
+    if (data != nullptr)
+      give_back(data, size);
+    data = nullptr;
+    held.clear();
+    held.shrink_to_fit();
+    held_charge.set(0);
+  }
+
+  bool random_access() override { return true; }
+};
@@ -0,0 +1,218 @@
+#include "tester.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "crc32.hpp"
+#include "lzma_zip.hpp"
+#include "zstd_frames.hpp"
+
+bool Tester::collect_cb(Archive::Entry *e, void *ctx) {
+  Tester *t = (Tester *)ctx;
+  if (!e->is_dir()) {
+    t->items.push_back({e->archive->entry_pos(), e->offset(), e->get_name(),
+                        e->method(), e->compressed_size(), e->size(),
+                        e->crc(),
+                        (e->entry->flag & MZ_ZIP_FLAG_ENCRYPTED) != 0});
+  }
+  return !t->cancel;
+}
+
+void Tester::stop() {
+  cancel = true;
+  std::lock_guard<std::mutex> guard(lock);
+  for (Archive *a : archives)
+    a->cancel = true;
+}
+
+void Tester::fail(Mystream *z, const Item &item, std::string error) {
+  Failure f = {item.name, "", item.offset, error};
+  Mystream::Part *part = z->find_part_wofft(item.offset);
+  if (part != nullptr) {
+    f.volume = part->path;
+    f.volume_offset = part->local_offt(item.offset);
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  failures.push_back(f);
+}
+
+const char *Tester::test_stored(Archive *a, const Item &item, char *buf) {
+  if (item.compressed_size != item.size)
+    return "Stored size doesn't match";
+  Archive::Entry e;
+  if (a->go_to_entry(&e, item.cd_pos) != MZ_OK or e.load_info() != MZ_OK)
+    return "Bad central directory record";
+  int64_t offt = a->data_offset(&e);
+  if (offt == -1)
+    return "Bad local header";
+  uint32_t crc = 0;
+  int64_t rem = item.size;
+  while (rem > 0 and !cancel) {
+    int64_t want = std::min<int64_t>(rem, RBUFSIZ);
+    if (a->stream->read_at(buf, want, offt) != want)
+      return "Entry data is truncated";
+    crc = crc32_update(crc, buf, want);
+    offt += want;
+    rem -= want;
+  }
+  if (!cancel and crc != item.crc)
+    return "CRC mismatch";
+  return nullptr;
+}
+
+const char *Tester::test_small(Archive *a, const Item &item, char *buf,
+                               Inflater *inflater) {
+  Archive::Entry e;
+  if (a->go_to_entry(&e, item.cd_pos) != MZ_OK or e.load_info() != MZ_OK)
+    return "Bad central directory record";
+  if (!Inflater::wants(&e))
+    return test_compressed(a, item, buf);
+  if (e.read_open(true) != MZ_OK)
+    return "Can't open the entry";
+  const char *error = inflater->inflate(&e);
+  e.read_close();
+  if (error == nullptr and e.crc_value != item.crc)
+    error = "CRC mismatch";
+  return error;
+}
+
+const char *Tester::test_unpacked(Archive *a, const Item &item, char *buf,
+                                  std::string *error) {
+  Archive::Entry e;
+  if (a->go_to_entry(&e, item.cd_pos) != MZ_OK or e.load_info() != MZ_OK)
+    return "Bad central directory record";
+  if (!Unpacker::wants(&e))
+    return test_compressed(a, item, buf);
+  Unpacker unpacker;
+  unpacker.threads = 1;
+  try {
+    unpacker.unpack(&e, nullptr);
+  } catch (DecodeError &err) {
+    *error = err.message;
+    return error->c_str();
+  }
+  if (!cancel and e.crc_value != item.crc)
+    return "CRC mismatch";
+  return nullptr;
+}
+
+const char *Tester::test_compressed(Archive *a, const Item &item, char *buf) {
+  Archive::Entry e;
+  if (a->go_to_entry(&e, item.cd_pos) != MZ_OK or e.read_open() != MZ_OK)
+    return "Can't open the entry";
+  int64_t total = 0;
+  int32_t n;
+  while (!cancel and (n = mz_zip_entry_read(e.parent, buf, RBUFSIZ)) > 0)
+    total += n;
+  // minizip compares the CRC when the entry is closed
+  int res = e.read_close();
+  if (cancel)
+    return nullptr;
+  if (n < 0)
+    return "Entry data is corrupt";
+  if (res == MZ_CRC_ERROR)
+    return "CRC mismatch";
+  if (res != MZ_OK)
+    return "Entry data is corrupt";
+  if (total != item.size)
+    return "Size mismatch";
+  return nullptr;
+}
+
+void Tester::work() {
+  PoolBuffer buf(RBUFSIZ);
+  try {
+    Inflater inflater;
+    std::string message;
+    Mystream z(&parts);
+    Archive a(&z);
+    // in archives while a is there, also when the loop throws
+    struct Listed {
+      Tester *t;
+      Archive *a;
+      Listed(Tester *tester, Archive *archive) : t(tester), a(archive) {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->archives.push_back(a);
+        a->cancel = t->cancel.load();
+      }
+      ~Listed() {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->archives.erase(
+            std::find(t->archives.begin(), t->archives.end(), a));
+      }
+    } listed(this, &a);
+    size_t i;
+    while (!cancel and (i = next++) < items.size()) {
+      const Item &item = items[i];
+      const char *error;
+      if (item.encrypted) {
+        std::lock_guard<std::mutex> guard(lock);
+        unchecked.push_back(item.name);
+        error = nullptr;
+      } else if (item.method == MZ_COMPRESS_METHOD_STORE)
+        error = test_stored(&a, item, buf.get());
+      else if (item.method == MZ_COMPRESS_METHOD_DEFLATE and
+               item.size <= Inflater::SMALL and
+               item.compressed_size <= Inflater::SMALL + Inflater::SMALL / 8)
+        error = test_small(&a, item, buf.get(), &inflater);
+      else if (item.method == MZ_COMPRESS_METHOD_ZSTD or
+               item.method == MZ_COMPRESS_METHOD_LZMA)
+        error = test_unpacked(&a, item, buf.get(), &message);
+      else
+        error = test_compressed(&a, item, buf.get());
+      if (error != nullptr)
+        fail(&z, item, error);
+      uint64_t done = ++tested;
+      if (progress != nullptr)
+        progress(done, ctx);
+    }
+  } catch (std::exception &e) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      failures.push_back({"", "", -1, e.what()});
+    }
+    stop();
+  }
+}
+
+// Threads there are descriptors for: each one's Mystream opens every part.
+// Some are left for the rest of the process.
+static unsigned fd_threads(size_t parts) {
+  enum { RESERVED = 64 };
+  parts = std::max<size_t>(parts, 1);
+#ifdef _WIN32
+  uint64_t limit = _getmaxstdio();
+#else
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 or rl.rlim_cur == RLIM_INFINITY)
+    return UINT_MAX;
+  uint64_t limit = rl.rlim_cur;
+#endif
+  if (limit <= RESERVED + parts)
+    return 1;
+  return std::min<uint64_t>(UINT_MAX, (limit - RESERVED) / parts);
+}
+
+size_t Tester::run() {
+  {
+    Mystream z(&parts);
+    Archive a(&z);
+    if (a.list(collect_cb, this) != MZ_OK)
+      throw Archive::Error("Failed to read the central directory");
+  }
+  std::vector<std::thread> pool;
+  unsigned n = std::min<size_t>(threads, std::max<size_t>(items.size(), 1));
+  n = std::min(n, fd_threads(parts.size()));
+  for (unsigned i = 1; i < n; i++)
+    pool.emplace_back([this]() { work(); });
+  work();
+  for (auto &t : pool)
+    t.join();
+  return failures.size();
+}
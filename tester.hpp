@@ -0,0 +1,81 @@
+#pragma once
+
+// Tester checks the CRC of every entry of an archive on several threads.
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "archive.hpp"
+#include "extract.hpp"
+
+// Verifies the CRC of every entry without writing anything. Entries are
+// spread over threads; each thread has its own Mystream and Archive because
+// minizip handles can't be shared, so there are no more threads than there
+// are file descriptors for. Stored entries skip minizip and are read
+// straight from the parts.
+struct Tester {
+  struct Item {
+    int64_t cd_pos;
+    int64_t offset;
+    std::string name;
+    uint16_t method;
+    int64_t compressed_size;
+    int64_t size;
+    uint32_t crc;
+    bool encrypted;
+  };
+
+  struct Failure {
+    std::string name;
+    std::string volume;
+    int64_t volume_offset;
+    std::string error;
+  };
+
+  enum { RBUFSIZ = 1 << 20 };
+
+  std::list<std::string> parts;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<Item> items;
+  std::vector<Failure> failures;
+  // encrypted entries, which can't be checked without the password
+  std::vector<std::string> unchecked;
+  std::mutex lock;
+  // the Archive of each thread, so that stop() reaches the decoders that
+  // poll Archive::cancel
+  std::vector<Archive *> archives;
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> tested{0};
+  std::atomic<bool> cancel{false};
+  void (*progress)(uint64_t, void *) = nullptr;
+  void *ctx = nullptr;
+
+  Tester(std::list<std::string> part_paths) : parts(part_paths) {}
+
+  static bool collect_cb(Archive::Entry *e, void *ctx);
+
+  // Cancels from another thread.
+  void stop();
+
+  void fail(Mystream *z, const Item &item, std::string error);
+
+  const char *test_stored(Archive *a, const Item &item, char *buf);
+
+  const char *test_small(Archive *a, const Item &item, char *buf,
+                         Inflater *inflater);
+
+  // zstd and LZMA, one entry per thread since entries are spread already
+  const char *test_unpacked(Archive *a, const Item &item, char *buf,
+                            std::string *error);
+
+  const char *test_compressed(Archive *a, const Item &item, char *buf);
+
+  void work();
+
+  // Returns the number of corrupt entries, see failures.
+  size_t run();
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+// Trace points on the hot paths: a Trace::Scope on the stack records how long
+// its block took, if Trace::start() was called. Each thread records into a
+// ring buffer of its own, so recording takes no lock; once a buffer is full
+// its oldest events are overwritten. save() writes what was recorded in the
+// Chrome trace format, which chrome://tracing and Perfetto open. While off, a
+// trace point costs a relaxed load and a branch.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Trace {
+  enum { CAPACITY = 1 << 16 };
+
+  struct Event {
+    const char *name;
+    int64_t begin; // ns since start()
+    int64_t end;
+    int64_t bytes; // -1 if not about bytes
+    uint32_t tid;
+  };
+
+  struct Buffer {
+    std::vector<Event> events;
+    uint64_t count = 0; // ever recorded, events[count % CAPACITY] is next
+  };
+
+  // A thread takes a buffer with its first event and hands it back when it
+  // exits, so the short-lived decoding threads don't each leave one behind.
+  struct Local {
+    Buffer *buf = nullptr;
+    uint32_t tid = 0;
+
+    ~Local() {
+      if (buf == nullptr)
+        return;
+      std::lock_guard<std::mutex> g(lock);
+      spare.push_back(buf);
+    }
+  };
+
+  static inline std::atomic<bool> on{false};
+  static inline std::chrono::steady_clock::time_point epoch;
+  static inline std::mutex lock;
+  static inline std::vector<std::unique_ptr<Buffer>> buffers;
+  static inline std::vector<Buffer *> spare;
+  static inline std::atomic<uint32_t> next_tid{1};
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch)
+        .count();
+  }
+
+  static void record(const char *name, int64_t begin, int64_t end,
+                     int64_t bytes) {
+    thread_local Local local;
+    if (local.buf == nullptr) {
+      std::lock_guard<std::mutex> g(lock);
+      if (spare.empty()) {
+        buffers.emplace_back(new Buffer);
+        buffers.back()->events.resize(CAPACITY);
+        local.buf = buffers.back().get();
+      } else {
+        local.buf = spare.back();
+        spare.pop_back();
+      }
+      local.tid = next_tid++;
+    }
+    Buffer *b = local.buf;
+    b->events[b->count++ % CAPACITY] = {name, begin, end, bytes, local.tid};
+  }
+
+  struct Scope {
+    const char *name;
+    int64_t begin;
+    int64_t bytes = -1;
+
+    Scope(const char *n) : name(n) {
+      begin = on.load(std::memory_order_relaxed) ? now() : -1;
+    }
+
+    ~Scope() {
+      if (begin >= 0)
+        record(name, begin, now(), bytes);
+    }
+  };
+
+  static void start() {
+    epoch = std::chrono::steady_clock::now();
+    on = true;
+  }
+
+  // Stops recording and writes everything to path. Should only be called
+  // once the traced work is done, events of threads still running may come
+  // out garbled.
+  static bool save(const std::string &path) {
+    on = false;
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == nullptr)
+      return false;
+    std::lock_guard<std::mutex> g(lock);
+    uint64_t dropped = 0;
+    bool first = true;
+    fputs("{\"traceEvents\": [", f);
+    for (auto &b : buffers) {
+      uint64_t n = std::min<uint64_t>(b->count, CAPACITY);
+      dropped += b->count - n;
+      for (uint64_t i = b->count - n; i < b->count; i++) {
+        const Event &e = b->events[i % CAPACITY];
+        fprintf(f,
+                "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+                first ? "" : ",", e.name, e.tid, e.begin / 1e3,
+                (e.end - e.begin) / 1e3);
+        if (e.bytes >= 0)
+          fprintf(f, ", \"args\": {\"bytes\": %lld}", (long long)e.bytes);
+        fputc('}', f);
+        first = false;
+      }
+    }
+    fprintf(f,
+            "\n], \"displayTimeUnit\": \"ms\", "
+            "\"otherData\": {\"dropped_events\": %llu}}\n",
+            (unsigned long long)dropped);
+    return fclose(f) == 0;
+  }
+};
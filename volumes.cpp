@@ -0,0 +1,123 @@
+#include "volumes.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "mystream.hpp"
+
+// The number written by the min_len or more digits of s that end at pos, or
+// -1. start is where they begin.
+static long digits_before(const std::string &s, size_t pos, size_t *start,
+                          size_t min_len) {
+  size_t i = pos;
+  while (i > 0 and isdigit((unsigned char)s[i - 1]))
+    i--;
+  if (pos - i < min_len or pos - i > 9)
+    return -1;
+  *start = i;
+  return atol(s.substr(i, pos - i).c_str());
+}
+
+static bool ends_with(const std::string &s, size_t end, const char *tail) {
+  size_t n = strlen(tail);
+  return end >= n and s.compare(end - n, n, tail) == 0;
+}
+
+bool Volume::parse(const std::string &name, Volume *v) {
+  std::string l = name;
+  for (auto &c : l)
+    c = tolower((unsigned char)c);
+  size_t n = l.size(), at;
+  long num;
+  if (ends_with(l, n, ".zip")) {
+    // out.part1.zip, or else out.zip
+    num = digits_before(l, n - 4, &at, 1);
+    if (num > 0 and ends_with(l, at, ".part")) {
+      *v = {name.substr(0, at - 5), Naming::RAR_STYLE, (int)num - 1};
+      return true;
+    }
+    *v = {name.substr(0, n - 4), Naming::WINZIP, LAST};
+    return n > 4;
+  }
+  num = digits_before(l, n, &at, 2);
+  if (num > 0 and ends_with(l, at, ".zip.") and n - at >= 3) {
+    *v = {name.substr(0, at - 5), Naming::SEVEN_ZIP, (int)num - 1};
+    return true;
+  }
+  if (num > 0 and ends_with(l, at, ".z") and at > 2) {
+    *v = {name.substr(0, at - 2), Naming::WINZIP, (int)num - 1};
+    return true;
+  }
+  if (num > 0 and ends_with(l, at, ".") and n - at >= 3 and at > 1) {
+    *v = {name.substr(0, at - 1), Naming::NUMBERED, (int)num - 1};
+    return true;
+  }
+  if (n > 7 and ends_with(l, n - 2, ".zip.") and
+      islower((unsigned char)l[n - 2]) and islower((unsigned char)l[n - 1])) {
+    *v = {name.substr(0, n - 7), Naming::LETTERS,
+          (l[n - 2] - 'a') * 26 + (l[n - 1] - 'a')};
+    return true;
+  }
+  return false;
+}
+
+static uint16_t u16(const unsigned char *p) { return p[0] | p[1] << 8; }
+
+static uint32_t u32(const unsigned char *p) {
+  return u16(p) | (uint32_t)u16(p + 2) << 16;
+}
+
+static uint64_t u64(const unsigned char *p) {
+  return u32(p) | (uint64_t)u32(p + 4) << 32;
+}
+
+bool archive_complete(std::list<std::string> *parts) {
+  enum { EOCD = 22, LOCATOR = 20, ZIP64_EOCD = 56, MAX_COMMENT = 0xffff };
+  try {
+    Mystream s(parts);
+    int64_t tail = std::min<int64_t>(s.whole_size, EOCD + MAX_COMMENT);
+    int64_t from = s.whole_size - tail;
+    std::vector<unsigned char> buf(tail);
+    if (s.read_at(buf.data(), tail, from) != tail)
+      return false;
+    // a part still being copied in is cut short, the parts of a spanned
+    // archive are all the same size but the last
+    bool full = true;
+    for (size_t k = 1; k + 1 < s.parts.size(); k++)
+      full = full and s.parts[k].file_size >= s.parts[0].file_size;
+    // the last record whose comment ends the archive
+    for (int64_t i = tail - EOCD; i >= 0; i--) {
+      const unsigned char *p = buf.data() + i;
+      if (u32(p) != 0x06054b50 or i + EOCD + u16(p + 20) != tail)
+        continue;
+      int64_t eocd = from + i;
+      uint64_t disks = u16(p + 4) + 1;
+      uint64_t cd_size = u32(p + 12), cd_offset = u32(p + 16);
+      int64_t cd_end = eocd;
+      unsigned char loc[LOCATOR], z[ZIP64_EOCD];
+      if (eocd >= LOCATOR and
+          s.read_at(loc, LOCATOR, eocd - LOCATOR) == LOCATOR and
+          u32(loc) == 0x07064b50) {
+        disks = u32(loc + 16);
+        if (disks > 1)
+          return parts->size() == disks and full;
+        cd_end = u64(loc + 8);
+        if (s.read_at(z, ZIP64_EOCD, cd_end) != ZIP64_EOCD or
+            u32(z) != 0x06064b50)
+          return false;
+        cd_size = u64(z + 40);
+        cd_offset = u64(z + 48);
+      }
+      if (disks > 1)
+        return parts->size() == disks and full;
+      return cd_offset + cd_size == (uint64_t)cd_end;
+    }
+  } catch (Mystream::Error &e) {
+    // a part went away meanwhile
+  }
+  return false;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// The names split archives come in, and what a set of parts looks like once
+// all of them are there.
+
+#include <cstdio>
+#include <list>
+#include <string>
+
+// How the parts of a split archive are named, for out.zip cut in n parts:
+//   SEVEN_ZIP  out.zip.001, out.zip.002...   (7-Zip, HJSplit)
+//   NUMBERED   out.001, out.002...
+//   LETTERS    out.zip.aa, out.zip.ab...     (split -a 2)
+//   WINZIP     out.z01, out.z02..., out.zip  (WinZip, zip -s)
+//   RAR_STYLE  out.part1.zip... or out.part01.zip... padded to the width of n
+// Parts with WinZip style names may be a spanned archive or, like the ones
+// bench/corpus.hpp makes, a plain byte split.
+enum class Naming { SEVEN_ZIP, NUMBERED, LETTERS, WINZIP, RAR_STYLE };
+
+inline std::string volume_name(const std::string &zip, Naming naming, int i,
+                               int n) {
+  std::string base = zip;
+  if (base.size() > 4 and base.compare(base.size() - 4, 4, ".zip") == 0)
+    base.resize(base.size() - 4);
+  char s[32];
+  switch (naming) {
+  case Naming::SEVEN_ZIP:
+    snprintf(s, sizeof(s), ".zip.%03d", i + 1);
+    break;
+  case Naming::NUMBERED:
+    snprintf(s, sizeof(s), ".%03d", i + 1);
+    break;
+  case Naming::LETTERS:
+    snprintf(s, sizeof(s), ".zip.%c%c", 'a' + i / 26 % 26, 'a' + i % 26);
+    break;
+  case Naming::WINZIP:
+    if (i == n - 1)
+      snprintf(s, sizeof(s), ".zip");
+    else
+      snprintf(s, sizeof(s), ".z%02d", i + 1);
+    break;
+  case Naming::RAR_STYLE:
+    snprintf(s, sizeof(s), ".part%0*d.zip", (int)std::to_string(n).size(),
+             i + 1);
+    break;
+  }
+  return base + s;
+}
+
+// What the name of a part says about it. base is the archive's name without
+// any extension, out for all the parts above.
+struct Volume {
+  std::string base;
+  Naming naming;
+  // place in the set from 0, or LAST for the .zip of WINZIP names, which
+  // comes after all the others
+  int index;
+
+  enum { LAST = -1 };
+
+  // False if name isn't that of a part. A lone out.zip reads as the last
+  // part of a WINZIP set with no others.
+  static bool parse(const std::string &name, Volume *v);
+};
+
+// Whether parts, in order, hold a whole archive: the end of central
+// directory record ends the last one, and either it gives the number of
+// disks of a spanned archive and there are that many parts, none but the
+// last shorter than the first, or the central directory ends right before
+// it so no bytes are missing from a byte split.
+bool archive_complete(std::list<std::string> *parts);
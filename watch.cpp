@@ -0,0 +1,230 @@
+#include "watch.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "fileio.hpp"
+
+Watcher::~Watcher() {
+#ifdef __linux__
+  if (fd >= 0)
+    close(fd);
+#endif
+}
+
+void Watcher::open() {
+#ifdef _WIN32
+  throw Error("Watching folders isn't available on Windows");
+#else
+#ifdef __linux__
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    throw Error(std::string("inotify: ") + strerror(errno));
+  for (auto &dir : dirs) {
+    int wd = inotify_add_watch(fd, dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                                   IN_MOVED_FROM | IN_ONLYDIR);
+    if (wd < 0)
+      throw Error("Can't watch " + dir + ": " + strerror(errno));
+    watches[wd] = dir;
+  }
+#endif
+  // after the watches, so nothing falls between the two
+  rescan();
+#endif
+}
+
+void Watcher::add(const std::string &dir, const std::string &name) {
+  Volume v;
+  if (!Volume::parse(name, &v))
+    return;
+  std::string key = dir + "/" + v.base + "/" + std::to_string((int)v.naming);
+  Set &s = sets[key];
+  s.dir = dir;
+  s.base = v.base;
+  s.parts[v.index] = dir + "/" + name;
+  s.changed = true;
+}
+
+void Watcher::remove(const std::string &dir, const std::string &name) {
+  Volume v;
+  if (!Volume::parse(name, &v))
+    return;
+  std::string key = dir + "/" + v.base + "/" + std::to_string((int)v.naming);
+  // parts that come again after this are a new set
+  taken.erase(key);
+  auto it = sets.find(key);
+  if (it == sets.end())
+    return;
+  it->second.parts.erase(v.index);
+  it->second.changed = true;
+  if (it->second.parts.empty())
+    sets.erase(it);
+}
+
+std::list<std::string> Watcher::ordered(const Set &s) {
+  std::list<std::string> parts;
+  int next = 0;
+  for (auto &p : s.parts) {
+    if (p.first == Volume::LAST)
+      continue;
+    if (p.first != next++)
+      return {};
+    parts.push_back(p.second);
+  }
+  auto last = s.parts.find(Volume::LAST);
+  if (last != s.parts.end())
+    parts.push_back(last->second);
+  return parts;
+}
+
+std::string Watcher::listing(const std::list<std::string> &parts) {
+  std::string l;
+  for (auto &p : parts) {
+    std::error_code ec;
+    uintmax_t size = fs::file_size(p, ec);
+    l += std::to_string(ec ? 0 : size) + " " +
+         fs::path(p).filename().string() + "\n";
+  }
+  return l;
+}
+
+bool Watcher::done(const Set &s, const std::string &listing) {
+  FILE *f = fopen(marker(s).c_str(), "rb");
+  if (f == nullptr)
+    return false;
+  std::string text(listing.size() + 1, '\0');
+  size_t n = fread(&text[0], 1, text.size(), f);
+  fclose(f);
+  return n == listing.size() and text.compare(0, n, listing) == 0;
+}
+
+void Watcher::check() {
+  for (auto it = sets.begin(); it != sets.end();) {
+    Set &s = it->second;
+    std::list<std::string> parts = ordered(s);
+    if (s.changed) {
+      s.changed = false;
+      s.complete = !parts.empty() and archive_complete(&parts);
+    }
+    if (!s.complete) {
+      ++it;
+      continue;
+    }
+    std::string l = listing(parts);
+    auto was = taken.find(it->first);
+    if ((was != taken.end() and was->second == l) or done(s, l)) {
+      it = sets.erase(it);
+      continue;
+    }
+    std::string out = (out_dir.empty() ? s.dir : out_dir) + "/" + s.base;
+    uint64_t id = daemon->submit(parts, out, marker(s), l);
+    if (id == 0) {
+      // the queue is full, the set is tried again next time
+      ++it;
+      continue;
+    }
+    fprintf(stderr, "job %llu: %s, %zu part(s)\n", (unsigned long long)id,
+            parts.front().c_str(), parts.size());
+    taken[it->first] = l;
+    it = sets.erase(it);
+  }
+}
+
+void Watcher::read_events() {
+#ifdef __linux__
+  alignas(struct inotify_event) char buf[64 << 10];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *e = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + e->len;
+      if (e->mask & IN_Q_OVERFLOW) {
+        // events were lost, the folders tell what's there
+        rescan();
+        continue;
+      }
+      auto w = watches.find(e->wd);
+      if (w == watches.end() or e->len == 0 or (e->mask & IN_ISDIR))
+        continue;
+      if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        add(w->second, e->name);
+      else
+        remove(w->second, e->name);
+    }
+  }
+#endif
+}
+
+void Watcher::rescan() {
+#ifdef __linux__
+  // inotify tells about the files that are still being written
+  for (auto &dir : dirs) {
+    std::error_code ec;
+    for (auto &f : fs::directory_iterator(dir, ec)) {
+      std::error_code fec;
+      if (f.is_regular_file(fec))
+        add(dir, f.path().filename().string());
+    }
+  }
+#else
+  std::map<std::string, std::pair<uintmax_t, bool>> now;
+  for (auto &dir : dirs) {
+    std::error_code ec;
+    for (auto &f : fs::directory_iterator(dir, ec)) {
+      std::error_code fec;
+      if (!f.is_regular_file(fec))
+        continue;
+      uintmax_t size = f.file_size(fec);
+      if (fec)
+        continue;
+      std::string name = f.path().filename().string();
+      auto was = seen.find(dir + "/" + name);
+      bool still = was != seen.end() and was->second.first == size;
+      bool taken = still and was->second.second;
+      if (still and !taken) {
+        add(dir, name);
+        taken = true;
+      }
+      now[dir + "/" + name] = {size, taken};
+    }
+  }
+  for (auto &s : seen) {
+    if (now.count(s.first) == 0) {
+      size_t slash = s.first.rfind('/');
+      remove(s.first.substr(0, slash), s.first.substr(slash + 1));
+    }
+  }
+  seen.swap(now);
+#endif
+}
+
+void Watcher::run() {
+#ifdef __linux__
+  while (!Daemon::stopping) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 250) > 0)
+      read_events();
+    check();
+  }
+#else
+  for (unsigned tick = 1; !Daemon::stopping; tick++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    if (tick % RESCAN_TICKS == 0)
+      rescan();
+    check();
+  }
+#endif
+}
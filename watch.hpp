@@ -0,0 +1,91 @@
+#pragma once
+
+// Watches spool folders for split archives and hands each set of parts to a
+// Daemon once all of them are there. Parts are grouped by their names, see
+// Volume, and a set goes when archive_complete() says so. On Linux it waits
+// on inotify for files being closed after writing or moved in, elsewhere it
+// looks at the folders every two seconds and takes files whose size held
+// still since the last look. A set the daemon has no room for waits.
+//
+// A set that was extracted leaves a hidden marker next to its parts with
+// their names and sizes, and isn't handed over again while they match, be it
+// after a restart or a rescan when inotify lost events.
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "daemon.hpp"
+#include "volumes.hpp"
+
+struct Watcher {
+  struct Error : std::exception {
+    std::string message;
+    Error(std::string m = "Failed to watch a folder") { message = m; }
+    const char *what() const noexcept override { return message.c_str(); }
+  };
+
+  struct Set {
+    std::string dir;
+    std::string base;
+    // by Volume::index, so Volume::LAST comes first
+    std::map<int, std::string> parts;
+    // since the last look at whether it's complete
+    bool changed = true;
+    bool complete = false;
+  };
+
+  enum { RESCAN_TICKS = 8 };
+
+  Daemon *daemon;
+  std::vector<std::string> dirs;
+  // a set goes to a folder named after it in out_dir, or in its own folder
+  // if out_dir is empty
+  std::string out_dir;
+  // by folder, base name and naming
+  std::map<std::string, Set> sets;
+  int fd = -1;
+  // folders by inotify watch
+  std::map<int, std::string> watches;
+  // without inotify, the size of each file at the last look and whether it
+  // was taken at that size
+  std::map<std::string, std::pair<uintmax_t, bool>> seen;
+  // what the sets handed to the daemon were made of, by key
+  std::map<std::string, std::string> taken;
+
+  Watcher(Daemon *d) : daemon(d) {}
+
+  ~Watcher();
+
+  // Starts watching dirs and takes the files already in them.
+  void open();
+
+  void add(const std::string &dir, const std::string &name);
+
+  void remove(const std::string &dir, const std::string &name);
+
+  // The parts of s in order, empty if some are missing.
+  static std::list<std::string> ordered(const Set &s);
+
+  // The names and sizes of parts, one a line, for the done marker.
+  static std::string listing(const std::list<std::string> &parts);
+
+  static std::string marker(const Set &s) {
+    return s.dir + "/." + s.base + ".zcdone";
+  }
+
+  // Whether the marker of s says these parts were extracted.
+  static bool done(const Set &s, const std::string &listing);
+
+  // Hands complete sets to the daemon.
+  void check();
+
+  void read_events();
+
+  void rescan();
+
+  // Watches until Daemon::stop().
+  void run();
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+// The extraction engine without the GUI: Mystream reads a split archive as
+// one stream, Archive walks it with minizip, Extractor and StreamExtractor
+// write its entries to an OutputSink and Tester checks them. Trace records
+// where the time goes, JobMetrics sums up a job and Daemon serves counters
+// about the jobs it runs, which a Watcher finds in spool folders. The large
+// buffers of all of them come out of the MemoryPool. Link the
+// zipcombiner_core library to use it.
+
+#include "archive.hpp"
+#include "daemon.hpp"
+#include "extract.hpp"
+#include "fileio.hpp"
+#include "mempool.hpp"
+#include "metrics.hpp"
+#include "mystream.hpp"
+#include "scheduler.hpp"
+#include "sink.hpp"
+#include "tester.hpp"
+#include "trace.hpp"
+#include "volumes.hpp"
+#include "watch.hpp"
@@ -0,0 +1,285 @@
+#pragma once
+
+// zstd data (ZIP method 93) as a list of frames. pzstd, zstd --format with
+// -B and the seekable format all write independent frames that carry their
+// content size, so where each frame goes in the output is known from the
+// headers alone and frames can be decoded by several threads at once. Data
+// that is a single frame, or frames without sizes, is decoded in one go.
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "crc32.hpp"
+#include "decode.hpp"
+#include "mempool.hpp"
+#include "trace.hpp"
+
+struct ZstdFrames {
+  enum : uint32_t { MAGIC = 0xfd2fb528, SKIP_MAGIC = 0x184d2a50 };
+  enum { CHUNK = 256 << 10, BUFSIZE = 2 * CHUNK };
+  // a frame may need a window of up to 128M; the decoder's own tables and
+  // block buffers come on top of it
+  enum { WINDOW_LOG_MAX = 27, HDRSIZ_MAX = 18, DCTX_EXTRA = 512 << 10 };
+
+  typedef DecodeError Error;
+  typedef decode_read_fn read_fn;
+  typedef decode_sink_fn sink_fn;
+
+  struct Frame {
+    int64_t in;
+    int64_t in_size;
+    int64_t out;
+    int64_t out_size;
+  };
+
+  std::vector<Frame> frames;
+  int64_t in_size = 0;
+  int64_t out_size = 0;
+  // every frame has its content size
+  bool sized = false;
+  // what one thread needs to decode the frame with the largest window
+  size_t memory = 0;
+
+  static uint32_t le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  }
+
+  // Size of a frame header from its descriptor byte, magic included.
+  static size_t header_size(unsigned char fhd) {
+    static const size_t did_size[4] = {0, 1, 2, 4};
+    bool single = fhd & 0x20;
+    int fcs = fhd >> 6;
+    return 5 + !single + did_size[fhd & 3] + (fcs == 0 ? single : 1 << fcs);
+  }
+
+  // Memory the decoder needs for the frame whose first n bytes are at p,
+  // from its window size. The largest window allowed if the header isn't
+  // all there.
+  static size_t frame_memory(const unsigned char *p, size_t n) {
+    if (n >= 4 and (le32(p) & 0xfffffff0) == SKIP_MAGIC)
+      return 0;
+    uint64_t window = (uint64_t)1 << WINDOW_LOG_MAX;
+    if (n >= 6 and !(p[4] & 0x20)) {
+      uint64_t base = (uint64_t)1 << (10 + (p[5] >> 3));
+      window = std::min(window, base + base / 8 * (p[5] & 7));
+    } else if (n >= 5 and n >= header_size(p[4])) {
+      // a single segment frame's window is its content
+      window = std::min<uint64_t>(window, ZSTD_getFrameContentSize(p, n));
+    }
+    return window + DCTX_EXTRA;
+  }
+
+  // Finds the frames of size bytes of data by walking the frame and block
+  // headers, without decoding anything. Stops at the first frame without a
+  // content size since nothing after it could be placed anyway.
+  void scan(read_fn read, void *ctx, int64_t size) {
+    frames.clear();
+    in_size = size;
+    out_size = 0;
+    sized = true;
+    memory = 0;
+    unsigned char hdr[HDRSIZ_MAX];
+    int64_t offt = 0;
+    while (offt < size) {
+      int64_t want = std::min<int64_t>(sizeof(hdr), size - offt);
+      int64_t n = read(ctx, (char *)hdr, want, offt);
+      if (n < 8)
+        throw Error("Entry data is truncated");
+      uint32_t magic = le32(hdr);
+      if ((magic & 0xfffffff0) == SKIP_MAGIC) {
+        offt += 8 + (int64_t)le32(hdr + 4);
+        continue;
+      }
+      if (magic != MAGIC)
+        throw Error();
+      unsigned long long content = ZSTD_getFrameContentSize(hdr, n);
+      if (content == ZSTD_CONTENTSIZE_ERROR)
+        throw Error();
+      if (content == ZSTD_CONTENTSIZE_UNKNOWN) {
+        sized = false;
+        return;
+      }
+      memory = std::max(memory, frame_memory(hdr, n));
+      bool checksum = hdr[4] & 4;
+      Frame f = {offt, 0, out_size, (int64_t)content};
+      offt += header_size(hdr[4]);
+      for (;;) {
+        unsigned char b[3];
+        if (read(ctx, (char *)b, 3, offt) != 3)
+          throw Error("Entry data is truncated");
+        uint32_t bh = b[0] | b[1] << 8 | b[2] << 16;
+        int type = (bh >> 1) & 3;
+        if (type == 3)
+          throw Error();
+        offt += 3 + (type == 1 ? 1 : bh >> 3);
+        if (bh & 1)
+          break;
+      }
+      if (checksum)
+        offt += 4;
+      f.in_size = offt - f.in;
+      frames.push_back(f);
+      out_size += f.out_size;
+    }
+    if (offt != size)
+      throw Error("Entry data is truncated");
+  }
+
+  // Decodes the frames in [in, in_end) of the compressed data, which start
+  // at out in the output. The CRC of the output goes to *crc_out. Returns
+  // false if sink stopped it. buf is BUFSIZE bytes to work in, or nullptr to
+  // take them from the MemoryPool. window is the decoder's memory, already
+  // charged, or nullptr to charge it as each frame starts.
+  static bool decode(read_fn read, void *rctx, int64_t in, int64_t in_end,
+                     int64_t out, sink_fn sink, void *sctx, uint32_t *crc_out,
+                     PoolBuffer *buf = nullptr, PoolCharge *window = nullptr) {
+    Trace::Scope ts("ZstdFrames::decode");
+    PoolCharge own_window;
+    bool charge = window == nullptr;
+    PoolBuffer own;
+    if (buf == nullptr) {
+      own.reset(BUFSIZE);
+      buf = &own;
+    }
+    char *ibuf = buf->get();
+    char *obuf = ibuf + CHUNK;
+    ZSTD_DCtx *d = ZSTD_createDCtx();
+    if (d == nullptr)
+      throw Error("Out of memory");
+    ZSTD_DCtx_setParameter(d, ZSTD_d_windowLogMax, WINDOW_LOG_MAX);
+    ZSTD_inBuffer i = {ibuf, 0, 0};
+    uint32_t c = 0;
+    size_t left = 0;
+    bool frame_start = true;
+    try {
+      for (;;) {
+        if (i.pos == i.size and in < in_end) {
+          int64_t want = std::min<int64_t>(CHUNK, in_end - in);
+          if (read(rctx, ibuf, want, in) != want)
+            throw Error("Entry data is truncated");
+          i.size = want;
+          i.pos = 0;
+          in += want;
+        }
+        if (charge and frame_start and i.pos < i.size) {
+          // the header is looked at where it was read, so pipes work too
+          size_t need = frame_memory((unsigned char *)ibuf + i.pos,
+                                     i.size - i.pos);
+          if (need > own_window.bytes)
+            own_window.set(need);
+          frame_start = false;
+        }
+        ZSTD_outBuffer o = {obuf, CHUNK, 0};
+        size_t used = i.pos;
+        size_t r = ZSTD_decompressStream(d, &o, &i);
+        if (ZSTD_isError(r))
+          throw Error(std::string("Entry data is corrupt: ") +
+                      ZSTD_getErrorName(r));
+        frame_start = r == 0;
+        // once all input is used and nothing more comes out, it's done; left
+        // is 0 if that was at the end of a frame
+        if (i.pos == used and o.pos == 0)
+          break;
+        left = r;
+        if (o.pos != 0) {
+          c = crc32_update(c, obuf, o.pos);
+          if (!sink(sctx, obuf, o.pos, out)) {
+            ZSTD_freeDCtx(d);
+            return false;
+          }
+          out += o.pos;
+        }
+      }
+    } catch (...) {
+      ZSTD_freeDCtx(d);
+      throw;
+    }
+    ZSTD_freeDCtx(d);
+    if (left != 0 or i.pos != i.size or in != in_end)
+      throw Error("Entry data is truncated");
+    *crc_out = c;
+    return true;
+  }
+
+  // Decodes all of it. With sized frames the frames are spread over up to
+  // threads threads in runs of about the same output size, each run writing
+  // its own part of the output; sink is called from all of them. Otherwise
+  // it's decoded on this thread. The CRC of the output goes to *crc_out.
+  // There are only as many threads as the MemoryPool has buffers and
+  // decoder memory for.
+  bool decode_all(read_fn read, void *rctx, unsigned threads, sink_fn sink,
+                  void *sctx, uint32_t *crc_out) const {
+    size_t n = std::min<size_t>(threads, frames.size());
+    if (!sized or n <= 1)
+      return decode(read, rctx, 0, in_size, 0, sink, sctx, crc_out);
+    std::vector<PoolCharge> windows(n);
+    windows[0].set(memory);
+    std::vector<PoolBuffer> bufs(1);
+    bufs[0].reset(BUFSIZE);
+    while (bufs.size() < n) {
+      PoolBuffer b;
+      if (!windows[bufs.size()].try_set(memory) or !b.try_reset(BUFSIZE))
+        break;
+      bufs.push_back(std::move(b));
+    }
+    n = bufs.size();
+    for (size_t k = n; k < windows.size(); k++)
+      windows[k].set(0);
+    if (n == 1)
+      return decode(read, rctx, 0, in_size, 0, sink, sctx, crc_out, &bufs[0],
+                    &windows[0]);
+    std::vector<size_t> first = {0};
+    for (size_t i = 0, k = 1; k < n; k++) {
+      int64_t until = out_size / (int64_t)n * (int64_t)k;
+      while (i < frames.size() and frames[i].out < until)
+        i++;
+      if (i >= frames.size())
+        break;
+      if (i != first.back())
+        first.push_back(i);
+    }
+    size_t runs = first.size();
+    std::vector<uint32_t> crcs(runs);
+    std::vector<std::exception_ptr> errors(runs);
+    std::atomic<bool> stopped{false};
+    auto end_of = [&](size_t k) {
+      return k + 1 < runs ? frames[first[k + 1]].in : in_size;
+    };
+    auto run = [&](size_t k) {
+      try {
+        const Frame &f = frames[first[k]];
+        if (!decode(read, rctx, f.in, end_of(k), f.out, sink, sctx, &crcs[k],
+                    &bufs[k], &windows[k]))
+          stopped = true;
+      } catch (...) {
+        errors[k] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t k = 1; k < runs; k++)
+      workers.emplace_back(run, k);
+    run(0);
+    for (auto &w : workers)
+      w.join();
+    for (auto &e : errors) {
+      if (e)
+        std::rethrow_exception(e);
+    }
+    if (stopped)
+      return false;
+    uint32_t c = crcs[0];
+    for (size_t k = 1; k < runs; k++) {
+      int64_t out_end = k + 1 < runs ? frames[first[k + 1]].out : out_size;
+      c = crc32_merge(c, crcs[k], out_end - frames[first[k]].out);
+    }
+    *crc_out = c;
+    return true;
+  }
+};